@@ -1,560 +1,1668 @@
-/*
- *  PLY.cpp
- *  PointProcessing
- *
- *  Created by Renato Pajarola on Wed Nov 05 2003.
- *  Copyright (c) 2003 __MyCompanyName__. All rights reserved.
- *
- */
-
-#include <stdlib.h>
-#include <string.h>
-#include <float.h>
-#include <math.h>
-
-#ifdef WIN32
-#include <windows.h>
-#endif
-
-#ifdef __APPLE__
-#include <glut/glut.h>
-#else
-#include <GL/glut.h>
-#endif
-
-#include "PLY.h"
-#include "geometry.h"
-
-extern int light;
-
-// Light and other info
-extern Vector3f light_pos, viewer_pos;
-extern Vector4f light_color, black_color, ambient_light;
-
-// Material properties
-GLfloat ambient[4] = {0.2, 0.2, 0.2, 1.0};
-GLfloat diffuse[4] = {0.7, 0.7, 1.0, 1.0};
-GLfloat specular[4] = {0.5, 0.5, 0.5, 1.0};
-GLfloat shininess[1] = {5.0};
-
-
-PLYObject::PLYObject(FILE *in)
-{
-  int i;
-
-  nproperties = 0;
-  hasnormal = hastexture = false;
-
-  nv = nf = 0;
-
-  vertices = NULL;
-  normals = NULL;
-  colors = NULL;
-  texcoords = NULL;
-  faces = NULL;
-
-  // init bounding box
-  for (i = 0; i < 3; i++) {
-    min[i] = FLT_MAX;
-    max[i] = -FLT_MAX;
-  }
-
-  // default order
-  for (i = 0; i < 11; i++)
-    order[i] = -1;
-
-  if (!checkHeader(in)) {
-    fprintf(stderr, "Error: could not read PLY file.\n");
-    return;
-  }
-
-  vertices = (Vector3f*)calloc(nv, sizeof(Vector3f));
-  normals  = (Vector3f*)calloc(nv, sizeof(Vector3f));
-  colors   = (Color3u*)calloc(nv, sizeof(Color3u));
-  if (hastexture)
-    texcoords = (Texture2f*)calloc(nv, sizeof(Texture2f));
-
-  faces    = (Index3i*)calloc(nf, sizeof(Index3i));
-  fnormals = (Vector3f*)calloc(nf, sizeof(Vector3f));
-
-  readVertices(in);
-  readFaces(in);
-}
-
-
-PLYObject::~PLYObject()
-{
-  // delete all allocated arrays
-
-  if (vertices)
-    free(vertices);
-  if (normals)
-    free(normals);
-  if (colors)
-    free(colors);
-  if (texcoords)
-    free(texcoords);
-  if (faces)
-    free(faces);
-}
-
-
-bool PLYObject::checkHeader(FILE *in)
-{
-  char buf[128], type[128], c[32];
-  int i;
-
-  // read ply file header
-  fscanf(in, "%s\n", buf);
-  if (strcmp(buf, "ply") != 0) {
-    fprintf(stderr, "Error: Input file is not of .ply type.\n");
-    return false;
-  }
-  fgets(buf, 128, in);
-  if (strncmp(buf, "format ascii", 12) != 0) {
-    fprintf(stderr, "Error: Input file is not in ASCII format.\n");
-    return false;
-  }
-
-  fgets(buf, 128, in);
-  while (strncmp(buf, "comment", 7) == 0)
-    fgets(buf, 128, in);
-
-  // read number of vertices
-  if (strncmp(buf, "element vertex", 14) == 0)
-    sscanf(buf, "element vertex %d\n", &nv);
-  else {
-    fprintf(stderr, "Error: number of vertices expected.\n");
-    return false;
-  }
-
-  // read vertex properties order
-  i = 0;
-  fgets(buf, 128, in);
-  while (strncmp(buf, "property", 8) == 0) {
-    sscanf(buf, "property %s %s\n", type, c);
-    if (strncmp(c, "x", 1) == 0)
-      order[0] = i;
-    else if (strncmp(c, "y", 1) == 0)
-      order[1] = i;
-    else if (strncmp(c, "z", 1) == 0)
-      order[2] = i;
-
-    else if (strncmp(c, "nx", 2) == 0)
-      order[3] = i;
-    else if (strncmp(c, "ny", 2) == 0)
-      order[4] = i;
-    else if (strncmp(c, "nz", 2) == 0)
-      order[5] = i;
-
-    else if (strncmp(c, "red", 3) == 0)
-      order[6] = i;
-    else if (strncmp(c, "green", 5) == 0)
-      order[7] = i;
-    else if (strncmp(c, "blue", 4) == 0)
-      order[8] = i;
-
-    else if (strncmp(c, "tu", 2) == 0)
-      order[9] = i;
-    else if (strncmp(c, "tv", 2) == 0)
-      order[10] = i;
-
-    i++;
-    fgets(buf, 128, in);
-  }
-  nproperties = i;
-
-  for (i = 0; i < 3; i++) {
-    if (order[i] < 0) {
-      fprintf(stderr, "Error: not enough vertex coordinate fields (nx, ny, nz).\n");
-      return false;
-   }
-  }
-  hasnormal = true;
-  for (i = 3; i < 6; i++)
-    if (order[i] < 0)
-      hasnormal = false;
-  hascolor = true;
-  for (i = 6; i < 9; i++)
-    if (order[i] < 0)
-      hascolor = false;
-  hastexture = true;
-  for (i = 9; i < 11; i++)
-    if (order[i] < 0)
-      hastexture = false;
-
-  if (!hasnormal)
-    fprintf(stderr, "Warning: no normal coordinates used from file.\n");
-  if (!hascolor)
-    fprintf(stderr, "Warning: no color used from file.\n");
-  if (!hastexture)
-    fprintf(stderr, "Warning: no texture coordinates used from file.\n");
-
-  // number of faces and face properties
-  if (strncmp(buf, "element face", 12) == 0)
-    sscanf(buf, "element face %d\n", &nf);
-  else {
-    fprintf(stderr, "Error: number of faces expected.\n");
-    return false;
-  }
-
-  fgets(buf, 128, in);
-  if (strncmp(buf, "property list", 13) != 0) {
-    fprintf(stderr, "Error: property list expected.\n");
-    return false;
-  }
-
-  fgets(buf, 128, in);
-  while (strncmp(buf, "end_header", 10) != 0)
-    fgets(buf, 128, in);
-
-  return true;
-}
-
-
-void PLYObject::readVertices(FILE *in)
-{
-  char buf[128];
-  int i, j;
-  float values[32];
-
-  // read in vertex attributes
-  for (i = 0; i < nv; i++) {
-    fgets(buf, 128, in);
-    sscanf(buf,"%f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f", &values[0], &values[1], &values[2], &values[3],
-            &values[4], &values[5], &values[6], &values[7], &values[8], &values[9], &values[10], &values[11],
-           &values[12], &values[13], &values[14], &values[15]);
-
-    for (j = 0; j < 3; j++)
-      vertices[i][j] = values[order[j]];
-    if (hasnormal)
-      for (j = 0; j < 3; j++)
-        normals[i][j] = values[order[3+j]];
-    if (hascolor)
-      for (j = 0; j < 3; j++)
-        colors[i][j] = (unsigned char)values[order[6+j]];
-    if (hastexture)
-      for (j = 0; j < 2; j++)
-        texcoords[i][j] = values[order[9+j]];
-
-    for (j = 0; j < 3; j++) {
-      if (vertices[i][j] < min[j])
-        min[j] = vertices[i][j];
-      if (vertices[i][j] > max[j])
-        max[j] = vertices[i][j];
-    }
-  }
-}
-
-
-void PLYObject::readFaces(FILE *in)
-{
-  char buf[128];
-  int i, j, k;
-
-  // read in face connectivity
-  for (i = 0; i < nf; i++) {
-    fgets(buf, 128, in);
-    sscanf(buf, "%d %d %d %d", &k, &faces[i][0], &faces[i][1], &faces[i][2]);
-    if (k != 3) {
-      fprintf(stderr, "Error: not a triangular face.\n");
-      exit(1);
-    }
-    // set up face normal
-    normal(fnormals[i], vertices[faces[i][0]], vertices[faces[i][1]], vertices[faces[i][2]]);
-
-    // accumulate normal information of each vertex
-    if (!hasnormal)
-      for (j = 0; j < 3; j++)
-        for (k = 0; k < 3; k++)
-          normals[faces[i][j]][k] += fnormals[i][k];
-  }
-  if (!hasnormal)
-    for (i = 0; i < nv; i++)
-      normalize(normals[i]);
-  hasnormal = true;
-}
-
-
-void PLYObject::resize()
-{
-  int i;
-  float minx, miny, minz, maxx, maxy, maxz;
-  float size, scale;
-
-  // get bounding box
-  minx = miny = minz = FLT_MAX;
-  maxx = maxy = maxz = -FLT_MAX;
-  for (i = 0; i <nv; i++) {
-    if (vertices[i][0] < minx)
-      minx = vertices[i][0];
-    if (vertices[i][0] > maxx)
-      maxx = vertices[i][0];
-
-    if (vertices[i][1] < miny)
-      miny = vertices[i][1];
-    if (vertices[i][1] > maxy)
-      maxy = vertices[i][1];
-
-    if (vertices[i][2] < minz)
-      minz = vertices[i][2];
-    if (vertices[i][2] > maxz)
-      maxz = vertices[i][2];
-  }
-
-  // rescale vertex coordinates to be in [-1,1]
-  size = 0.0;
-  if (size < maxx-minx)
-    size = maxx-minx;
-  if (size < maxy-miny)
-    size = maxy-miny;
-  if (size < maxz-minz)
-    size = maxz-minz;
-  scale = 2.0 / size;
-  for (i = 0; i < nv; i++) {
-    vertices[i][0] = scale * (vertices[i][0] - minx) - 1.0;
-    vertices[i][1] = scale * (vertices[i][1] - miny) - 1.0;
-    vertices[i][2] = scale * (vertices[i][2] - minz) - 1.0;
-  }
-}
-
-void PLYObject::invertNormals()
-{
-  int i, tmp;
-
-  for (i = 0; i < nv; i++)
-    scale(normals[i], -1.0);
-  for (i = 0; i < nf; i++) {
-    scale(fnormals[i], -1.0);
-    tmp = faces[i][0];
-    faces[i][0] = faces[i][2];
-    faces[i][2] = tmp;
-  }
-}
-
-
-void PLYObject::draw()
-{
-
-  // setup default material
-  glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-  glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
-  glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, specular);
-  glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
-  glColor3fv(diffuse);
-
-  // set lighting if enabled
-	// Otherwise, compute colors
-  if (light)
-		{
-			glEnable(GL_LIGHTING);
-		}
-  else
-		{
-
-			glDisable(GL_LIGHTING);
-			for (int v=0; v<nv; v++)
-				{
-					// Instead of this, use the Phong illumination equation to find the color
-
-                    // Phong equation with attenuation factor att
-                    // If = (As*Am) + ((Al*Am) + Id + Is) * att
-
-                    // Get ModelView
-
-                    float M[16];
-                    Matrix4f modelViewMatrix;
-
-                    glGetFloatv(GL_MODELVIEW_MATRIX, M);
-                    for (int i = 0; i < 3; i++) {
-                        modelViewMatrix[i][3] = 0.0;
-                        modelViewMatrix[3][i] = 0.0;
-                        for (int j = 0; j < 3; j++) {
-                            modelViewMatrix[i][j] = M[i*4+j];
-                        }
-                    }
-                    modelViewMatrix[3][3] = 1.0;
-
-                    // ModelView is already here in a Matrix4f for operations
-
-                    Vector3f vVertex;
-                    multVector(vVertex, modelViewMatrix, vertices[v]);
-
-                    Vector4f lightSource;
-                    copy(lightSource, light_pos);
-                    //glGetLightfv(GL_LIGHT0, GL_POSITION, lightSource);
-
-                    Vector3f lightDir;
-                    sub(lightDir, lightSource, vVertex);
-
-                    float d = length(lightDir);
-
-                    // Get parameters for the ambient part
-                    float Al[4] = {0.0f, 0.0f, 0.0f, 0.0f };
-                    glGetLightfv( GL_LIGHT0, GL_AMBIENT, Al );
-
-                    Vector4f As = {0.0f, 0.0f, 0.0f, 0.0f };
-                    glGetFloatv( GL_LIGHT_MODEL_AMBIENT, As );
-
-                    float Dl[4] = {0.0f, 0.0f, 0.0f, 0.0f };
-                    glGetLightfv( GL_LIGHT0, GL_DIFFUSE, Dl );
-
-                    float Sl[4] = {0.0f, 0.0f, 0.0f, 0.0f };
-                    glGetLightfv( GL_LIGHT0, GL_SPECULAR, Sl );
-
-                    Vector4f Am = {0.0f, 0.0f, 0.0f, 0.0f };
-                    copy(Am, ambient);
-
-                    float Dm[4] = {0.0f, 0.0f, 0.0f, 0.0f };
-                    copy(Dm, diffuse);
-
-                    float Sm[4] = {0.0f, 0.0f, 0.0f, 0.0f };
-                    copy(Sm, specular);
-
-                    float f = shininess[0];  // copy shininess
-
-                    float constantAttenuation = 0.0f;
-                    glGetLightfv( GL_LIGHT0, GL_CONSTANT_ATTENUATION, &constantAttenuation);
-
-                    float linearAttenuation = 0.0f;
-                    glGetLightfv( GL_LIGHT0, GL_LINEAR_ATTENUATION , &linearAttenuation );
-
-                    float quadraticAttenuation = 0.0f;
-                    glGetLightfv( GL_LIGHT0, GL_QUADRATIC_ATTENUATION , &quadraticAttenuation);
-
-                    float att = (constantAttenuation +
-                                (linearAttenuation*d) +
-                                (quadraticAttenuation*d*d) );
-
-					// Start the phong equation with the ambient component
-					Vector4f temp1;
-					multVectors4(temp1, As, Am);
-					Vector4f temp2;
-                    multVectors4(temp2, Al, Am);
-                    scale4(temp2, att);
-					Vector4f final_color;
-					//final_color = (As * Am) + (Al * Am)*att;
-					add(final_color, temp1, temp2);
-
-                    // Calculate lambertTerm
-                    Vector3f N;
-                    normalizeVector(N, normals[v]);
-                    Vector3f L;
-                    normalizeVector(L, lightDir);
-
-                    float lambertTerm = dotProd(N,L);
-
-                    if (lambertTerm > 0.0){
-                        // diffuse component
-                        multVectors4(temp1,Dl,Dm);
-                        scale4(temp1,lambertTerm);
-                        add(final_color, final_color, temp1);
-
-                        // specular component
-                        Vector3f E;
-                        normalizeVector(E,viewer_pos);
-                        Vector3f R;
-                        scale4(temp1,lambertTerm*2,N);
-                        sub(R, temp1, L); // reflect(-L,N)
-
-                        float dotProduct = dotProd(R,E);
-                        float specular_factor;
-                        if(dotProduct > 0.0){
-                            specular_factor = pow(dotProduct, f);
-                        } else {
-                            specular_factor = 0; // pow(0.0, f);
-                        }
-
-                        multVectors4(temp1, Sl, Sm);
-                        scale4(temp1, specular_factor*att, temp1);
-                        add(final_color, final_color, temp1);
-                        // printf("DM are %f , %f and %f", final_color[0], final_color[1], final_color[2]);
-                    }
-
-
-                    //Colors [v][i] should take the colors of final_color, how?
-                    colors[v][0] = final_color[0]*255;
-                    colors[v][1] = final_color[1]*255;
-                    colors[v][2] = final_color[2]*255;
-				}
-		}
-
-	// Now do the actual drawing of the model
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-  glBegin(GL_TRIANGLES);
-
-  for (int i = 0; i < nf; i++)
-    {
-      for (int j = 0; j < 3; j++)
-        {
-            glColor3ubv((GLubyte*)colors[faces[i][j]]);
-            glNormal3fv(normals[faces[i][j]]);	// vertex normal
-            glVertex3fv(vertices[faces[i][j]]);	// vertex coordinates
-        }
-    }
-  glEnd();
-
-  glDisable(GL_POLYGON_OFFSET_FILL);
-  if (hascolor)
-    glDisable(GL_COLOR_MATERIAL);
-}
-
-
-
-
-void PLYObject::eat()
-{
-  float scale = 0.01;
-
-  /* Jitter each vertex */
-  for(int i=0 ; i<nv ;i++)
-    for(int j=0 ; j<3 ; j++)
-      {
-        vertices[i][j] += scale*normals[i][j];
-      }
-}
-
-
-void PLYObject::starve()
-{
-  float scale = -0.01;
-
-  /* Jitter each vertex */
-  for(int i=0 ; i<nv ;i++)
-    for(int j=0 ; j<3 ; j++)
-      {
-        vertices[i][j] += scale*normals[i][j];
-      }
-}
-
-
-void PLYObject::dance()
-{
-  /* This creates a random vector */
-  Vector3f randomvector;
-  randomvector[0] = rangerand(-0.1, 0.1, 30);
-  randomvector[1] = rangerand(-0.1, 0.1, 30);
-  randomvector[2] = rangerand(-0.1, 0.1, 30);
-
-
-  /* Insert code here to add randomvector to all vertices in the PLYObject */
-  /* Iterate over all the vertices and add randomvector to each one. */
-  /* The vertex positions are stored in the array called 'vertices' */
-
-	for (int v=0 ; v<nv ; v++)
-		{
-			vertices[v][0] += randomvector[0];
-			vertices[v][1] += randomvector[1];
-			vertices[v][2] += randomvector[2];
-		}
-
-}
-
-
-
-/* A not too good pseudo-random number generator */
-/* Returns a pseudo-random number between min and max */
-double PLYObject::rangerand(double min, double max, long steps)
-{
-  return min + ((rand() % steps) * (max - min)) / steps;
-}
+/*
+ *  PLY.cpp
+ *  PointProcessing
+ *
+ *  Created by Renato Pajarola on Wed Nov 05 2003.
+ *  Copyright (c) 2003 __MyCompanyName__. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "PLY.h"
+#include "geometry.h"
+#include "lighting.h"
+#include "threadPool.h"
+#include "simd.h"
+#include "plyTokenizer.h"
+#include "meshOptimizer.h"
+#include "simplify.h"
+#include "profiler.h"
+#include "bvh.h"
+#include "occlusion.h"
+
+// Material properties, also set for OpenGL by draw()
+float ambient[4] = {0.2, 0.2, 0.2, 1.0};
+float diffuse[4] = {0.7, 0.7, 1.0, 1.0};
+float specular[4] = {0.5, 0.5, 0.5, 1.0};
+float shininess[1] = {5.0};
+
+
+void setMaterialLighting(LightingContext &ctx, const Vector4f As, const LightList &lights)
+{
+  setLightingProducts(ctx, As, lights, ambient, diffuse, specular);
+  ctx.shininess = shininess[0];
+}
+
+
+PLYObject::PLYObject()
+{
+  init();
+}
+
+
+PLYObject::PLYObject(FILE *in)
+{
+  init();
+
+  if (!checkHeader(in)) {
+    fprintf(stderr, "Error: could not read PLY file.\n");
+    return;
+  }
+
+  allocate(true);
+  readVertices(in);
+  readFaces(in);
+}
+
+
+PLYObject::PLYObject(const char *filename, bool useCache)
+{
+  init();
+  load(filename, useCache);
+}
+
+
+PLYObject::PLYObject(PLYObject &&other)
+{
+  init();
+  swap(other);
+}
+
+
+PLYObject &PLYObject::operator=(PLYObject &&other)
+{
+  // other takes the old mesh along and frees it when it goes
+  swap(other);
+  return *this;
+}
+
+
+void PLYObject::swap(PLYObject &other)
+{
+  std::swap(static_cast<PLYData&>(*this), static_cast<PLYData&>(other));
+}
+
+
+bool PLYObject::load(const char *filename, bool useCache)
+{
+  FILE *in;
+  long offset;
+
+  release();
+  clear();
+
+  // a valid cache saves the parsing, the normals and the resize
+  if (useCache && readCache(filename))
+    return true;
+
+  if (!(in = fopen(filename, "rb"))) {
+    fprintf(stderr, "Cannot open input file %s.\n", filename);
+    return false;
+  }
+  if (!checkHeader(in)) {
+    fprintf(stderr, "Error: could not read PLY file.\n");
+    nv = nf = 0;
+    fclose(in);
+    return false;
+  }
+
+  // parse from a mapping of the file, or from the stream if that fails
+  offset = ftell(in);
+  if (mapFile(mapping, filename))
+    readMapped(offset);
+  else {
+    allocate(true);
+    readVertices(in);
+    readFaces(in);
+  }
+  fclose(in);
+  return true;
+}
+
+
+// Everything that outlives a single mesh: the thread pool, the arena
+// block, the shading streams and the GL buffers
+void PLYObject::init()
+{
+  int i;
+
+  pool = new ThreadPool();
+  initArena(arena);
+  initShadingStreams(streams);
+  initMappedFile(mapping);
+  vboMode = -1;
+  bufferRelease = NULL;
+  for (i = 0; i < VBO_COUNT; i++)
+    vbo[i] = 0;
+  vfStart = vfFaces = NULL;
+  lodFaces = NULL;
+  bvh = NULL;
+  shadow = NULL;
+  occlusion = NULL;
+  bake = NULL;
+
+  clear();
+}
+
+
+// the state of an empty mesh, after release()
+void PLYObject::clear()
+{
+  int i;
+
+  nproperties = 0;
+  lineno = 0;
+  hasnormal = hascolor = hastexture = false;
+
+  nv = nf = 0;
+
+  vertices = NULL;
+  mappedVertices = false;
+  mappedCache = false;
+  cached = false;
+  normals = NULL;
+  colors = NULL;
+  texcoords = NULL;
+  faces = NULL;
+  fnormals = NULL;
+
+  positionStamp = normalStamp = faceStamp = colorStamp = 1;
+  // buffers and streams may still hold the data of an earlier mesh
+  for (i = 0; i < VBO_COUNT; i++)
+    vboStamps[i] = 0;
+  streamsPositionStamp = streamsNormalStamp = 0;
+  adjacencyStamp = 0;
+  nlods = 1;
+  lodFirst[0] = lodCount[0] = 0;
+  lodStamp = 1;
+  lod = 0;
+  radius = 0.0;
+  bvhPositionStamp = 0;
+  culled = false;
+  picked = -1;
+  normalWeighting = NORMALS_UNIFORM;
+  colorsPositionStamp = colorsNormalStamp = 0;
+  occlusionStamp = 1;
+  colorsOcclusionStamp = 0;
+  colorsEpoch = 0;
+  shadedVertices = 0;
+  shadowPositionStamp = shadowNormalStamp = shadowFaceStamp = 0;
+  shadowEpoch = 0;
+  for (i = 0; i < 3; i++)
+    shadowLight[i] = 0.0;
+  releasedBytes = 0;
+
+  // init bounding box
+  for (i = 0; i < 3; i++) {
+    min[i] = FLT_MAX;
+    max[i] = -FLT_MAX;
+  }
+
+  // default order
+  for (i = 0; i < 11; i++)
+    order[i] = -1;
+}
+
+
+// Give back the current mesh. The arena is only reset, its block stays
+// for the next mesh.
+void PLYObject::release()
+{
+  free(vfStart);
+  free(vfFaces);
+  free(lodFaces);
+  free(shadow);
+  delete bake;
+  free(occlusion);
+  delete bvh;
+  vfStart = vfFaces = NULL;
+  lodFaces = NULL;
+  bvh = NULL;
+  shadow = NULL;
+  bake = NULL;
+  occlusion = NULL;
+  resetArena(arena);
+  unmapFile(mapping);
+}
+
+
+void PLYObject::allocate(bool withVertices)
+{
+  size_t vbytes = nv * sizeof(Vector3f), fbytes = nf * sizeof(Index3i);
+  size_t size = arenaSize(vbytes) + arenaSize(nv * sizeof(Color3u)) + arenaSize(fbytes)
+    + arenaSize(nf * sizeof(Vector3f));
+
+  // one block for all arrays, every one starting on a cache line: the
+  // shading threads write colors in 64 vertex chunks and the SIMD
+  // kernels load the others aligned
+  if (withVertices)
+    size += arenaSize(vbytes);
+  if (hastexture)
+    size += arenaSize(nv * sizeof(Texture2f));
+  if (!reserveArena(arena, size)) {
+    fprintf(stderr, "Error: no memory for %d vertices and %d faces.\n", nv, nf);
+    exit(1);
+  }
+
+  if (withVertices)
+    vertices = (Vector3f*)arenaAlloc(arena, vbytes);
+  normals  = (Vector3f*)arenaAlloc(arena, vbytes);
+  colors   = (Color3u*)arenaAlloc(arena, nv * sizeof(Color3u));
+  if (hastexture)
+    texcoords = (Texture2f*)arenaAlloc(arena, nv * sizeof(Texture2f));
+
+  faces    = (Index3i*)arenaAlloc(arena, fbytes);
+  fnormals = (Vector3f*)arenaAlloc(arena, nf * sizeof(Vector3f));
+
+}
+
+
+PLYObject::~PLYObject()
+{
+  // the mesh arrays go with the arena or the mapping
+  release();
+  freeArena(arena);
+  freeShadingStreams(streams);
+  if (bufferRelease)
+    bufferRelease(this);
+  delete pool;
+}
+
+
+// size in bytes of the PLY property types
+static const int typeSize[] = {1, 1, 2, 2, 4, 4, 4, 8};
+
+
+// map a PLY type name (old and new style) to its type, -1 if unknown
+static int propertyType(const char *name)
+{
+  static const char *names[][2] = {
+    {"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+    {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}
+  };
+
+  for (int t = 0; t < 8; t++)
+    if (strcmp(name, names[t][0]) == 0 || strcmp(name, names[t][1]) == 0)
+      return t;
+  return -1;
+}
+
+
+static bool hostLittleEndian()
+{
+  unsigned int one = 1;
+  return *(unsigned char*)&one == 1;
+}
+
+
+// decode one binary value of the given type, swapping its bytes if needed
+static double decodeValue(const unsigned char *p, int type, bool swap)
+{
+  unsigned char b[8];
+
+  if (swap) {
+    for (int i = 0; i < typeSize[type]; i++)
+      b[i] = p[typeSize[type]-1-i];
+    p = b;
+  }
+
+  switch (type) {
+  case PLY_CHAR:   { signed char v;    memcpy(&v, p, 1); return v; }
+  case PLY_UCHAR:  { unsigned char v;  memcpy(&v, p, 1); return v; }
+  case PLY_SHORT:  { short v;          memcpy(&v, p, 2); return v; }
+  case PLY_USHORT: { unsigned short v; memcpy(&v, p, 2); return v; }
+  case PLY_INT:    { int v;            memcpy(&v, p, 4); return v; }
+  case PLY_UINT:   { unsigned int v;   memcpy(&v, p, 4); return v; }
+  case PLY_FLOAT:  { float v;          memcpy(&v, p, 4); return v; }
+  default:         { double v;         memcpy(&v, p, 8); return v; }
+  }
+}
+
+
+// fgets that keeps count of the lines read
+char *PLYObject::readLine(char *buf, int size, FILE *in)
+{
+  lineno++;
+  return fgets(buf, size, in);
+}
+
+
+bool PLYObject::checkHeader(FILE *in)
+{
+  PROFILE_SCOPE("checkHeader");
+  char buf[128], type[128], c[32], itype[32];
+  int i, t;
+
+  // read ply file header
+  fscanf(in, "%s\n", buf);
+  lineno = 1;
+  if (strcmp(buf, "ply") != 0) {
+    fprintf(stderr, "Error: Input file is not of .ply type.\n");
+    return false;
+  }
+  readLine(buf, 128, in);
+  if (strncmp(buf, "format ascii", 12) == 0)
+    format = PLY_ASCII;
+  else if (strncmp(buf, "format binary_little_endian", 27) == 0)
+    format = PLY_BINARY_LE;
+  else if (strncmp(buf, "format binary_big_endian", 24) == 0)
+    format = PLY_BINARY_BE;
+  else {
+    fprintf(stderr, "Error: Input file is neither in ASCII nor in binary format.\n");
+    return false;
+  }
+
+  readLine(buf, 128, in);
+  while (strncmp(buf, "comment", 7) == 0 || strncmp(buf, "obj_info", 8) == 0)
+    readLine(buf, 128, in);
+
+  // read number of vertices
+  if (strncmp(buf, "element vertex", 14) == 0)
+    sscanf(buf, "element vertex %d\n", &nv);
+  else {
+    fprintf(stderr, "Error: number of vertices expected.\n");
+    return false;
+  }
+
+  // read vertex properties order
+  i = 0;
+  vsize = 0;
+  readLine(buf, 128, in);
+  while (strncmp(buf, "property", 8) == 0) {
+    sscanf(buf, "property %s %s\n", type, c);
+    if (i == PLY_MAX_PROPERTIES) {
+      fprintf(stderr, "Error: more than %d vertex properties.\n", PLY_MAX_PROPERTIES);
+      return false;
+    }
+    if ((t = propertyType(type)) < 0) {
+      fprintf(stderr, "Error: unknown vertex property type %s.\n", type);
+      return false;
+    }
+    vtypes[i] = t;
+    vsize += typeSize[t];
+
+    if (strncmp(c, "x", 1) == 0)
+      order[0] = i;
+    else if (strncmp(c, "y", 1) == 0)
+      order[1] = i;
+    else if (strncmp(c, "z", 1) == 0)
+      order[2] = i;
+
+    else if (strncmp(c, "nx", 2) == 0)
+      order[3] = i;
+    else if (strncmp(c, "ny", 2) == 0)
+      order[4] = i;
+    else if (strncmp(c, "nz", 2) == 0)
+      order[5] = i;
+
+    else if (strncmp(c, "red", 3) == 0)
+      order[6] = i;
+    else if (strncmp(c, "green", 5) == 0)
+      order[7] = i;
+    else if (strncmp(c, "blue", 4) == 0)
+      order[8] = i;
+
+    else if (strncmp(c, "tu", 2) == 0)
+      order[9] = i;
+    else if (strncmp(c, "tv", 2) == 0)
+      order[10] = i;
+
+    i++;
+    readLine(buf, 128, in);
+  }
+  nproperties = i;
+
+  for (i = 0; i < 3; i++) {
+    if (order[i] < 0) {
+      fprintf(stderr, "Error: not enough vertex coordinate fields (nx, ny, nz).\n");
+      return false;
+   }
+  }
+  hasnormal = true;
+  for (i = 3; i < 6; i++)
+    if (order[i] < 0)
+      hasnormal = false;
+  hascolor = true;
+  for (i = 6; i < 9; i++)
+    if (order[i] < 0)
+      hascolor = false;
+  hastexture = true;
+  for (i = 9; i < 11; i++)
+    if (order[i] < 0)
+      hastexture = false;
+
+  if (!hasnormal)
+    fprintf(stderr, "Warning: no normal coordinates used from file.\n");
+  if (!hascolor)
+    fprintf(stderr, "Warning: no color used from file.\n");
+  if (!hastexture)
+    fprintf(stderr, "Warning: no texture coordinates used from file.\n");
+
+  // number of faces and face properties
+  if (strncmp(buf, "element face", 12) == 0)
+    sscanf(buf, "element face %d\n", &nf);
+  else {
+    fprintf(stderr, "Error: number of faces expected.\n");
+    return false;
+  }
+
+  readLine(buf, 128, in);
+  if (strncmp(buf, "property list", 13) != 0) {
+    fprintf(stderr, "Error: property list expected.\n");
+    return false;
+  }
+  sscanf(buf, "property list %s %s", type, itype);
+  fcounttype = propertyType(type);
+  findextype = propertyType(itype);
+  if (fcounttype < 0 || findextype < 0 || fcounttype == PLY_FLOAT || fcounttype == PLY_DOUBLE
+      || findextype == PLY_FLOAT || findextype == PLY_DOUBLE) {
+    fprintf(stderr, "Error: face list of integer types expected.\n");
+    return false;
+  }
+
+  // further scalar face properties are skipped when reading
+  fextrasize = 0;
+  readLine(buf, 128, in);
+  while (strncmp(buf, "end_header", 10) != 0) {
+    if (sscanf(buf, "property %s", type) == 1 && (t = propertyType(type)) >= 0)
+      fextrasize += typeSize[t];
+    else if (format != PLY_ASCII) {
+      fprintf(stderr, "Error: cannot skip \"%.*s\" in binary file.\n", (int)strcspn(buf, "\r\n"), buf);
+      return false;
+    }
+    if (!readLine(buf, 128, in)) {
+      fprintf(stderr, "Error: end_header expected.\n");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+void PLYObject::readVertices(FILE *in)
+{
+  PROFILE_SCOPE("readVertices");
+  char buf[1024];
+  PLYTokenizer t;
+  int i;
+
+  if (format != PLY_ASCII)
+    readVerticesBinary(in);
+  else {
+    // read in vertex attributes
+    for (i = 0; i < nv; i++) {
+      if (!readLine(buf, 1024, in))
+        buf[0] = '\0';
+      initTokenizer(t, buf, buf + strlen(buf), lineno);
+      parseVertex(t, i);
+    }
+  }
+  computeBounds(0, nv, min, max);
+}
+
+
+void PLYObject::parseVertex(PLYTokenizer &t, int i)
+{
+  float values[PLY_MAX_PROPERTIES];
+
+  for (int j = 0; j < nproperties; j++)
+    if (!parseFloat(t, values[j]))
+      tokenError(t, "vertex property");
+  setVertex(i, values);
+}
+
+
+void PLYObject::parseFace(PLYTokenizer &t, int i)
+{
+  int k;
+
+  if (!parseInt(t, k))
+    tokenError(t, "face vertex count");
+  for (int j = 0; j < 3 && j < k; j++)
+    if (!parseInt(t, faces[i][j]))
+      tokenError(t, "face vertex index");
+  checkFace(i, k);
+}
+
+
+void PLYObject::readVerticesBinary(FILE *in)
+{
+  unsigned char *block;
+  int i, n, blocksize;
+
+  // read the vertex records in blocks of a few thousand
+  blocksize = 4096;
+  block = (unsigned char*)malloc(blocksize * vsize);
+  for (i = 0; i < nv; i += n) {
+    n = nv - i < blocksize ? nv - i : blocksize;
+    if (fread(block, vsize, n, in) != (size_t)n) {
+      fprintf(stderr, "Error: unexpected end of file in vertex %d.\n", i);
+      exit(1);
+    }
+    decodeVertices(block, i, n);
+  }
+  free(block);
+}
+
+
+void PLYObject::decodeVertices(const unsigned char *data, int first, int n)
+{
+  bool swap = (format == PLY_BINARY_LE) != hostLittleEndian();
+  int offset[PLY_MAX_PROPERTIES];
+  float values[PLY_MAX_PROPERTIES];
+  int j, k;
+
+  for (j = 0, k = 0; j < nproperties; j++) {
+    offset[j] = k;
+    k += typeSize[vtypes[j]];
+  }
+
+  for (k = 0; k < n; k++) {
+    const unsigned char *record = data + (size_t)k * vsize;
+    for (j = 0; j < nproperties; j++)
+      values[j] = decodeValue(record + offset[j], vtypes[j], swap);
+    setVertex(first + k, values);
+  }
+}
+
+
+void PLYObject::setVertex(int i, const float *values)
+{
+  int j;
+
+  for (j = 0; j < 3; j++)
+    vertices[i][j] = values[order[j]];
+  if (hasnormal)
+    for (j = 0; j < 3; j++)
+      normals[i][j] = values[order[3+j]];
+  if (hascolor)
+    for (j = 0; j < 3; j++)
+      colors[i][j] = (unsigned char)values[order[6+j]];
+  if (hastexture)
+    for (j = 0; j < 2; j++)
+      texcoords[i][j] = values[order[9+j]];
+}
+
+
+// grow the box lo, hi by vertices [begin, end)
+void PLYObject::computeBounds(int begin, int end, Vector3f lo, Vector3f hi)
+{
+  for (int i = begin; i < end; i++)
+    for (int j = 0; j < 3; j++) {
+      if (vertices[i][j] < lo[j])
+        lo[j] = vertices[i][j];
+      if (vertices[i][j] > hi[j])
+        hi[j] = vertices[i][j];
+    }
+}
+
+
+void PLYObject::readFaces(FILE *in)
+{
+  PROFILE_SCOPE("readFaces");
+  char buf[1024];
+  PLYTokenizer t;
+  int i;
+
+  if (format != PLY_ASCII) {
+    readFacesBinary(in);
+    return;
+  }
+
+  // read in face connectivity
+  for (i = 0; i < nf; i++) {
+    if (!readLine(buf, 1024, in))
+      buf[0] = '\0';
+    initTokenizer(t, buf, buf + strlen(buf), lineno);
+    parseFace(t, i);
+  }
+  setupNormals();
+}
+
+
+void PLYObject::readFacesBinary(FILE *in)
+{
+  int fsize = faceSize();
+  unsigned char *block;
+  int i, n, blocksize;
+
+  // triangles all have the same record size, anything else is an error
+  blocksize = 4096;
+  block = (unsigned char*)malloc(blocksize * fsize);
+  for (i = 0; i < nf; i += n) {
+    n = nf - i < blocksize ? nf - i : blocksize;
+    if (fread(block, fsize, n, in) != (size_t)n) {
+      fprintf(stderr, "Error: unexpected end of file in face %d.\n", i);
+      exit(1);
+    }
+    decodeFaces(block, i, n);
+  }
+  free(block);
+
+  setupNormals();
+}
+
+
+int PLYObject::faceSize()
+{
+  return typeSize[fcounttype] + 3 * typeSize[findextype] + fextrasize;
+}
+
+
+void PLYObject::decodeFaces(const unsigned char *data, int first, int n)
+{
+  bool swap = (format == PLY_BINARY_LE) != hostLittleEndian();
+  int csize = typeSize[fcounttype], isize = typeSize[findextype];
+  int fsize = faceSize();
+  int j, k;
+
+  for (k = 0; k < n; k++) {
+    const unsigned char *record = data + (size_t)k * fsize;
+    for (j = 0; j < 3; j++)
+      faces[first+k][j] = (int)decodeValue(record + csize + j * isize, findextype, swap);
+    checkFace(first + k, (int)decodeValue(record, fcounttype, swap));
+  }
+}
+
+
+void PLYObject::readMapped(size_t offset)
+{
+  PROFILE_SCOPE("readMapped");
+  const char *p = mapping.data + offset, *end = mapping.data + mapping.size;
+
+  if (format == PLY_ASCII) {
+    allocate(true);
+    if (pool->size() > 1)
+      parseParallel(p, end);
+    else {
+      PLYTokenizer t;
+      initTokenizer(t, p, end, lineno + 1);
+      parseVertices(t);
+      parseFaces(t);
+      computeBounds(0, nv, min, max);
+    }
+    setupNormals();
+    unmapFile(mapping);
+    return;
+  }
+
+  size_t vbytes = (size_t)nv * vsize, fbytes = (size_t)nf * faceSize();
+  if (vbytes + fbytes > mapping.size - offset) {
+    fprintf(stderr, "Error: file is shorter than its header says.\n");
+    exit(1);
+  }
+
+  // Vertices with nothing but float x, y, z in host byte order are used
+  // in place; writes to them (resize, eat, ...) copy only those pages.
+  // Faces always start with the list count, they are never laid out as
+  // Index3i and get decoded.
+  mappedVertices = nproperties == 3 && (format == PLY_BINARY_LE) == hostLittleEndian()
+    && offset % sizeof(float) == 0;
+  for (int j = 0; j < 3 && mappedVertices; j++)
+    mappedVertices = order[j] == j && vtypes[j] == PLY_FLOAT;
+
+  allocate(!mappedVertices);
+  if (mappedVertices) {
+    vertices = (Vector3f*)(mapping.data + offset);
+  }
+  else
+    decodeVertices((const unsigned char*)p, 0, nv);
+  computeBounds(0, nv, min, max);
+  decodeFaces((const unsigned char*)p + vbytes, 0, nf);
+  setupNormals();
+
+  // keep only the pages holding the vertices
+  if (mappedVertices)
+    releaseMappedRange(mapping, offset + vbytes, mapping.size);
+  else
+    unmapFile(mapping);
+}
+
+
+void PLYObject::parseVertices(PLYTokenizer &t)
+{
+  for (int i = 0; i < nv; i++) {
+    parseVertex(t, i);
+    nextLine(t);
+    releaseParsed(t.p);
+  }
+}
+
+
+void PLYObject::parseFaces(PLYTokenizer &t)
+{
+  for (int i = 0; i < nf; i++) {
+    parseFace(t, i);
+    nextLine(t);
+    releaseParsed(t.p);
+  }
+}
+
+
+void PLYObject::parseParallel(const char *begin, const char *end)
+{
+  // chunks of at most 64 MB, several per thread for load balance
+  int nchunks = 4 * pool->size();
+  if ((end - begin) / nchunks > (64 << 20))
+    nchunks = (int)((end - begin) / (64 << 20)) + 1;
+
+  // move the chunk boundaries to the next line start
+  std::vector<const char*> start(nchunks + 1);
+  start[0] = begin;
+  start[nchunks] = end;
+  for (int c = 1; c < nchunks; c++) {
+    const char *q = begin + (end - begin) / nchunks * c;
+    const char *eol = q > start[c-1] ? (const char*)memchr(q, '\n', end - q) : NULL;
+    start[c] = eol ? eol + 1 : (q > start[c-1] ? end : start[c-1]);
+  }
+
+  // the number of the first line in each chunk
+  std::vector<int> first(nchunks + 1, 0);
+  pool->parallelFor(0, nchunks, 1, [&](int c0, int c1) {
+    for (int c = c0; c < c1; c++)
+      first[c+1] = (int)std::count(start[c], start[c+1], '\n');
+  });
+  for (int c = 0; c < nchunks; c++)
+    first[c+1] += first[c];
+  int total = first[nchunks] + (end > begin && end[-1] != '\n');
+  if (total < nv + nf) {
+    fprintf(stderr, "Error: file is shorter than its header says.\n");
+    exit(1);
+  }
+
+  // parse the chunks, each one keeping its own bounding box
+  std::vector<float> bounds(6 * nchunks);
+  pool->parallelFor(0, nchunks, 1, [&](int c0, int c1) {
+    for (int c = c0; c < c1; c++) {
+      float *lo = &bounds[6*c], *hi = lo + 3;
+      PLYTokenizer t;
+      int i = first[c];
+
+      initTokenizer(t, start[c], start[c+1], lineno + 1 + i);
+      for (int j = 0; j < 3; j++) {
+        lo[j] = FLT_MAX;
+        hi[j] = -FLT_MAX;
+      }
+      for (; i < nv + nf && t.p < t.end; i++) {
+        if (i < nv)
+          parseVertex(t, i);
+        else
+          parseFace(t, i - nv);
+        nextLine(t);
+      }
+      int vend = i < nv ? i : nv;
+      if (first[c] < vend)
+        computeBounds(first[c], vend, lo, hi);
+      releaseMappedRange(mapping, start[c] - mapping.data, start[c+1] - mapping.data);
+    }
+  });
+
+  // reduce in chunk order
+  for (int c = 0; c < nchunks; c++)
+    for (int j = 0; j < 3; j++) {
+      if (bounds[6*c+j] < min[j])
+        min[j] = bounds[6*c+j];
+      if (bounds[6*c+3+j] > max[j])
+        max[j] = bounds[6*c+3+j];
+    }
+}
+
+
+//##########################################
+// Binary cache of a loaded and resized mesh
+
+#define CACHE_VERSION 4		// 4: faces reordered for the vertex cache within the units
+
+struct CacheHeader {
+  char magic[8];		// "PLYCACHE"
+  int version;			// CACHE_VERSION
+  int byteOrder;		// 1, written in host byte order
+  long long sourceSize;		// size and modification time of the PLY file
+  long long sourceTime;
+  int nv, nf;
+  int hascolor, hastexture;
+  Vector3f min, max;
+};
+
+
+// offsets of the arrays in a cache file, each aligned to 64 bytes
+static size_t cacheLayout(int nv, int nf, bool hastexture, size_t offsets[6])
+{
+  size_t sizes[6] = {
+    nv * sizeof(Vector3f), nv * sizeof(Vector3f), nv * sizeof(Color3u),
+    hastexture ? nv * sizeof(Texture2f) : 0, nf * sizeof(Index3i), nf * sizeof(Vector3f)
+  };
+  size_t off = (sizeof(CacheHeader) + 63) & ~(size_t)63;
+
+  for (int i = 0; i < 6; i++) {
+    offsets[i] = off;
+    off = (off + sizes[i] + 63) & ~(size_t)63;
+  }
+  return off;
+}
+
+
+static void cacheName(char *name, size_t size, const char *filename)
+{
+  snprintf(name, size, "%s.cache", filename);
+}
+
+
+// Load filename.cache if it was written for the current version of
+// filename. The arrays are used straight from a mapping of the cache.
+bool PLYObject::readCache(const char *filename)
+{
+  PROFILE_SCOPE("readCache");
+  char name[1024];
+  struct stat st;
+  size_t offsets[6];
+  CacheHeader h;
+
+  cacheName(name, sizeof(name), filename);
+  if (stat(filename, &st) != 0 || !mapFile(mapping, name))
+    return false;
+
+  if (mapping.size < sizeof(CacheHeader))
+    goto invalid;
+  memcpy(&h, mapping.data, sizeof(CacheHeader));
+  if (memcmp(h.magic, "PLYCACHE", 8) != 0 || h.version != CACHE_VERSION || h.byteOrder != 1
+      || h.sourceSize != (long long)st.st_size || h.sourceTime != (long long)st.st_mtime
+      || h.nv <= 0 || h.nf < 0 || cacheLayout(h.nv, h.nf, h.hastexture, offsets) > mapping.size)
+    goto invalid;
+
+  nv = h.nv;
+  nf = h.nf;
+  hasnormal = true;
+  hascolor = h.hascolor;
+  hastexture = h.hastexture;
+  for (int i = 0; i < 3; i++) {
+    min[i] = h.min[i];
+    max[i] = h.max[i];
+  }
+
+  vertices  = (Vector3f*)(mapping.data + offsets[0]);
+  normals   = (Vector3f*)(mapping.data + offsets[1]);
+  colors    = (Color3u*)(mapping.data + offsets[2]);
+  texcoords = hastexture ? (Texture2f*)(mapping.data + offsets[3]) : NULL;
+  faces     = (Index3i*)(mapping.data + offsets[4]);
+  fnormals  = (Vector3f*)(mapping.data + offsets[5]);
+  mappedVertices = mappedCache = cached = true;
+  return true;
+
+ invalid:
+  unmapFile(mapping);
+  return false;
+}
+
+
+// write the current mesh to filename.cache, stamped with filename's size and time
+bool PLYObject::writeCache(const char *filename)
+{
+  PROFILE_SCOPE("writeCache");
+  char name[1024], tmpname[1040];
+  struct stat st;
+  size_t offsets[6], total;
+  CacheHeader h;
+  FILE *out;
+
+  if (nv == 0 || stat(filename, &st) != 0)
+    return false;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "PLYCACHE", 8);
+  h.version = CACHE_VERSION;
+  h.byteOrder = 1;
+  h.sourceSize = st.st_size;
+  h.sourceTime = st.st_mtime;
+  h.nv = nv;
+  h.nf = nf;
+  h.hascolor = hascolor;
+  h.hastexture = hastexture;
+  for (int i = 0; i < 3; i++) {
+    h.min[i] = min[i];
+    h.max[i] = max[i];
+  }
+
+  const void *arrays[6] = {vertices, normals, colors, texcoords, faces, fnormals};
+  size_t sizes[6] = {
+    nv * sizeof(Vector3f), nv * sizeof(Vector3f), nv * sizeof(Color3u),
+    hastexture ? nv * sizeof(Texture2f) : 0, nf * sizeof(Index3i), nf * sizeof(Vector3f)
+  };
+  total = cacheLayout(nv, nf, hastexture, offsets);
+
+  // write next to the final name and rename, readers never see half a file
+  cacheName(name, sizeof(name), filename);
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+  if (!(out = fopen(tmpname, "wb"))) {
+    fprintf(stderr, "Warning: cannot write cache %s.\n", tmpname);
+    return false;
+  }
+
+  // arrays in order, zero padded up to their offsets
+  static const char zeros[64] = {0};
+  size_t pos = sizeof(h);
+  bool ok = fwrite(&h, sizeof(h), 1, out) == 1;
+  for (int i = 0; i <= 6 && ok; i++) {
+    size_t next = i < 6 ? offsets[i] : total;
+    ok = fwrite(zeros, 1, next - pos, out) == next - pos;
+    pos = next;
+    if (i < 6 && sizes[i] > 0) {
+      ok = ok && fwrite(arrays[i], sizes[i], 1, out) == 1;
+      pos += sizes[i];
+    }
+  }
+  ok = (fclose(out) == 0) && ok;
+
+  remove(name);
+  if (!ok || rename(tmpname, name) != 0) {
+    fprintf(stderr, "Warning: cannot write cache %s.\n", name);
+    remove(tmpname);
+    return false;
+  }
+  return true;
+}
+
+
+void PLYObject::releaseParsed(const char *p)
+{
+  // let go of the text already parsed every few megabytes
+  size_t parsed = p - mapping.data;
+
+  if (parsed - releasedBytes >= (8 << 20)) {
+    releaseMappedRange(mapping, releasedBytes, parsed);
+    releasedBytes = parsed;
+  }
+}
+
+
+void PLYObject::checkFace(int i, int k)
+{
+  if (k != 3) {
+    fprintf(stderr, "Error: not a triangular face.\n");
+    exit(1);
+  }
+  for (int j = 0; j < 3; j++)
+    if (faces[i][j] < 0 || faces[i][j] >= nv) {
+      fprintf(stderr, "Error: face %d refers to vertex %d out of range.\n", i, faces[i][j]);
+      exit(1);
+    }
+}
+
+
+void PLYObject::setupNormals()
+{
+  computeFaceNormals();
+  if (!hasnormal)
+    computeVertexNormals();
+  hasnormal = true;
+}
+
+
+void PLYObject::computeFaceNormals()
+{
+  int grain = nf / (4 * pool->size());
+
+  pool->parallelFor(0, nf, grain < 4096 ? 4096 : grain, [&](int begin, int end) {
+    triangleNormals(fnormals + begin, vertices, faces + begin, end - begin);
+  });
+}
+
+
+// Counting sort of the face corners by vertex. Filled in face order, so
+// every vertex lists its faces in the order the old scatter loop added
+// them and the uniform normals come out bit for bit the same.
+void PLYObject::buildAdjacency()
+{
+  int i, j;
+
+  if (vfStart && adjacencyStamp == faceStamp)
+    return;
+
+  free(vfStart);
+  free(vfFaces);
+  vfStart = (int*)calloc(nv + 1, sizeof(int));
+  vfFaces = (int*)malloc(3 * (size_t)nf * sizeof(int));
+
+  for (i = 0; i < nf; i++)
+    for (j = 0; j < 3; j++)
+      vfStart[faces[i][j] + 1]++;
+  for (i = 0; i < nv; i++)
+    vfStart[i+1] += vfStart[i];
+
+  std::vector<int> next(vfStart, vfStart + nv);
+  for (i = 0; i < nf; i++)
+    for (j = 0; j < 3; j++)
+      vfFaces[next[faces[i][j]]++] = i;
+  adjacencyStamp = faceStamp;
+}
+
+
+// Each thread gathers the face normals around its own vertices, so no two
+// threads write the same normal
+void PLYObject::computeVertexNormals()
+{
+  int grain = nv / (4 * pool->size());
+
+  buildAdjacency();
+  pool->parallelFor(0, nv, grain < 4096 ? 4096 : grain, [&](int begin, int end) {
+    for (int v = begin; v < end; v++) {
+      Vector3f n = {0.0, 0.0, 0.0};
+
+      for (int a = vfStart[v]; a < vfStart[v+1]; a++) {
+        int f = vfFaces[a];
+        float w = 1.0;
+
+        if (normalWeighting != NORMALS_UNIFORM) {
+          // edges leaving v in the face
+          int j = faces[f][0] == v ? 0 : faces[f][1] == v ? 1 : 2;
+          Vector3f e1, e2, c;
+
+          sub(e1, vertices[faces[f][(j+1)%3]], vertices[v]);
+          sub(e2, vertices[faces[f][(j+2)%3]], vertices[v]);
+          if (normalWeighting == NORMALS_AREA) {
+            vecProd(c, e1, e2);
+            w = 0.5 * sqrt(dotProd(c, c));
+          }
+          else {
+            float l = sqrt(dotProd(e1, e1) * dotProd(e2, e2));
+            float cosine = l > 0.0 ? dotProd(e1, e2) / l : 1.0;
+            w = acos(cosine < -1.0 ? -1.0 : cosine > 1.0 ? 1.0 : cosine);
+          }
+        }
+        for (int k = 0; k < 3; k++)
+          n[k] += w * fnormals[f][k];
+      }
+      for (int k = 0; k < 3; k++)
+        normals[v][k] = n[k];
+    }
+    normalizeVectors(normals + begin, normals + begin, end - begin);
+  });
+}
+
+
+// Face and vertex normals from the current vertices, to switch
+// normalWeighting
+void PLYObject::recomputeNormals()
+{
+  PROFILE_SCOPE("recomputeNormals");
+  computeFaceNormals();
+  computeVertexNormals();
+  hasnormal = true;
+  normalStamp++;
+}
+
+
+void PLYObject::resize()
+{
+  PROFILE_SCOPE("resize");
+  int i;
+  float minx, miny, minz, maxx, maxy, maxz;
+  float size, scale;
+
+  // get bounding box
+  minx = miny = minz = FLT_MAX;
+  maxx = maxy = maxz = -FLT_MAX;
+  for (i = 0; i <nv; i++) {
+    if (vertices[i][0] < minx)
+      minx = vertices[i][0];
+    if (vertices[i][0] > maxx)
+      maxx = vertices[i][0];
+
+    if (vertices[i][1] < miny)
+      miny = vertices[i][1];
+    if (vertices[i][1] > maxy)
+      maxy = vertices[i][1];
+
+    if (vertices[i][2] < minz)
+      minz = vertices[i][2];
+    if (vertices[i][2] > maxz)
+      maxz = vertices[i][2];
+  }
+
+  // rescale vertex coordinates to be in [-1,1]
+  size = 0.0;
+  if (size < maxx-minx)
+    size = maxx-minx;
+  if (size < maxy-miny)
+    size = maxy-miny;
+  if (size < maxz-minz)
+    size = maxz-minz;
+  scale = 2.0 / size;
+  Matrix4f m;
+  emptyMatrix(m);
+  m[0][0] = m[1][1] = m[2][2] = scale;
+  m[0][3] = -scale * minx - 1.0;
+  m[1][3] = -scale * miny - 1.0;
+  m[2][3] = -scale * minz - 1.0;
+  m[3][3] = 1.0;
+  transformPoints(vertices, m, vertices, nv);
+  positionStamp++;
+}
+
+// move element v of the nv elements of size bytes at data to remap[v]
+static void permute(void *data, size_t size, int nv, const int *remap)
+{
+  char *copy = (char*)malloc(nv * size);
+
+  memcpy(copy, data, nv * size);
+  for (int v = 0; v < nv; v++)
+    memcpy((char*)data + remap[v] * size, copy + v * size, size);
+  free(copy);
+}
+
+
+// Reorder the faces for the post-transform vertex cache, then renumber
+// the vertices in the order the faces use them, so drawing and shading
+// both walk the vertex arrays front to back
+void PLYObject::optimizeMesh()
+{
+  PROFILE_SCOPE("optimizeMesh");
+  int *order = (int*)malloc(nf * sizeof(int));
+  float before = vertexCacheACMR(faces, nf, nv);
+
+  optimizeVertexCache(faces, nf, nv, order);
+  reorderFaces(order);
+  free(order);
+  renumberVertices();
+
+  printf("Vertex cache: %.3f vertices per triangle before, %.3f after.\n",
+         before, vertexCacheACMR(faces, nf, nv));
+}
+
+
+// Put face order[k] in place k. The arrays are left alone if they are
+// in that order already, they may be pages of a mapped cache.
+void PLYObject::reorderFaces(const int *order)
+{
+  int i;
+
+  for (i = 0; i < nf && order[i] == i; i++)
+    ;
+  if (i >= nf)
+    return;
+
+  Index3i *reordered = (Index3i*)malloc(nf * sizeof(Index3i));
+  Vector3f *fn = (Vector3f*)malloc(nf * sizeof(Vector3f));
+  for (i = 0; i < nf; i++) {
+    memcpy(reordered[i], faces[order[i]], sizeof(Index3i));
+    memcpy(fn[i], fnormals[order[i]], sizeof(Vector3f));
+  }
+  memcpy(faces, reordered, nf * sizeof(Index3i));
+  memcpy(fnormals, fn, nf * sizeof(Vector3f));
+  free(reordered);
+  free(fn);
+  faceStamp++;
+}
+
+
+// Number the vertices in the order the faces first use them, the
+// levels of detail follow
+void PLYObject::renumberVertices()
+{
+  int *remap = (int*)malloc(nv * sizeof(int));
+  int i, j, v;
+
+  optimizeVertexFetch(faces, nf, nv, remap);
+  for (v = 0; v < nv && remap[v] == v; v++)
+    ;
+  if (v >= nv) {
+    free(remap);
+    return;
+  }
+
+  for (i = 0; i < nf; i++)
+    for (j = 0; j < 3; j++)
+      faces[i][j] = remap[faces[i][j]];
+  if (nlods > 1) {
+    for (i = 0; i < lodFirst[nlods-1] + lodCount[nlods-1]; i++)
+      for (j = 0; j < 3; j++)
+        lodFaces[i][j] = remap[lodFaces[i][j]];
+    lodStamp++;
+  }
+  permute(vertices, sizeof(Vector3f), nv, remap);
+  permute(normals, sizeof(Vector3f), nv, remap);
+  permute(colors, sizeof(Color3u), nv, remap);
+  if (texcoords)
+    permute(texcoords, sizeof(Texture2f), nv, remap);
+  free(remap);
+
+  positionStamp++;
+  normalStamp++;
+  faceStamp++;
+  colorStamp++;
+}
+
+
+// Build the hierarchy and put the faces in its order of units, then the
+// vertices in the order of the faces. Every unit is then a range of
+// faces and owns a range of vertices. Grouping the faces by units breaks
+// up the order optimizeMesh() found, so within each unit the faces are
+// reordered for the vertex cache again. The cache keeps the result: a
+// mesh read from it keeps the order its faces have within the units,
+// and a rebuild moves nothing.
+void PLYObject::buildBVH()
+{
+  PROFILE_SCOPE("buildBVH");
+  long long start = profileNow();
+  int *order = (int*)malloc(nf * sizeof(int));
+  int *placed = (int*)malloc(nf * sizeof(int));
+
+  if (!bvh)
+    bvh = new BVH();
+  bvh->build(vertices, faces, nf, pool, order);
+
+  // the faces of each unit in the order they came in, or for the cache
+  memcpy(placed, order, nf * sizeof(int));
+  std::vector<BVHUnit> &units = bvh->units;
+  pool->parallelFor(0, (int)units.size(), 1, [&](int begin, int end) {
+    for (int u = begin; u < end; u++) {
+      std::sort(placed + units[u].first, placed + units[u].first + units[u].count);
+      if (!cached)
+        optimizePartVertexCache(faces, placed + units[u].first, units[u].count);
+    }
+  });
+  bvh->placeFaces(order, placed, nf);
+  reorderFaces(placed);
+  free(order);
+  free(placed);
+  renumberVertices();
+  bvh->findVertices(faces);
+  bvhPositionStamp = positionStamp;
+  culled = false;
+  picked = -1;
+
+  printf("BVH: %d nodes, %d leaves, depth %d, %d units, %.1f ms.\n", (int)bvh->nodes.size(),
+         bvh->leaves, bvh->depth, (int)bvh->units.size(), (profileNow() - start) * 1e-6);
+  printf("Vertex cache: %.3f vertices per triangle in unit order.\n", vertexCacheACMR(faces, nf, nv));
+}
+
+
+// the bounds follow the vertices once they moved
+void PLYObject::refitBVH()
+{
+  if (bvh && bvhPositionStamp != positionStamp) {
+    bvh->refit(vertices, faces, pool);
+    bvhPositionStamp = positionStamp;
+  }
+}
+
+
+// Find the units in the view frustum of projection * modelView. Until
+// the next cull only those are drawn and shaded.
+void PLYObject::cull(const Matrix4f modelView, const Matrix4f projection)
+{
+  PROFILE_SCOPE("cull");
+  Matrix4f mvp;
+
+  if (!bvh) {
+    culled = false;
+    return;
+  }
+  refitBVH();
+
+  multMatrix(mvp, projection, modelView);
+  bvh->cull(mvp);
+  culled = true;
+}
+
+
+// Nearest face hit by the ray origin + s * dir for 0 < s < t, with t
+// set to its s, or -1 if the ray misses or there is no hierarchy
+int PLYObject::pick(const Vector3f origin, const Vector3f dir, float &t)
+{
+  if (!bvh)
+    return -1;
+  refitBVH();
+  return bvh->intersect(vertices, faces, origin, dir, t);
+}
+
+
+// Chain of simplified meshes, each about half the faces of the one
+// before, until simplification stops paying off. They index the current
+// vertices, so build them after optimizeMesh().
+void PLYObject::buildLODs(int levels)
+{
+  PROFILE_SCOPE("buildLODs");
+  Index3i *out = (Index3i*)malloc(nf * sizeof(Index3i));
+  int *order = (int*)malloc(nf * sizeof(int));
+  const Index3i *source = faces;
+  int i, total = 0;
+
+  free(lodFaces);
+  lodFaces = (Index3i*)malloc(nf * sizeof(Index3i));
+  lodFirst[0] = 0;
+  lodCount[0] = nf;
+  nlods = 1;
+  if (levels > MAX_LODS)
+    levels = MAX_LODS;
+
+  while (nlods < levels) {
+    int n = lodCount[nlods-1];
+    int m = simplifyMesh(vertices, nv, source, n, n / 2, out);
+    if (m < 64 || m > 0.9 * n || total + m > nf)
+      break;
+
+    // the levels are drawn through the vertex cache as well
+    optimizeVertexCache(out, m, nv, order);
+    for (i = 0; i < m; i++)
+      memcpy(lodFaces[total + i], out[order[i]], sizeof(Index3i));
+    lodFirst[nlods] = total;
+    lodCount[nlods] = m;
+    source = lodFaces + total;
+    total += m;
+    nlods++;
+  }
+  free(out);
+  free(order);
+  lodStamp++;
+  lod = 0;
+
+  radius = 0.0;
+  for (i = 0; i < nv; i++) {
+    float r = length(vertices[i]);
+    if (r > radius)
+      radius = r;
+  }
+
+  printf("Levels of detail:");
+  for (i = 0; i < nlods; i++)
+    printf(" %d", lodCount[i]);
+  printf(" faces.\n");
+}
+
+
+// Pick the coarsest level that still puts a triangle on about every
+// LOD_PIXELS_PER_TRIANGLE pixels of the object's projected bounding
+// sphere, seen from distance with a vertical field of view in degrees
+int PLYObject::selectLOD(float distance, float fieldOfView, int viewportHeight)
+{
+  lod = 0;
+  if (distance > radius) {
+    float r = radius / (distance * tan(fieldOfView * M_PI / 360.0)) * viewportHeight / 2;
+    float wanted = M_PI * r * r / LOD_PIXELS_PER_TRIANGLE;
+
+    while (lod + 1 < nlods && lodCount[lod+1] >= wanted)
+      lod++;
+  }
+  return lod;
+}
+
+
+void PLYObject::invertNormals()
+{
+  int i, tmp;
+
+  scaleVectors(normals, -1.0, nv);
+  scaleVectors(fnormals, -1.0, nf);
+  for (i = 0; i < nf; i++) {
+    tmp = faces[i][0];
+    faces[i][0] = faces[i][2];
+    faces[i][2] = tmp;
+  }
+  if (nlods > 1) {
+    for (i = 0; i < lodFirst[nlods-1] + lodCount[nlods-1]; i++) {
+      tmp = lodFaces[i][0];
+      lodFaces[i][0] = lodFaces[i][2];
+      lodFaces[i][2] = tmp;
+    }
+    lodStamp++;
+  }
+  normalStamp++;
+  faceStamp++;
+}
+
+
+// Light the vertices into colors, unless neither the vertices, the
+// normals nor the lighting changed since the colors were computed. A
+// redraw without changes then only submits the mesh again. With a
+// hierarchy only the units about to be drawn are lit, and shadows are
+// cast if ctx asks for them. Occlusion scales the ambient light once
+// it is baked, if ctx asks for it.
+void PLYObject::shade(const LightingContext &ctx)
+{
+  PROFILE_SCOPE("lighting");
+  updateOcclusion();
+  bool current = colorsPositionStamp == positionStamp && colorsNormalStamp == normalStamp &&
+    colorsOcclusionStamp == occlusionStamp && sameLighting(ctx, colorsContext);
+
+  if (!current) {
+    colorsContext = ctx;
+    colorsPositionStamp = positionStamp;
+    colorsNormalStamp = normalStamp;
+    colorsOcclusionStamp = occlusionStamp;
+    colorsEpoch++;
+  }
+
+  shadedVertices = 0;
+  if (bvh)
+    shadeUnits(ctx);
+  else if (!current) {
+    updateShadingStreams();
+    streams.visible = NULL;
+    streams.occlusion = ctx.occlusion ? occlusion : NULL;
+    shadeParallel(ctx);
+    shadedVertices = nv;
+  }
+  if (shadedVertices > 0)
+    colorStamp++;
+}
+
+
+void PLYObject::updateShadingStreams()
+{
+  // refresh the SoA copy only after vertices or normals changed
+  if (streamsPositionStamp == positionStamp && streamsNormalStamp == normalStamp)
+    return;
+
+  fillShadingStreams(streams, vertices, normals, nv);
+  streamsPositionStamp = positionStamp;
+  streamsNormalStamp = normalStamp;
+}
+
+
+void PLYObject::shadeParallel(const LightingContext &ctx)
+{
+  // Chunks are multiples of 64 vertices, so no two threads ever write
+  // into the same cache line of colors or read the same line of the
+  // streams. About four chunks per thread even out the load.
+  int grain = nv / (4 * pool->size());
+  grain = grain < 1024 ? 1024 : (grain + 63) & ~63;
+
+  pool->parallelFor(0, nv, grain, [&](int begin, int end) {
+    PROFILE_SCOPE("shade chunk");
+    shadeStreams(ctx, streams, colors, begin, end);
+  });
+}
+
+
+// Light the own vertices of the units lit for an older colorsEpoch
+// among those drawn next: the visible units and their neighbors, whose
+// vertices they share, after a cull, all units otherwise
+void PLYObject::shadeUnits(const LightingContext &ctx)
+{
+  std::vector<int> stale;
+  std::vector<BVHUnit> &units = bvh->units;
+
+  auto want = [&](int u) {
+    if (units[u].shadedEpoch != colorsEpoch) {
+      units[u].shadedEpoch = colorsEpoch;
+      stale.push_back(u);
+      shadedVertices += units[u].vcount;
+    }
+  };
+  if (culled)
+    for (size_t i = 0; i < bvh->visible.size(); i++) {
+      const BVHUnit &u = units[bvh->visible[i]];
+      want(bvh->visible[i]);
+      for (int k = u.neighbors; k < u.neighbors + u.nneighbors; k++)
+        want(bvh->neighbors[k]);
+    }
+  else
+    for (int u = 0; u < (int)units.size(); u++)
+      want(u);
+  if (stale.empty())
+    return;
+
+  // units have a few hundred vertices, four batches of them per thread
+  int grain = (int)stale.size() / (4 * pool->size());
+  bool shadows = updateShadows(ctx);
+  updateShadingStreams();
+  streams.visible = shadows ? shadow : NULL;
+  streams.occlusion = ctx.occlusion ? occlusion : NULL;
+  pool->parallelFor(0, (int)stale.size(), grain < 1 ? 1 : grain, [&](int begin, int end) {
+    PROFILE_SCOPE("shade chunk");
+    for (int i = begin; i < end; i++) {
+      BVHUnit &u = units[stale[i]];
+      if (shadows && u.tracedEpoch != shadowEpoch) {
+        bvh->traceShadows(vertices, faces, streams, shadowLight, shadow, u.vfirst, u.vfirst + u.vcount);
+        u.tracedEpoch = shadowEpoch;
+      }
+      shadeStreams(ctx, streams, colors, u.vfirst, u.vfirst + u.vcount);
+    }
+  });
+}
+
+
+// Whether ctx casts shadows from light 0, which needs the hierarchy.
+// Moving the light relative to the mesh or changing the mesh starts a
+// new shadowEpoch, after which every unit is traced again.
+bool PLYObject::updateShadows(const LightingContext &ctx)
+{
+  Vector3f light;
+
+  if (!ctx.shadows || !bvh || ctx.nlights == 0 || !objectSpaceLight(ctx, 0, light))
+    return false;
+  if (!shadow) {
+    shadow = (float*)malloc(nv * sizeof(float));
+    if (!shadow) {
+      fprintf(stderr, "Error: no memory for the shadows of %d vertices.\n", nv);
+      return false;
+    }
+  }
+
+  if (memcmp(light, shadowLight, sizeof(Vector3f)) != 0 || shadowPositionStamp != positionStamp ||
+      shadowNormalStamp != normalStamp || shadowFaceStamp != faceStamp) {
+    memcpy(shadowLight, light, sizeof(Vector3f));
+    shadowPositionStamp = positionStamp;
+    shadowNormalStamp = normalStamp;
+    shadowFaceStamp = faceStamp;
+    shadowEpoch++;
+    refitBVH();
+  }
+  return true;
+}
+
+
+// Find the ambient occlusion of the mesh in its cache next to filename
+// or start baking it in the background, unless it is there or on its
+// way. updateOcclusion() picks up the result of the bake.
+void PLYObject::bakeOcclusion(const char *filename)
+{
+  PROFILE_SCOPE("bakeOcclusion");
+  char name[1024];
+
+  if (occlusion || bake || nv == 0)
+    return;
+  if (!bvh) {
+    fprintf(stderr, "Error: ambient occlusion needs the hierarchy of the mesh.\n");
+    return;
+  }
+  if (!(occlusion = (float*)malloc(nv * sizeof(float)))) {
+    fprintf(stderr, "Error: no memory for the occlusion of %d vertices.\n", nv);
+    return;
+  }
+
+  unsigned long long hash = meshHash(vertices, nv, faces, nf);
+  occlusionCacheName(name, sizeof(name), filename, hash);
+  if (readOcclusion(name, hash, nv, occlusion)) {
+    occlusionStamp++;
+    return;
+  }
+  free(occlusion);
+  occlusion = NULL;
+
+  refitBVH();
+  bake = new OcclusionBake(this, name, hash);
+}
+
+
+// take over the occlusion of a finished bake
+void PLYObject::updateOcclusion()
+{
+  if (!bake || !bake->finished())
+    return;
+  occlusion = bake->take();
+  delete bake;
+  bake = NULL;
+  if (occlusion)
+    occlusionStamp++;
+}
+
+
+void PLYObject::setThreads(int nthreads)
+{
+  pool->resize(nthreads);
+}
+
+
+void PLYObject::eat()
+{
+  float scale = 0.01;
+
+  /* Jitter each vertex */
+  addScaledVectors(vertices, scale, normals, nv);
+  positionStamp++;
+}
+
+
+void PLYObject::starve()
+{
+  float scale = -0.01;
+
+  /* Jitter each vertex */
+  addScaledVectors(vertices, scale, normals, nv);
+  positionStamp++;
+}
+
+
+void PLYObject::dance()
+{
+  /* This creates a random vector */
+  Vector3f randomvector;
+  randomvector[0] = rangerand(-0.1, 0.1, 30);
+  randomvector[1] = rangerand(-0.1, 0.1, 30);
+  randomvector[2] = rangerand(-0.1, 0.1, 30);
+
+
+  /* Insert code here to add randomvector to all vertices in the PLYObject */
+  /* Iterate over all the vertices and add randomvector to each one. */
+  /* The vertex positions are stored in the array called 'vertices' */
+
+	Matrix4f m;
+	emptyMatrix(m);
+	for (int k=0 ; k<4 ; k++)
+		m[k][k] = 1.0;
+	for (int k=0 ; k<3 ; k++)
+		m[k][3] = randomvector[k];
+	transformPoints(vertices, m, vertices, nv);
+	positionStamp++;
+	// a translation, the normals stay valid
+}
+
+
+
+/* A not too good pseudo-random number generator */
+/* Returns a pseudo-random number between min and max */
+double PLYObject::rangerand(double min, double max, long steps)
+{
+  return min + ((rand() % steps) * (max - min)) / steps;
+}
@@ -12,31 +12,58 @@
 
 #include <stdio.h>
 
+#include "lighting.h"
+#include "mappedFile.h"
+#include "arena.h"
+
+class ThreadPool;
+class Rasterizer;
+class BVH;
+class OcclusionBake;
+class PLYObject;
+struct PLYTokenizer;
+
 typedef float Vector3f[3];
 typedef unsigned char Color3u[3];
 typedef float Texture2f[2];
 typedef int Index3i[3];
 
+// file formats
+enum { PLY_ASCII, PLY_BINARY_LE, PLY_BINARY_BE };
 
-class PLYObject {
-public:
+// property types
+enum { PLY_CHAR, PLY_UCHAR, PLY_SHORT, PLY_USHORT, PLY_INT, PLY_UINT, PLY_FLOAT, PLY_DOUBLE };
 
-  PLYObject(FILE *in);
-  ~PLYObject();
+#define PLY_MAX_PROPERTIES 32
 
-  bool checkHeader(FILE *in);
-  void readVertices(FILE *in);
-  void readFaces(FILE *in);
-  void resize();
-  double rangerand(double min, double max, long steps);
-  void invertNormals();
-  void dance();
-  void eat();
-  void starve();
+// weight of each face in the vertex normals around it: the same for all
+// faces, face area, or the angle of the face at the vertex
+enum { NORMALS_UNIFORM, NORMALS_AREA, NORMALS_ANGLE };
 
-  void draw();
-  
+// buffer objects of the indexed draw path
+enum { VBO_POSITIONS, VBO_NORMALS, VBO_COLORS, VBO_INDICES, VBO_LODS, VBO_COUNT };
+
+#define MAX_LODS 6			// levels of detail, the full mesh included
+#define LOD_PIXELS_PER_TRIANGLE 8.0	// screen area one triangle should cover
+
+
+// Fill the products and shininess of ctx from the material PLY objects
+// are drawn with, the global ambient As and the lights. ctx.modelView
+// has to be set before.
+void setMaterialLighting(LightingContext &ctx, const Vector4f As, const LightList &lights);
+
+
+// Everything a PLYObject holds, the arrays and objects it owns included
+// by pointer. Moving an object swaps the whole of it, so a member added
+// here moves along without further code.
+struct PLYData {
+  int format;			// PLY_ASCII, PLY_BINARY_LE or PLY_BINARY_BE
+  int lineno;			// lines of the file read so far
   int nproperties;		// number of vertex properties
+  int vtypes[PLY_MAX_PROPERTIES];	// type of each vertex property
+  int vsize;			// bytes per binary vertex record
+  int fcounttype, findextype;	// types of the face list count and indices
+  int fextrasize;		// bytes of further properties per binary face
   int order[11];		// order of x,y,z, nx,ny,nz, red,green,blue, tu,tv vertex properties
   bool hasnormal, hascolor, hastexture;
 
@@ -50,6 +77,165 @@ public:
   Texture2f *texcoords;		// array of texture coords
   Index3i *faces;		// array of face indices
   Vector3f *fnormals;		// array of face normals
+  // the six arrays above unless they point into the mapping, each
+  // ARENA_ALIGNMENT aligned
+  Arena arena;
+
+  // Ambient occlusion of each point, 0 enclosed to 1 open, NULL until
+  // bakeOcclusion() found it in the cache or the bake it started
+  // finished. It is baked for the mesh as it was then and kept while
+  // the mesh moves; occlusionStamp is bumped whenever it arrives.
+  float *occlusion;
+  OcclusionBake *bake;		// the running bake, NULL if none
+  unsigned int occlusionStamp, colorsOcclusionStamp;
+
+  // vertex to face adjacency, the faces around vertex v are
+  // vfFaces[vfStart[v]] to vfFaces[vfStart[v+1]-1] in increasing order
+  int *vfStart, *vfFaces;
+  unsigned int adjacencyStamp;	// faceStamp the adjacency was built for
+  int normalWeighting;		// NORMALS_UNIFORM, NORMALS_AREA or NORMALS_ANGLE
+
+  // Simplified versions of the mesh. They reuse the vertices, level l
+  // draws lodCount[l] faces, of faces for level 0 and from lodFirst[l]
+  // on in lodFaces for the coarser levels.
+  int nlods;
+  Index3i *lodFaces;
+  int lodFirst[MAX_LODS], lodCount[MAX_LODS];
+  unsigned int lodStamp;	// bumped whenever lodFaces change
+  int lod;			// level draw() uses
+  float radius;			// bounding sphere around the origin
+
+  // Hierarchy over the faces, NULL until buildBVH(). While culled is
+  // set the last cull() holds: draw() draws and shade() lights only the
+  // units in bvh->visible.
+  BVH *bvh;
+  unsigned int bvhPositionStamp;	// positionStamp the bounds were fitted to
+  bool culled;
+  int picked;			// face found by the last pickPixel(), -1 for none
+
+  // modification counters, bumped whenever the corresponding array changes
+  unsigned int positionStamp, normalStamp, faceStamp, colorStamp;
+
+  // The colors are reshaded only when the geometry or the lighting
+  // changed since the last shade(); shadedVertices counts the vertices
+  // the last call lit, 0 when the colors could be reused. With a
+  // hierarchy the units remember the colorsEpoch they were lit for.
+  LightingContext colorsContext;	// lighting the colors were computed with
+  unsigned int colorsPositionStamp, colorsNormalStamp;
+  unsigned int colorsEpoch;	// bumped whenever colorsContext or the stamps change
+  int shadedVertices;
+
+  // Visibility of light 0 from each vertex for lighting that casts
+  // shadows. Units are traced while they are shaded, unless they were
+  // already traced for shadowEpoch, which starts anew whenever the light
+  // moved relative to the mesh or the mesh changed.
+  float *shadow;
+  Vector3f shadowLight;		// light 0 in object space
+  unsigned int shadowPositionStamp, shadowNormalStamp, shadowFaceStamp;
+  unsigned int shadowEpoch;
+
+  ShadingStreams streams;	// SoA copy of vertices and normals for shading
+  unsigned int streamsPositionStamp, streamsNormalStamp;
+
+  ThreadPool *pool;		// workers for the per-vertex loops
+
+  int vboMode;			// -1 not yet known, 0 client arrays, 1 buffer objects
+  unsigned int vbo[VBO_COUNT];	// GL buffer names
+  unsigned int vboStamps[VBO_COUNT];	// stamp of the data each buffer holds
+  // set by drawElements() once buffers exist, so that deleting objects
+  // that were never drawn needs no OpenGL
+  void (*bufferRelease)(PLYObject *ply);
+
+  MappedFile mapping;		// file mapping while loading, kept if vertices point into it
+  bool mappedVertices;		// vertices live in the mapping, not on the heap
+  bool mappedCache;		// all arrays live in the mapping of a cache file
+  bool cached;			// loaded from the cache, already resized
+  size_t releasedBytes;		// mapped text already given back to the OS
+};
+
+
+class PLYObject : public PLYData {
+public:
+
+  PLYObject();			// empty, for checkHeader(), allocate() and the readers
+  PLYObject(FILE *in);
+  PLYObject(const char *filename, bool useCache = false);	// memory-mapped loading
+  ~PLYObject();
+
+  // Moving hands over the mesh with its arena, mapping, threads and GL
+  // buffers; copies are not possible
+  PLYObject(PLYObject &&other);
+  PLYObject &operator=(PLYObject &&other);
+  PLYObject(const PLYObject &) = delete;
+  PLYObject &operator=(const PLYObject &) = delete;
+  void swap(PLYObject &other);
+
+  // Replace the mesh by the one in filename, reusing the arena, the
+  // thread pool and the GL buffers. Return false, leaving an empty
+  // object, if it cannot be read.
+  bool load(const char *filename, bool useCache = false);
+
+  void init();
+  void clear();
+  void release();
+  void allocate(bool withVertices);
+
+  bool checkHeader(FILE *in);
+  char *readLine(char *buf, int size, FILE *in);
+  void readVertices(FILE *in);
+  void readFaces(FILE *in);
+  void readVerticesBinary(FILE *in);
+  void readFacesBinary(FILE *in);
+  void decodeVertices(const unsigned char *data, int first, int n);
+  void decodeFaces(const unsigned char *data, int first, int n);
+  int faceSize();
+  void readMapped(size_t offset);
+  void parseVertices(PLYTokenizer &t);
+  void parseFaces(PLYTokenizer &t);
+  void parseVertex(PLYTokenizer &t, int i);
+  void parseFace(PLYTokenizer &t, int i);
+  void parseParallel(const char *begin, const char *end);
+  void releaseParsed(const char *p);
+  bool readCache(const char *filename);
+  bool writeCache(const char *filename);
+  void setVertex(int i, const float *values);
+  void computeBounds(int begin, int end, Vector3f lo, Vector3f hi);
+  void checkFace(int i, int k);
+  void setupNormals();
+  void computeFaceNormals();
+  void buildAdjacency();
+  void computeVertexNormals();
+  void recomputeNormals();
+  void optimizeMesh();
+  void reorderFaces(const int *order);
+  void renumberVertices();
+  void buildBVH();
+  void refitBVH();
+  void cull(const Matrix4f modelView, const Matrix4f projection);
+  int pick(const Vector3f origin, const Vector3f dir, float &t);
+  int pickPixel(int x, int y);
+  void buildLODs(int levels);
+  int selectLOD(float distance, float fieldOfView, int viewportHeight);
+  void resize();
+  double rangerand(double min, double max, long steps);
+  void invertNormals();
+  void dance();
+  void eat();
+  void starve();
+
+  void draw();
+  void drawPixels(Rasterizer &raster);
+  void drawElements();
+  void updateBuffer(int b, const void *data, size_t size, unsigned int stamp);
+  void releaseBuffers();
+  void shade(const LightingContext &ctx);
+  void updateShadingStreams();
+  void shadeParallel(const LightingContext &ctx);
+  void shadeUnits(const LightingContext &ctx);
+  bool updateShadows(const LightingContext &ctx);
+  void bakeOcclusion(const char *filename);
+  void updateOcclusion();
+  void setThreads(int nthreads);
 };
 
 #endif
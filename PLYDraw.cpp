@@ -0,0 +1,447 @@
+/* File: PLYDraw
+ * Description:
+ *   OpenGL drawing of PLY objects: the fixed function lights and
+ *   material, the indexed draw from buffer objects, the copy of
+ *   software rendered images into the window and picking faces in it.
+ *   Everything else of PLYObject lives in PLY.cpp and runs without
+ *   OpenGL. Streamed chunks of chunkedMesh are drawn here as well.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#ifndef WIN32
+#define GL_GLEXT_PROTOTYPES
+#endif
+
+#ifdef __APPLE__
+#include <glut/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+
+#ifdef WIN32
+#include <GL/glext.h>
+
+// opengl32.dll only exports GL 1.1, the buffer functions are looked up
+static PFNGLGENBUFFERSPROC glGenBuffers;
+static PFNGLDELETEBUFFERSPROC glDeleteBuffers;
+static PFNGLBINDBUFFERPROC glBindBuffer;
+static PFNGLBUFFERDATAPROC glBufferData;
+#endif
+
+#include "PLY.h"
+#include "geometry.h"
+#include "lighting.h"
+#include "rasterizer.h"
+#include "viewModule.h"
+#include "profiler.h"
+#include "chunkedMesh.h"
+#include "bvh.h"
+
+extern int light;
+extern int objectSpace;
+extern int shadows;
+extern int ambientOcclusion;
+
+// Light and other info
+extern Vector3f viewer_pos;
+extern LightList lights;
+extern GLfloat current_pos[];
+extern perspectiveData pD;
+
+// Material properties of PLY.cpp
+extern float ambient[4], diffuse[4], specular[4], shininess[1];
+
+
+// Fill a lighting context from the current GL state, the light list and
+// the material of PLY.cpp
+static void captureLighting(LightingContext &ctx)
+{
+  float M[16];
+  Vector4f As;
+
+  // Get ModelView
+  glGetFloatv(GL_MODELVIEW_MATRIX, M);
+  for (int i = 0; i < 3; i++) {
+    ctx.modelView[i][3] = 0.0;
+    ctx.modelView[3][i] = 0.0;
+    for (int j = 0; j < 3; j++)
+      ctx.modelView[i][j] = M[i*4+j];
+  }
+  ctx.modelView[3][3] = 1.0;
+
+  normalizeVector(ctx.eyeDir, viewer_pos);
+
+  // Get the global ambient, the lights come from the list
+  glGetFloatv(GL_LIGHT_MODEL_AMBIENT, As);
+  setMaterialLighting(ctx, As, lights);
+  ctx.shadows = shadows;
+  ctx.occlusion = ambientOcclusion;
+  if (objectSpace)
+    toObjectSpace(ctx);
+}
+
+
+// Hand the light list to OpenGL. The positions are set under an identity
+// modelview, so the lights stay fixed to the eye. Only the first
+// GL_MAX_LIGHTS lights (at least 8) exist for OpenGL lighting.
+static void uploadLights()
+{
+  static int enabled = 0;
+  GLint maxLights;
+  int i, n;
+
+  glGetIntegerv(GL_MAX_LIGHTS, &maxLights);
+  n = lights.n < maxLights ? lights.n : maxLights;
+
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  for (i = 0; i < n; i++) {
+    const Light &l = lights.lights[i];
+
+    glLightfv(GL_LIGHT0 + i, GL_POSITION, l.position);
+    glLightfv(GL_LIGHT0 + i, GL_AMBIENT, l.ambient);
+    glLightfv(GL_LIGHT0 + i, GL_DIFFUSE, l.diffuse);
+    glLightfv(GL_LIGHT0 + i, GL_SPECULAR, l.specular);
+    glLightf(GL_LIGHT0 + i, GL_CONSTANT_ATTENUATION, l.constantAttenuation);
+    glLightf(GL_LIGHT0 + i, GL_LINEAR_ATTENUATION, l.linearAttenuation);
+    glLightf(GL_LIGHT0 + i, GL_QUADRATIC_ATTENUATION, l.quadraticAttenuation);
+    glEnable(GL_LIGHT0 + i);
+  }
+  glPopMatrix();
+
+  // switch off lights removed since the last frame
+  for (; i < enabled; i++)
+    glDisable(GL_LIGHT0 + i);
+  enabled = n;
+}
+
+
+//##########################################
+// Indexed drawing from buffer objects
+
+// buffer objects are core since GL 1.5
+static bool buffersSupported()
+{
+  const char *version = (const char*)glGetString(GL_VERSION);
+  int major = 0, minor = 0;
+
+  if (!version || sscanf(version, "%d.%d", &major, &minor) != 2)
+    return false;
+  if (major < 1 || (major == 1 && minor < 5))
+    return false;
+
+#ifdef WIN32
+  glGenBuffers = (PFNGLGENBUFFERSPROC)wglGetProcAddress("glGenBuffers");
+  glDeleteBuffers = (PFNGLDELETEBUFFERSPROC)wglGetProcAddress("glDeleteBuffers");
+  glBindBuffer = (PFNGLBINDBUFFERPROC)wglGetProcAddress("glBindBuffer");
+  glBufferData = (PFNGLBUFFERDATAPROC)wglGetProcAddress("glBufferData");
+  if (!glGenBuffers || !glDeleteBuffers || !glBindBuffer || !glBufferData)
+    return false;
+#endif
+  return true;
+}
+
+
+// upload data into buffer b unless it already holds that stamp
+void PLYObject::updateBuffer(int b, const void *data, size_t size, unsigned int stamp)
+{
+  bool indices = b == VBO_INDICES || b == VBO_LODS;
+  GLenum target = indices ? GL_ELEMENT_ARRAY_BUFFER : GL_ARRAY_BUFFER;
+  GLenum usage = (indices || b == VBO_NORMALS) ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW;
+
+  glBindBuffer(target, vbo[b]);
+  if (vboStamps[b] != stamp) {
+    glBufferData(target, size, data, usage);
+    vboStamps[b] = stamp;
+  }
+}
+
+
+static void releaseObjectBuffers(PLYObject *ply)
+{
+  ply->releaseBuffers();
+}
+
+
+// Draw the faces of the current level of detail with one
+// glDrawElements, or after a cull one per run of consecutive visible
+// units. With buffer objects the arrays are sent to GL once
+// and again only after they changed: the colors after user lighting,
+// the positions after eat, starve, dance and resize, normals and
+// indices after invertNormals.
+void PLYObject::drawElements()
+{
+  PROFILE_SCOPE("submit");
+  int count = lod > 0 ? lodCount[lod] : nf;
+  size_t first = lod > 0 ? lodFirst[lod] : 0;
+  size_t indices;		// address of the index array, 0 in a buffer
+
+  if (vboMode < 0) {
+    vboMode = buffersSupported() ? 1 : 0;
+    if (vboMode) {
+      glGenBuffers(VBO_COUNT, vbo);
+      bufferRelease = releaseObjectBuffers;
+    }
+  }
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_NORMAL_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+
+  if (vboMode) {
+    updateBuffer(VBO_POSITIONS, vertices, nv * sizeof(Vector3f), positionStamp);
+    glVertexPointer(3, GL_FLOAT, 0, 0);
+    updateBuffer(VBO_NORMALS, normals, nv * sizeof(Vector3f), normalStamp);
+    glNormalPointer(GL_FLOAT, 0, 0);
+    updateBuffer(VBO_COLORS, colors, nv * sizeof(Color3u), colorStamp);
+    glColorPointer(3, GL_UNSIGNED_BYTE, 0, 0);
+    if (lod > 0)
+      updateBuffer(VBO_LODS, lodFaces, (lodFirst[nlods-1] + lodCount[nlods-1]) * sizeof(Index3i), lodStamp);
+    else
+      updateBuffer(VBO_INDICES, faces, nf * sizeof(Index3i), faceStamp);
+    indices = 0;
+  }
+  else {
+    // plain vertex arrays read from client memory every frame
+    glVertexPointer(3, GL_FLOAT, 0, vertices);
+    glNormalPointer(GL_FLOAT, 0, normals);
+    glColorPointer(3, GL_UNSIGNED_BYTE, 0, colors);
+    indices = (size_t)(lod > 0 ? lodFaces : faces);
+  }
+
+  if (culled) {
+    const std::vector<int> &visible = bvh->visible;
+    for (size_t i = 0; i < visible.size(); ) {
+      first = bvh->units[visible[i]].first;
+      count = bvh->units[visible[i]].count;
+      for (i++; i < visible.size() && visible[i] == visible[i-1] + 1; i++)
+        count += bvh->units[visible[i]].count;
+      glDrawElements(GL_TRIANGLES, 3 * count, GL_UNSIGNED_INT, (void*)(indices + first * sizeof(Index3i)));
+    }
+  }
+  else
+    glDrawElements(GL_TRIANGLES, 3 * count, GL_UNSIGNED_INT, (void*)(indices + first * sizeof(Index3i)));
+
+  if (vboMode) {
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glDisableClientState(GL_COLOR_ARRAY);
+}
+
+
+void PLYObject::releaseBuffers()
+{
+  // buffers only exist once a GL context has drawn the object
+  if (vboMode > 0)
+    glDeleteBuffers(VBO_COUNT, vbo);
+  vboMode = -1;
+  for (int b = 0; b < VBO_COUNT; b++)
+    vbo[b] = vboStamps[b] = 0;
+}
+
+
+void PLYObject::draw()
+{
+
+  // setup default material
+  glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, specular);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
+  glColor3fv(diffuse);
+
+  // fewer faces the smaller the object appears
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  selectLOD(length(current_pos), pD.fieldOfView, viewport[3]);
+
+  // cull the full mesh against the frustum of pD, the levels are small
+  culled = false;
+  if (bvh && lod == 0) {
+    float M[16];
+    Matrix4f modelView, projection;
+
+    glGetFloatv(GL_MODELVIEW_MATRIX, M);
+    for (int i = 0; i < 4; i++)
+      for (int j = 0; j < 4; j++)
+        modelView[i][j] = M[j*4+i];
+    perspectiveMatrix(projection, pD);
+    cull(modelView, projection);
+  }
+
+  // set lighting if enabled
+  // Otherwise, compute colors
+  if (light) {
+    uploadLights();
+    glEnable(GL_LIGHTING);
+  }
+  else {
+    glDisable(GL_LIGHTING);
+
+    // Instead of asking GL for every vertex, grab the state once per frame
+    LightingContext ctx;
+    captureLighting(ctx);
+    shade(ctx);
+  }
+
+	// Now do the actual drawing of the model
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  drawElements();
+
+  glDisable(GL_POLYGON_OFFSET_FILL);
+  if (hascolor)
+    glDisable(GL_COLOR_MATERIAL);
+
+  // outline the picked face on top
+  if (picked >= 0) {
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glColor3f(1.0, 0.0, 0.0);
+    glBegin(GL_LINE_LOOP);
+    for (int j = 0; j < 3; j++)
+      glVertex3fv(vertices[faces[picked][j]]);
+    glEnd();
+    glEnable(GL_DEPTH_TEST);
+  }
+}
+
+
+// Pick the face under window pixel x, y, counted from the top left as
+// GLUT does, in the view of the last frame, whose modelview is still
+// loaded. The ray runs from the near to the far plane.
+int PLYObject::pickPixel(int x, int y)
+{
+  GLdouble M[16], P[16], wx, wy, p[2][3];
+  GLint viewport[4];
+  Vector3f origin, dir;
+  float t = 1.0;
+
+  glGetDoublev(GL_MODELVIEW_MATRIX, M);
+  glGetDoublev(GL_PROJECTION_MATRIX, P);
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  wx = x + 0.5;
+  wy = viewport[3] - y - 0.5;
+  for (int k = 0; k < 2; k++)
+    if (!gluUnProject(wx, wy, k, M, P, viewport, &p[k][0], &p[k][1], &p[k][2]))
+      return picked = -1;
+
+  for (int i = 0; i < 3; i++) {
+    origin[i] = p[0][i];
+    dir[i] = p[1][i] - p[0][i];
+  }
+  picked = pick(origin, dir, t);
+  return picked;
+}
+
+
+
+
+// Per-pixel Phong shading: the software rasterizer lights every pixel
+// with the GL state draw() would use and the image is copied into the
+// window
+void PLYObject::drawPixels(Rasterizer &raster)
+{
+  float M[16], P[16];
+  Matrix4f modelView, projection;
+  LightingContext ctx;
+
+  captureLighting(ctx);
+  glGetFloatv(GL_MODELVIEW_MATRIX, M);
+  glGetFloatv(GL_PROJECTION_MATRIX, P);
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++) {
+      modelView[i][j] = M[j*4+i];
+      projection[i][j] = P[j*4+i];
+    }
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, raster.clearColor);
+
+  raster.render(this, modelView, projection, &ctx);
+
+  // the rows of the image go down, start at the top left corner
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_LIGHTING);
+
+  glRasterPos2f(-1.0, 1.0);
+  glPixelZoom(1.0, -1.0);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glDrawPixels(raster.width, raster.height, GL_RGB, GL_UNSIGNED_BYTE, raster.color);
+  glPixelZoom(1.0, 1.0);
+
+  glEnable(GL_DEPTH_TEST);
+  glPopMatrix();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+}
+
+
+// Draw the chunks of stream that are in view and in memory with the
+// current GL matrices, lit like draw() lights PLY objects
+void drawChunks(ChunkStream &stream)
+{
+  float M[16], P[16];
+  Matrix4f modelView, projection;
+
+  glGetFloatv(GL_MODELVIEW_MATRIX, M);
+  glGetFloatv(GL_PROJECTION_MATRIX, P);
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++) {
+      modelView[i][j] = M[j*4+i];
+      projection[i][j] = P[j*4+i];
+    }
+  stream.update(modelView, projection);
+
+  glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, diffuse);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, specular);
+  glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
+  glColor3fv(diffuse);
+
+  if (light) {
+    uploadLights();
+    glEnable(GL_LIGHTING);
+  }
+  else {
+    LightingContext ctx;
+    glDisable(GL_LIGHTING);
+    captureLighting(ctx);
+    stream.shade(ctx);
+  }
+
+  // client arrays, the chunks come and go too often for buffer objects
+  PROFILE_SCOPE("submit");
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_NORMAL_ARRAY);
+  if (!light)
+    glEnableClientState(GL_COLOR_ARRAY);
+  for (size_t i = 0; i < stream.drawable.size(); i++) {
+    Chunk &c = stream.chunks[stream.drawable[i]];
+    glVertexPointer(3, GL_FLOAT, 0, c.vertices);
+    glNormalPointer(GL_FLOAT, 0, c.normals);
+    if (!light)
+      glColorPointer(3, GL_UNSIGNED_BYTE, 0, c.colors);
+    glDrawElements(GL_TRIANGLES, 3 * c.info.nf, GL_UNSIGNED_INT, c.faces);
+  }
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glDisableClientState(GL_NORMAL_ARRAY);
+  glDisableClientState(GL_COLOR_ARRAY);
+}
@@ -0,0 +1,69 @@
+/* File: arena
+ * Description:
+ *   Bump allocation out of one aligned block. Nothing is freed piece by
+ *   piece; a mesh gives back all its arrays at once and the next mesh
+ *   of at most the same size reuses the block without touching the heap.
+ */
+
+#include <string.h>
+
+#include "arena.h"
+#include "simd.h"
+
+
+void initArena(Arena &a)
+{
+  a.base = NULL;
+  a.capacity = a.used = 0;
+  a.allocate = simdAlloc;
+  a.release = simdFree;
+}
+
+
+size_t arenaSize(size_t size)
+{
+  return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+
+bool reserveArena(Arena &a, size_t size)
+{
+  a.used = 0;
+  if (size <= a.capacity)
+    return true;
+
+  freeArena(a);
+  if (!(a.base = (char*)a.allocate(size)))
+    return false;
+  a.capacity = size;
+  return true;
+}
+
+
+void *arenaAlloc(Arena &a, size_t size)
+{
+  size_t n = arenaSize(size);
+  char *p;
+
+  if (!a.base || n > a.capacity - a.used)
+    return NULL;
+  p = a.base + a.used;
+  a.used += n;
+  memset(p, 0, size);
+  return p;
+}
+
+
+void resetArena(Arena &a)
+{
+  a.used = 0;
+}
+
+
+void freeArena(Arena &a)
+{
+  if (a.base)
+    a.release(a.base);
+  a.base = NULL;
+  a.capacity = a.used = 0;
+}
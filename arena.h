@@ -0,0 +1,42 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/* File: arena
+ * Description:
+ *   One block of memory handed out front to back in aligned pieces,
+ *   released and reused as a whole
+ */
+
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT 64		// start of every piece, a cache line
+
+
+struct Arena {
+  char *base;			// the block, NULL until the first reserveArena()
+  size_t capacity, used;	// bytes in the block, bytes handed out
+  // where blocks come from, simdAlloc() and simdFree() unless changed
+  // after initArena(); allocate has to return ARENA_ALIGNMENT aligned memory
+  void *(*allocate)(size_t size);
+  void (*release)(void *p);
+};
+
+
+void initArena(Arena &a);
+
+// size rounded up to ARENA_ALIGNMENT, the room a piece of size bytes takes
+size_t arenaSize(size_t size);
+
+// Drop all pieces and make sure the block holds size bytes. A block that
+// is large enough is kept, a smaller one is replaced. Return false if
+// no block could be allocated.
+bool reserveArena(Arena &a, size_t size);
+
+// next size bytes of the block, zeroed and aligned, NULL if they do not fit
+void *arenaAlloc(Arena &a, size_t size);
+
+// drop all pieces, keeping the block for the next reserveArena()
+void resetArena(Arena &a);
+void freeArena(Arena &a);
+
+#endif
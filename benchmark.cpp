@@ -0,0 +1,425 @@
+/* File: benchmark
+ * Description:
+ *   Microbenchmarks of the geometry, loading and shading code without
+ *   OpenGL or a window. Every case runs on bunny.ply (or the given file)
+ *   and on synthetic grid meshes of 10k triangles and up, and is repeated
+ *   until it took at least a minimum time and a minimum number of runs.
+ *   The table gives the mean time per element with its standard
+ *   deviation and the throughput; -j also writes the results as JSON.
+ *
+ *   benchmark [-m maxTriangles] [-t seconds] [-r runs] [-j results.json] [file.ply]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include <functional>
+
+#include "PLY.h"
+#include "geometry.h"
+#include "lighting.h"
+#include "threadPool.h"
+#include "simd.h"
+#include "bvh.h"
+#include "occlusion.h"
+
+
+#define MAX_RUNS 100000
+
+struct Result {
+  char name[32];		// case
+  char mesh[32];		// mesh it ran on
+  long long elements;		// vertices, faces or operations per run
+  int runs;
+  double mean, stddev, best;	// ns per element
+};
+
+static std::vector<Result> results;
+static double minSeconds = 0.2;	// least time spent in each case
+static int minRuns = 5;		// least number of runs of each case
+
+typedef std::chrono::steady_clock Clock;
+
+
+static double seconds(Clock::time_point start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+
+// Repeat run, which returns the seconds it measured, after one warm-up
+// run and record the statistics of the time per element
+static void measure(const char *name, const char *mesh, long long elements,
+                    const std::function<double()> &run)
+{
+  std::vector<double> ns;
+  double total = 0.0, sum = 0.0, var = 0.0;
+  Result r;
+
+  if (elements <= 0)
+    return;
+
+  run();
+  while ((int)ns.size() < minRuns || (total < minSeconds && ns.size() < MAX_RUNS)) {
+    double t = run();
+    ns.push_back(t * 1e9 / elements);
+    total += t;
+  }
+
+  r.best = ns[0];
+  for (size_t i = 0; i < ns.size(); i++) {
+    sum += ns[i];
+    if (ns[i] < r.best)
+      r.best = ns[i];
+  }
+  r.mean = sum / ns.size();
+  for (size_t i = 0; i < ns.size(); i++)
+    var += (ns[i] - r.mean) * (ns[i] - r.mean);
+  r.stddev = ns.size() > 1 ? sqrt(var / (ns.size() - 1)) : 0.0;
+
+  snprintf(r.name, sizeof(r.name), "%s", name);
+  snprintf(r.mesh, sizeof(r.mesh), "%s", mesh);
+  r.elements = elements;
+  r.runs = ns.size();
+  results.push_back(r);
+
+  printf("%-18s %-10s %10lld %6d %10.2f %8.2f %10.2f %10.1f\n", r.name, r.mesh, r.elements,
+         r.runs, r.mean, r.stddev, r.best, 1e3 / r.mean);
+  fflush(stdout);
+}
+
+
+// time the whole of fn
+static double timed(const std::function<void()> &fn)
+{
+  Clock::time_point start = Clock::now();
+
+  fn();
+  return seconds(start);
+}
+
+
+// ASCII PLY of a k by k grid of quads over a bumpy surface, two
+// triangles each, in a temporary file
+static FILE *gridMesh(int k)
+{
+  FILE *out = tmpfile();
+  int i, j;
+
+  if (!out) {
+    fprintf(stderr, "Error: could not create a temporary file.\n");
+    exit(1);
+  }
+
+  fprintf(out, "ply\nformat ascii 1.0\nelement vertex %d\n", (k + 1) * (k + 1));
+  fprintf(out, "property float x\nproperty float y\nproperty float z\n");
+  fprintf(out, "element face %d\nproperty list uchar int vertex_indices\nend_header\n", 2 * k * k);
+
+  for (i = 0; i <= k; i++)
+    for (j = 0; j <= k; j++) {
+      float x = (float)j / k, y = (float)i / k;
+      fprintf(out, "%g %g %g\n", x, y, 0.05 * sin(20.0 * x) * cos(20.0 * y));
+    }
+  for (i = 0; i < k; i++)
+    for (j = 0; j < k; j++) {
+      int a = i * (k + 1) + j, b = a + 1, c = a + k + 1, d = c + 1;
+      fprintf(out, "3 %d %d %d\n3 %d %d %d\n", a, b, d, a, d, c);
+    }
+  fflush(out);
+  return out;
+}
+
+
+// the default light and view of the viewer, as renderBatch() sets them
+static void setupLighting(LightingContext &ctx)
+{
+  Vector4f position = {-100.0, 100.0, 100.0, 0.0}, color = {0.6, 0.6, 0.6, 1.0};
+  Vector4f ambientLight = {0.3, 0.3, 0.3, 1.0}, black = {0.0, 0.0, 0.0, 1.0};
+  Vector3f viewer = {0.0, 0.0, 5.0};
+  float a = 20.0 * M_PI / 180.0, b = 30.0 * M_PI / 180.0;
+  LightList lights;
+  Light l;
+  int i;
+
+  initLightList(lights);
+  for (i = 0; i < 4; i++) {
+    l.position[i] = position[i];
+    l.ambient[i] = ambientLight[i];
+    l.diffuse[i] = l.specular[i] = color[i];
+  }
+  l.constantAttenuation = 1.0;
+  l.linearAttenuation = l.quadraticAttenuation = 0.0;
+  addLight(lights, l);
+
+  // rotation by b about x after a about y
+  emptyMatrix(ctx.modelView);
+  ctx.modelView[0][0] = cos(a);
+  ctx.modelView[0][2] = sin(a);
+  ctx.modelView[1][0] = sin(b) * sin(a);
+  ctx.modelView[1][1] = cos(b);
+  ctx.modelView[1][2] = -sin(b) * cos(a);
+  ctx.modelView[2][0] = -cos(b) * sin(a);
+  ctx.modelView[2][1] = sin(b);
+  ctx.modelView[2][2] = cos(b) * cos(a);
+  ctx.modelView[3][3] = 1.0;
+  normalizeVector(ctx.eyeDir, viewer);
+  setMaterialLighting(ctx, black, lights);
+}
+
+
+// the reading cases, each run parses in a fresh object
+static void benchmarkReading(FILE *in, const char *mesh, int nv, int nf)
+{
+  measure("readVertices", mesh, nv, [&]() {
+    PLYObject p;
+    rewind(in);
+    p.checkHeader(in);
+    p.allocate(true);
+    return timed([&]() { p.readVertices(in); });
+  });
+  measure("readFaces", mesh, nf, [&]() {
+    PLYObject p;
+    rewind(in);
+    p.checkHeader(in);
+    p.allocate(true);
+    p.readVertices(in);
+    return timed([&]() { p.readFaces(in); });
+  });
+}
+
+
+// the cases run on a loaded object
+static void benchmarkObject(PLYObject *ply, const char *mesh)
+{
+  int nv = ply->nv, nf = ply->nf, i;
+  std::vector<float> scratch(3 * (size_t)(nv > nf ? nv : nf));
+  Vector3f *out = (Vector3f*)&scratch[0];
+  Vector3f *saved = new Vector3f[nv];
+  Matrix4f m, products[64];
+  LightingContext ctx;
+
+  setupLighting(ctx);
+  for (i = 0; i < 64; i++)
+    memcpy(products[i], ctx.modelView, sizeof(Matrix4f));
+
+  measure("multVector", mesh, nv, [&]() {
+    return timed([&]() {
+      for (int i = 0; i < nv; i++)
+        multVector(out[i], ctx.modelView, ply->vertices[i]);
+    });
+  });
+  measure("transformPoints", mesh, nv, [&]() {
+    return timed([&]() { transformPoints(out, ctx.modelView, ply->vertices, nv); });
+  });
+
+  // the products feed back into the next, so none can be left out
+  measure("multMatrix", mesh, nv, [&]() {
+    return timed([&]() {
+      for (int i = 0; i < nv; i++) {
+        multMatrix(m, products[i & 63], ctx.modelView);
+        memcpy(products[(i + 1) & 63], m, sizeof(Matrix4f));
+      }
+    });
+  });
+
+  memcpy(out, ply->normals, nv * sizeof(Vector3f));
+  measure("normalize", mesh, nv, [&]() {
+    return timed([&]() {
+      for (int i = 0; i < nv; i++)
+        normalize(out[i]);
+    });
+  });
+  measure("normalizeVectors", mesh, nv, [&]() {
+    return timed([&]() { normalizeVectors(out, ply->normals, nv); });
+  });
+
+  measure("normal", mesh, nf, [&]() {
+    return timed([&]() {
+      for (int i = 0; i < nf; i++) {
+        int *f = ply->faces[i];
+        normal(out[i], ply->vertices[f[0]], ply->vertices[f[1]], ply->vertices[f[2]]);
+      }
+    });
+  });
+  measure("triangleNormals", mesh, nf, [&]() {
+    return timed([&]() { triangleNormals(out, ply->vertices, ply->faces, nf); });
+  });
+
+  // one thread with the reference loop, then the stream kernels on the pool
+  measure("shadeVertices", mesh, nv, [&]() {
+    return timed([&]() { shadeVertices(ctx, ply->vertices, ply->normals, ply->colors, 0, nv); });
+  });
+  ply->updateShadingStreams();
+  measure("shadeParallel", mesh, nv, [&]() {
+    return timed([&]() { ply->shadeParallel(ctx); });
+  });
+
+  // resize() scales in place, so every run starts from the same vertices
+  memcpy(saved, ply->vertices, nv * sizeof(Vector3f));
+  measure("resize", mesh, nv, [&]() {
+    memcpy(ply->vertices, saved, nv * sizeof(Vector3f));
+    return timed([&]() { ply->resize(); });
+  });
+
+  // the hierarchy is built as it comes, then the faces are put in its
+  // order for the refits and rays, and back after them
+  std::vector<int> order(nf);
+  std::vector<int> facesBefore(&ply->faces[0][0], &ply->faces[0][0] + 3 * (size_t)nf);
+  BVH bvh;
+  measure("bvhBuild", mesh, nf, [&]() {
+    return timed([&]() { bvh.build(ply->vertices, ply->faces, nf, ply->pool, &order[0]); });
+  });
+  for (i = 0; i < nf; i++)
+    memcpy(ply->faces[i], &facesBefore[3 * (size_t)order[i]], sizeof(Index3i));
+  measure("bvhRefit", mesh, nf, [&]() {
+    return timed([&]() { bvh.refit(ply->vertices, ply->faces, ply->pool); });
+  });
+
+  // rays straight down onto the mesh next to each vertex
+  measure("bvhIntersect", mesh, nv, [&]() {
+    return timed([&]() {
+      Vector3f origin, dir = {0.0, 0.0, -1.0};
+      for (int i = 0; i < nv; i++) {
+        float t = 10.0;
+        origin[0] = ply->vertices[i][0] + 1e-4f;
+        origin[1] = ply->vertices[i][1] + 1e-4f;
+        origin[2] = 5.0;
+        bvh.intersect(ply->vertices, ply->faces, origin, dir, t);
+      }
+    });
+  });
+
+  // shadow rays of all vertices to a light above the mesh; the vertices
+  // keep the file order, so the packets are less coherent than after
+  // buildBVH() renumbered them
+  std::vector<float> visible(nv);
+  Vector3f light = {1.0, 3.0, 1.0};
+  ply->updateShadingStreams();
+  measure("bvhShadows", mesh, nv, [&]() {
+    return timed([&]() { bvh.traceShadows(ply->vertices, ply->faces, ply->streams, light, &visible[0], 0, nv); });
+  });
+
+  // the hemisphere packets of the ambient occlusion bake, for no more
+  // than the first 16k vertices: every vertex casts OCCLUSION_RAYS rays
+  std::vector<float> open(nv);
+  int baked = nv < 16384 ? nv : 16384;
+  float outside = outsideSign(ply->vertices, ply->faces, nf);
+  measure("occlusion", mesh, baked, [&]() {
+    return timed([&]() { traceOcclusion(bvh, ply->vertices, ply->normals, ply->faces, outside, &open[0], 0, baked); });
+  });
+  memcpy(&ply->faces[0][0], &facesBefore[0], 3 * (size_t)nf * sizeof(int));
+
+  delete [] saved;
+}
+
+
+static void benchmarkFile(FILE *in, const char *mesh)
+{
+  PLYObject *ply;
+
+  rewind(in);
+  ply = new PLYObject(in);
+  if (ply->nv == 0 || ply->nf == 0) {
+    fprintf(stderr, "Error: no mesh to benchmark in %s.\n", mesh);
+    exit(1);
+  }
+
+  benchmarkReading(in, mesh, ply->nv, ply->nf);
+  benchmarkObject(ply, mesh);
+  delete ply;
+}
+
+
+static bool writeJSON(const char *filename, int threads)
+{
+  FILE *out = fopen(filename, "w");
+
+  if (!out) {
+    fprintf(stderr, "Error: could not write %s.\n", filename);
+    return false;
+  }
+
+  fprintf(out, "{\n  \"simd\": \"%s\",\n  \"threads\": %d,\n", simdName(simdLevel()), threads);
+  fprintf(out, "  \"minSeconds\": %g,\n  \"minRuns\": %d,\n  \"results\": [\n", minSeconds, minRuns);
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    fprintf(out, "    {\"name\": \"%s\", \"mesh\": \"%s\", \"elements\": %lld, \"runs\": %d, "
+            "\"nsPerElement\": %.4f, \"stddev\": %.4f, \"variance\": %.4f, \"best\": %.4f, "
+            "\"millionPerSecond\": %.3f}%s\n",
+            r.name, r.mesh, r.elements, r.runs, r.mean, r.stddev, r.stddev * r.stddev, r.best,
+            1e3 / r.mean, i + 1 < results.size() ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+  fclose(out);
+  return true;
+}
+
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [-m maxTriangles] [-t seconds] [-r runs] [-j results.json] [file.ply]\n", name);
+  exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+  const char *filename = "bunny.ply", *json = NULL;
+  long long maxTriangles = 1000000, n;
+  char mesh[32];
+  int i, threads;
+  FILE *in;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-m") && i + 1 < argc)
+      maxTriangles = atoll(argv[++i]);
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+      minSeconds = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      minRuns = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+      json = argv[++i];
+    else if (argv[i][0] == '-')
+      usage(argv[0]);
+    else
+      filename = argv[i];
+  }
+  if (minRuns < 1)
+    minRuns = 1;
+
+  {
+    PLYObject probe;
+    threads = probe.pool->size();
+  }
+  printf("simd %s, %d threads, at least %g s and %d runs per case\n\n",
+         simdName(simdLevel()), threads, minSeconds, minRuns);
+  printf("%-18s %-10s %10s %6s %10s %8s %10s %10s\n", "case", "mesh", "elements", "runs",
+         "ns/elem", "stddev", "best", "M/s");
+
+  if (!(in = fopen(filename, "rb"))) {
+    fprintf(stderr, "Error: cannot open input file %s.\n", filename);
+    return 1;
+  }
+  benchmarkFile(in, filename);
+  fclose(in);
+
+  // synthetic grids of 10k, 100k, ... triangles
+  for (n = 10000; n <= maxTriangles; n *= 10) {
+    int k = (int)sqrt(n / 2.0);
+
+    if (n >= 1000000)
+      snprintf(mesh, sizeof(mesh), "grid%lldM", n / 1000000);
+    else
+      snprintf(mesh, sizeof(mesh), "grid%lldk", n / 1000);
+    in = gridMesh(k);
+    benchmarkFile(in, mesh);
+    fclose(in);
+  }
+
+  if (json && !writeJSON(json, threads))
+    return 1;
+  return 0;
+}
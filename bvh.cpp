@@ -0,0 +1,814 @@
+/* File: bvh
+ * Description:
+ *   The build sorts the face box centers of a node into BVH_BINS bins
+ *   along the longest axis of the centers and splits at the bin border
+ *   of the lowest surface area cost, or makes a leaf when testing all
+ *   its faces costs less. The bins also bound the faces and centers of
+ *   both children, so every face is visited twice per level: binned and
+ *   partitioned.
+ *   The faces are partitioned stably, so faces that stay together keep
+ *   the order they had. Nodes of at least BVH_PARALLEL_FACES faces are
+ *   binned by all threads of the pool one after the other from the root
+ *   down; the smaller subtrees below them are built one per thread.
+ *   Nodes are taken in pairs from a shared counter, which is all the
+ *   threads share, and children always come after their parents.
+ *
+ *   No node is deeper than BVH_MAX_DEPTH, so the traversals keep their
+ *   stacks on the C stack.
+ *
+ *   The mesh may reorder the faces within each unit for the vertex
+ *   cache after the build. The leaves then find their faces through
+ *   leafFaces, while units and the nodes above them stay ranges of the
+ *   faces as they are drawn.
+ *
+ *   Shadow and occlusion rays only ask whether anything is in the way,
+ *   so a packet of segments goes down the tree with a mask of the rays
+ *   still unblocked that hit the node, and a ray leaves the packet at
+ *   its first hit. The segments of a packet end at the same light or
+ *   start at the same vertex; a node outside the box around them is
+ *   skipped without testing the rays one by one. The edges of a leaf
+ *   face are computed once for all rays.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include "bvh.h"
+#include "lighting.h"
+#include "threadPool.h"
+
+
+struct FaceBox {
+  Vector3f min, max, center;
+};
+
+// faces in a bin and the bounds of them and of their centers
+struct Bin {
+  Vector3f min, max;
+  Vector3f cmin, cmax;
+  int count;
+};
+
+// the bins of one node, no more than it has faces
+struct NodeBins {
+  int axis;
+  float cmin, scale;		// bin of a center c is (c[axis] - cmin) * scale
+  int nbins;
+  Bin bins[BVH_BINS];
+};
+
+struct Build {
+  std::vector<FaceBox> boxes;
+  std::vector<Bin> bounds;	// faces and centers of every node, set by its parent
+  int *order;
+  BVHNode *nodes;
+  std::atomic<int> nnodes;
+  ThreadPool *pool;
+};
+
+
+static void emptyBox(Vector3f lo, Vector3f hi)
+{
+  for (int i = 0; i < 3; i++) {
+    lo[i] = FLT_MAX;
+    hi[i] = -FLT_MAX;
+  }
+}
+
+
+static void growBox(Vector3f lo, Vector3f hi, const Vector3f plo, const Vector3f phi)
+{
+  // min and max without branches, the faces come in no order
+  for (int i = 0; i < 3; i++) {
+    lo[i] = std::min(lo[i], plo[i]);
+    hi[i] = std::max(hi[i], phi[i]);
+  }
+}
+
+
+static float area(const Vector3f lo, const Vector3f hi)
+{
+  float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+
+  return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+
+static void emptyBin(Bin &bin)
+{
+  emptyBox(bin.min, bin.max);
+  emptyBox(bin.cmin, bin.cmax);
+  bin.count = 0;
+}
+
+
+static void addFace(Bin &bin, const FaceBox &f)
+{
+  growBox(bin.min, bin.max, f.min, f.max);
+  growBox(bin.cmin, bin.cmax, f.center, f.center);
+  bin.count++;
+}
+
+
+static void mergeBin(Bin &bin, const Bin &other)
+{
+  growBox(bin.min, bin.max, other.min, other.max);
+  growBox(bin.cmin, bin.cmax, other.cmin, other.cmax);
+  bin.count += other.count;
+}
+
+
+static inline int binOf(const NodeBins &nb, const FaceBox &f)
+{
+  int k = (int)((f.center[nb.axis] - nb.cmin) * nb.scale);
+
+  return k < 0 ? 0 : k >= nb.nbins ? nb.nbins - 1 : k;
+}
+
+
+static void binRange(const Build &b, int begin, int end, NodeBins &nb)
+{
+  for (int i = begin; i < end; i++) {
+    const FaceBox &f = b.boxes[b.order[i]];
+    addFace(nb.bins[binOf(nb, f)], f);
+  }
+}
+
+
+// Bin faces [begin, end) of a node into nb, in parallel with every
+// thread binning into its own copy, merged at the end
+static void binNode(Build &b, int begin, int end, NodeBins &nb, bool parallel)
+{
+  if (!parallel) {
+    binRange(b, begin, end, nb);
+    return;
+  }
+
+  NodeBins start = nb;
+  std::mutex lock;
+  b.pool->parallelFor(begin, end, BVH_PARALLEL_FACES / 4, [&](int first, int last) {
+    NodeBins part = start;
+    binRange(b, first, last, part);
+    std::lock_guard<std::mutex> guard(lock);
+    for (int k = 0; k < nb.nbins; k++)
+      mergeBin(nb.bins[k], part.bins[k]);
+  });
+}
+
+
+// Lowest cost of splitting at a bin border, the summed areas of both
+// sides times their faces, with the first bin of the right side
+static float findSplit(const NodeBins &nb, int &split)
+{
+  const Bin *bins = nb.bins;
+  float rightArea[BVH_BINS], best = FLT_MAX;
+  int rightCount[BVH_BINS];
+  Vector3f lo, hi;
+  int k, n, last = nb.nbins - 1;
+
+  emptyBox(lo, hi);
+  for (k = last, n = 0; k > 0; k--) {
+    growBox(lo, hi, bins[k].min, bins[k].max);
+    n += bins[k].count;
+    rightArea[k] = n > 0 ? area(lo, hi) : 0.0f;
+    rightCount[k] = n;
+  }
+
+  split = 1;
+  emptyBox(lo, hi);
+  for (k = 1, n = 0; k <= last; k++) {
+    growBox(lo, hi, bins[k-1].min, bins[k-1].max);
+    n += bins[k-1].count;
+    if (n == 0 || rightCount[k] == 0)
+      continue;
+    float cost = area(lo, hi) * n + rightArea[k] * rightCount[k];
+    if (cost < best) {
+      best = cost;
+      split = k;
+    }
+  }
+  return best;
+}
+
+
+// Split node n, whose faces and bounds are set, in two or leave it a
+// leaf. The children get their bounds from the bins. Return true if
+// the node got children.
+static bool splitNode(Build &b, int n, int depth, bool parallel)
+{
+  BVHNode &node = b.nodes[n];
+  const Bin &bounds = b.bounds[n];
+  int first = node.first, end = node.first + node.count;
+  int a, k, split, mid;
+  NodeBins nb;
+
+  memcpy(node.min, bounds.min, sizeof(Vector3f));
+  memcpy(node.max, bounds.max, sizeof(Vector3f));
+  node.left = -1;
+  node.unit = -1;
+  node.nunits = 0;
+  if (node.count == 1 || depth >= BVH_MAX_DEPTH - 1)
+    return false;
+
+  // all centers in one point leave nothing to bin
+  nb.axis = 0;
+  for (a = 1; a < 3; a++)
+    if (bounds.cmax[a] - bounds.cmin[a] > bounds.cmax[nb.axis] - bounds.cmin[nb.axis])
+      nb.axis = a;
+  float extent = bounds.cmax[nb.axis] - bounds.cmin[nb.axis];
+  float cost = FLT_MAX;
+  if (extent > 0.0f) {
+    nb.nbins = std::min(node.count, BVH_BINS);
+    nb.cmin = bounds.cmin[nb.axis];
+    nb.scale = nb.nbins / extent;
+    for (k = 0; k < nb.nbins; k++)
+      emptyBin(nb.bins[k]);
+    binNode(b, first, end, nb, parallel);
+    cost = findSplit(nb, split);
+  }
+  float s = area(node.min, node.max);
+  if (node.count <= BVH_LEAF_FACES && (extent == 0.0f || node.count * s <= BVH_TRAVERSAL_COST * s + cost))
+    return false;
+
+  node.left = b.nnodes.fetch_add(2);
+  Bin &left = b.bounds[node.left], &right = b.bounds[node.left + 1];
+  emptyBin(left);
+  emptyBin(right);
+  if (extent == 0.0f) {
+    // faces with one center cannot be told apart, halve them
+    mid = first + node.count / 2;
+    for (k = first; k < end; k++)
+      addFace(k < mid ? left : right, b.boxes[b.order[k]]);
+  }
+  else {
+    mid = std::stable_partition(b.order + first, b.order + end, [&](int f) {
+        return binOf(nb, b.boxes[f]) < split;
+      }) - b.order;
+    for (k = 0; k < nb.nbins; k++)
+      mergeBin(k < split ? left : right, nb.bins[k]);
+  }
+
+  b.nodes[node.left].first = first;
+  b.nodes[node.left].count = mid - first;
+  b.nodes[node.left + 1].first = mid;
+  b.nodes[node.left + 1].count = end - mid;
+  return true;
+}
+
+
+// build the subtree below n, on the calling thread
+static void buildSubtree(Build &b, int n, int depth)
+{
+  int stack[BVH_MAX_DEPTH + 1], depths[BVH_MAX_DEPTH + 1], top = 0;
+
+  stack[top] = n;
+  depths[top++] = depth;
+  while (top > 0) {
+    top--;
+    n = stack[top];
+    depth = depths[top];
+    if (splitNode(b, n, depth, false)) {
+      stack[top] = b.nodes[n].left + 1;
+      depths[top++] = depth + 1;
+      stack[top] = b.nodes[n].left;
+      depths[top++] = depth + 1;
+    }
+  }
+}
+
+
+// make the first node of at most BVH_UNIT_FACES faces on every path a unit
+static void assignUnits(std::vector<BVHNode> &nodes, std::vector<BVHUnit> &units, int n)
+{
+  BVHNode &node = nodes[n];
+
+  if (node.left < 0 || node.count <= BVH_UNIT_FACES) {
+    BVHUnit u;
+    u.node = n;
+    u.first = node.first;
+    u.count = node.count;
+    u.vfirst = u.vcount = 0;
+    u.neighbors = u.nneighbors = 0;
+    u.shadedEpoch = 0;
+    u.tracedEpoch = 0;
+    node.unit = (int)units.size();
+    node.nunits = 1;
+    units.push_back(u);
+    return;
+  }
+
+  assignUnits(nodes, units, node.left);
+  assignUnits(nodes, units, node.left + 1);
+  node.unit = nodes[node.left].unit;
+  node.nunits = nodes[node.left].nunits + nodes[node.left + 1].nunits;
+}
+
+
+BVH::BVH()
+{
+  visibleFaces = 0;
+  leaves = depth = 0;
+}
+
+
+void BVH::build(const Vector3f *vertices, const Index3i *faces, int nf, ThreadPool *pool, int *order)
+{
+  std::vector<std::pair<int, int> > large, subtrees;	// nodes and their depths
+  std::vector<int> depths;
+  Build b;
+  int n;
+
+  nodes.clear();
+  units.clear();
+  neighbors.clear();
+  visible.clear();
+  leafFaces.clear();
+  visibleFaces = 0;
+  leaves = depth = 0;
+  if (nf == 0)
+    return;
+
+  b.boxes.resize(nf);
+  b.bounds.resize(2 * nf - 1);
+  leafFaces.resize(nf);
+  b.order = order;
+  nodes.resize(2 * nf - 1);
+  b.nodes = nodes.data();
+  b.nnodes = 1;
+  b.pool = pool;
+
+  pool->parallelFor(0, nf, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      FaceBox &f = b.boxes[i];
+      emptyBox(f.min, f.max);
+      for (int j = 0; j < 3; j++)
+        growBox(f.min, f.max, vertices[faces[i][j]], vertices[faces[i][j]]);
+      for (int j = 0; j < 3; j++)
+        f.center[j] = 0.5f * (f.min[j] + f.max[j]);
+      order[i] = i;
+      leafFaces[i] = i;
+    }
+  });
+
+  // the large nodes from the root down, each binned by all threads
+  nodes[0].first = 0;
+  nodes[0].count = nf;
+  emptyBin(b.bounds[0]);
+  for (n = 0; n < nf; n++)
+    addFace(b.bounds[0], b.boxes[n]);
+  large.push_back(std::make_pair(0, 0));
+  while (!large.empty()) {
+    std::pair<int, int> t = large.back();
+    large.pop_back();
+    if (nodes[t.first].count < BVH_PARALLEL_FACES)
+      subtrees.push_back(t);
+    else if (splitNode(b, t.first, t.second, true)) {
+      large.push_back(std::make_pair(nodes[t.first].left, t.second + 1));
+      large.push_back(std::make_pair(nodes[t.first].left + 1, t.second + 1));
+    }
+  }
+
+  // then the subtrees below them, one thread each
+  pool->parallelFor(0, (int)subtrees.size(), 1, [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+      buildSubtree(b, subtrees[i].first, subtrees[i].second);
+  });
+  nodes.resize(b.nnodes);
+
+  assignUnits(nodes, units, 0);
+
+  // the nodes inside a unit belong to it
+  depths.assign(nodes.size(), 0);
+  for (n = 0; n < (int)nodes.size(); n++) {
+    const BVHNode &node = nodes[n];
+    if (node.left < 0) {
+      leaves++;
+      continue;
+    }
+    for (int c = node.left; c <= node.left + 1; c++) {
+      depths[c] = depths[n] + 1;
+      depth = std::max(depth, depths[c]);
+      if (node.nunits == 1) {
+        nodes[c].unit = node.unit;
+        nodes[c].nunits = 1;
+      }
+    }
+  }
+}
+
+
+void BVH::placeFaces(const int *order, const int *placed, int nf)
+{
+  std::vector<int> place(nf);
+
+  for (int k = 0; k < nf; k++)
+    place[placed[k]] = k;
+  for (int k = 0; k < nf; k++)
+    leafFaces[k] = place[order[k]];
+}
+
+
+void BVH::findVertices(const Index3i *faces)
+{
+  std::vector<int> starts(units.size()), owners;
+  int end = 0;
+  size_t u;
+
+  // a unit owns the vertices no unit before it used
+  for (u = 0; u < units.size(); u++) {
+    BVHUnit &unit = units[u];
+    unit.vfirst = end;
+    for (int i = unit.first; i < unit.first + unit.count; i++)
+      for (int j = 0; j < 3; j++)
+        end = std::max(end, faces[i][j] + 1);
+    unit.vcount = end - unit.vfirst;
+    starts[u] = unit.vfirst;
+  }
+
+  neighbors.clear();
+  for (u = 0; u < units.size(); u++) {
+    BVHUnit &unit = units[u];
+    owners.clear();
+    for (int i = unit.first; i < unit.first + unit.count; i++)
+      for (int j = 0; j < 3; j++)
+        if (faces[i][j] < unit.vfirst)
+          owners.push_back(std::upper_bound(starts.begin(), starts.end(), faces[i][j]) - starts.begin() - 1);
+    std::sort(owners.begin(), owners.end());
+    owners.erase(std::unique(owners.begin(), owners.end()), owners.end());
+
+    unit.neighbors = (int)neighbors.size();
+    unit.nneighbors = (int)owners.size();
+    neighbors.insert(neighbors.end(), owners.begin(), owners.end());
+  }
+}
+
+
+void BVH::refit(const Vector3f *vertices, const Index3i *faces, ThreadPool *pool)
+{
+  int n = (int)nodes.size();
+
+  pool->parallelFor(0, n, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      BVHNode &node = nodes[i];
+      if (node.left >= 0)
+        continue;
+      emptyBox(node.min, node.max);
+      for (int f = node.first; f < node.first + node.count; f++) {
+        const int *face = faces[leafFaces[f]];
+        for (int j = 0; j < 3; j++)
+          growBox(node.min, node.max, vertices[face[j]], vertices[face[j]]);
+      }
+    }
+  });
+
+  // children come after their parents
+  for (int i = n - 1; i >= 0; i--) {
+    BVHNode &node = nodes[i];
+    if (node.left < 0)
+      continue;
+    memcpy(node.min, nodes[node.left].min, sizeof(Vector3f));
+    memcpy(node.max, nodes[node.left].max, sizeof(Vector3f));
+    growBox(node.min, node.max, nodes[node.left + 1].min, nodes[node.left + 1].max);
+  }
+}
+
+
+int BVH::cull(const Matrix4f mvp)
+{
+  float planes[6][4];
+  int stack[BVH_MAX_DEPTH + 1], masks[BVH_MAX_DEPTH + 1], top = 0;
+  int j, k;
+
+  visible.clear();
+  visibleFaces = 0;
+  if (nodes.empty())
+    return 0;
+
+  // -w <= x, y, z <= w of clip space as planes in object space
+  for (k = 0; k < 6; k++) {
+    float sign = k & 1 ? -1.0 : 1.0;
+    for (j = 0; j < 4; j++)
+      planes[k][j] = mvp[3][j] + sign * mvp[k / 2][j];
+  }
+
+  // the bit of a plane is cleared once a node is wholly on its inner side
+  stack[top] = 0;
+  masks[top++] = 63;
+  while (top > 0) {
+    top--;
+    const BVHNode &node = nodes[stack[top]];
+    int mask = masks[top];
+    bool out = false;
+
+    for (k = 0; k < 6 && !out; k++) {
+      if (!(mask & 1 << k))
+        continue;
+      // distances of the corners farthest in and farthest out
+      float most = planes[k][3], least = planes[k][3];
+      for (j = 0; j < 3; j++) {
+        float lo = planes[k][j] * node.min[j], hi = planes[k][j] * node.max[j];
+        most += std::max(lo, hi);
+        least += std::min(lo, hi);
+      }
+      if (most < 0.0)
+        out = true;
+      else if (least >= 0.0)
+        mask &= ~(1 << k);
+    }
+    if (out)
+      continue;
+
+    if (mask == 0 || node.nunits == 1) {
+      for (int u = node.unit; u < node.unit + node.nunits; u++)
+        visible.push_back(u);
+      visibleFaces += node.count;
+    }
+    else {
+      stack[top] = node.left + 1;
+      masks[top++] = mask;
+      stack[top] = node.left;
+      masks[top++] = mask;
+    }
+  }
+  return visibleFaces;
+}
+
+
+// entry of the ray into the box before tmax
+static bool hitBox(const BVHNode &node, const Vector3f origin, const Vector3f inv, float tmax, float &tnear)
+{
+  float t0 = 0.0, t1 = tmax;
+
+  for (int i = 0; i < 3; i++) {
+    float a = (node.min[i] - origin[i]) * inv[i], b = (node.max[i] - origin[i]) * inv[i];
+    t0 = std::max(t0, std::min(a, b));
+    t1 = std::min(t1, std::max(a, b));
+  }
+  tnear = t0;
+  return t0 <= t1;
+}
+
+
+// Moeller-Trumbore, t is lowered to the hit if there is one before it
+static bool hitTriangle(const Vector3f p, const Vector3f q, const Vector3f r,
+                        const Vector3f origin, const Vector3f dir, float &t)
+{
+  Vector3f e1, e2, s, h, k;
+  float det, u, v, d;
+
+  sub(e1, q, p);
+  sub(e2, r, p);
+  vecProd(h, dir, e2);
+  det = dotProd(e1, h);
+  if (det == 0.0)
+    return false;
+
+  sub(s, origin, p);
+  u = dotProd(s, h) / det;
+  if (u < 0.0 || u > 1.0)
+    return false;
+  vecProd(k, s, e1);
+  v = dotProd(dir, k) / det;
+  if (v < 0.0 || u + v > 1.0)
+    return false;
+
+  d = dotProd(e2, k) / det;
+  if (d <= 0.0 || d >= t)
+    return false;
+  t = d;
+  return true;
+}
+
+
+int BVH::intersect(const Vector3f *vertices, const Index3i *faces, const Vector3f origin,
+                   const Vector3f dir, float &t) const
+{
+  int stack[BVH_MAX_DEPTH + 1], top = 0, hit = -1;
+  float entry[BVH_MAX_DEPTH + 1], tnear;
+  Vector3f inv;
+
+  for (int i = 0; i < 3; i++)
+    inv[i] = 1.0f / dir[i];
+  if (nodes.empty() || !hitBox(nodes[0], origin, inv, t, tnear))
+    return -1;
+
+  // nearer child first, nodes behind the nearest hit so far are skipped
+  stack[top] = 0;
+  entry[top++] = tnear;
+  while (top > 0) {
+    top--;
+    if (entry[top] >= t)
+      continue;
+    const BVHNode &node = nodes[stack[top]];
+
+    if (node.left < 0) {
+      for (int f = node.first; f < node.first + node.count; f++) {
+        const int *face = faces[leafFaces[f]];
+        if (hitTriangle(vertices[face[0]], vertices[face[1]], vertices[face[2]], origin, dir, t))
+          hit = leafFaces[f];
+      }
+      continue;
+    }
+
+    float tl, tr;
+    bool hl = hitBox(nodes[node.left], origin, inv, t, tl);
+    bool hr = hitBox(nodes[node.left + 1], origin, inv, t, tr);
+    if (hl && hr) {
+      bool leftFirst = tl <= tr;
+      stack[top] = leftFirst ? node.left + 1 : node.left;
+      entry[top++] = leftFirst ? tr : tl;
+      stack[top] = leftFirst ? node.left : node.left + 1;
+      entry[top++] = leftFirst ? tl : tr;
+    }
+    else if (hl || hr) {
+      stack[top] = hl ? node.left : node.left + 1;
+      entry[top++] = hl ? tl : tr;
+    }
+  }
+  return hit;
+}
+
+
+//##########################################
+// Packets of segments
+
+void clearPacket(BVHPacket &p)
+{
+  p.n = 0;
+  emptyBox(p.min, p.max);
+}
+
+
+void addRay(BVHPacket &p, const Vector3f o, const Vector3f d)
+{
+  int k = p.n++;
+
+  p.ox[k] = o[0];
+  p.oy[k] = o[1];
+  p.oz[k] = o[2];
+  p.dx[k] = d[0];
+  p.dy[k] = d[1];
+  p.dz[k] = d[2];
+  p.ix[k] = 1.0f / d[0];
+  p.iy[k] = 1.0f / d[1];
+  p.iz[k] = 1.0f / d[2];
+  for (int a = 0; a < 3; a++) {
+    float e = o[a] + d[a];
+    p.min[a] = std::min(p.min[a], std::min(o[a], e));
+    p.max[a] = std::max(p.max[a], std::max(o[a], e));
+  }
+}
+
+
+static inline bool overlaps(const BVHNode &node, const Vector3f min, const Vector3f max)
+{
+  return node.min[0] <= max[0] && node.max[0] >= min[0] &&
+    node.min[1] <= max[1] && node.max[1] >= min[1] &&
+    node.min[2] <= max[2] && node.max[2] >= min[2];
+}
+
+
+// the rays of mask whose segment passes through the box
+static unsigned int packetHitsBox(const BVHPacket &p, const BVHNode &node, unsigned int mask)
+{
+  unsigned int hits = 0;
+
+  if (!overlaps(node, p.min, p.max))
+    return 0;
+  for (int k = 0; k < p.n; k++) {
+    if (!(mask & (1u << k)))
+      continue;
+    float ax = (node.min[0] - p.ox[k]) * p.ix[k], bx = (node.max[0] - p.ox[k]) * p.ix[k];
+    float ay = (node.min[1] - p.oy[k]) * p.iy[k], by = (node.max[1] - p.oy[k]) * p.iy[k];
+    float az = (node.min[2] - p.oz[k]) * p.iz[k], bz = (node.max[2] - p.oz[k]) * p.iz[k];
+    float t0 = std::max(std::max(0.0f, std::min(ax, bx)), std::max(std::min(ay, by), std::min(az, bz)));
+    float t1 = std::min(std::min(1.0f, std::max(ax, bx)), std::min(std::max(ay, by), std::max(az, bz)));
+    hits |= (unsigned int)(t0 <= t1) << k;
+  }
+  return hits;
+}
+
+
+// the rays of mask blocked by the face p, q, r
+static unsigned int packetHitsTriangle(const BVHPacket &pk, const Vector3f p, const Vector3f q,
+                                       const Vector3f r, unsigned int mask)
+{
+  Vector3f e1, e2;
+  unsigned int hits = 0;
+
+  sub(e1, q, p);
+  sub(e2, r, p);
+  for (int k = 0; k < pk.n; k++) {
+    if (!(mask & (1u << k)))
+      continue;
+    Vector3f d = {pk.dx[k], pk.dy[k], pk.dz[k]}, s = {pk.ox[k], pk.oy[k], pk.oz[k]}, h, g;
+
+    vecProd(h, d, e2);
+    float det = dotProd(e1, h);
+    if (det == 0.0f)
+      continue;
+    sub(s, p);
+    float u = dotProd(s, h) / det;
+    if (u < 0.0f || u > 1.0f)
+      continue;
+    vecProd(g, s, e1);
+    float v = dotProd(d, g) / det;
+    if (v < 0.0f || u + v > 1.0f)
+      continue;
+    float t = dotProd(e2, g) / det;
+    if (t > 0.0f && t < 1.0f)
+      hits |= 1u << k;
+  }
+  return hits;
+}
+
+
+unsigned int BVH::occluded(const Vector3f *vertices, const Index3i *faces, const BVHPacket &pk) const
+{
+  int stack[BVH_MAX_DEPTH + 1];
+  unsigned int masks[BVH_MAX_DEPTH + 1];
+  unsigned int all = pk.n == BVH_PACKET ? ~0u : (1u << pk.n) - 1, alive = all;
+
+  if (nodes.empty() || pk.n == 0)
+    return 0;
+
+  int top = 0;
+  unsigned int mask = packetHitsBox(pk, nodes[0], alive);
+  if (mask) {
+    stack[top] = 0;
+    masks[top++] = mask;
+  }
+  while (top > 0 && alive) {
+    top--;
+    const BVHNode &node = nodes[stack[top]];
+    mask = masks[top] & alive;
+    if (!mask)
+      continue;
+
+    if (node.left < 0) {
+      for (int f = node.first; f < node.first + node.count && mask; f++) {
+        const int *face = faces[leafFaces[f]];
+        unsigned int hits = packetHitsTriangle(pk, vertices[face[0]], vertices[face[1]],
+                                               vertices[face[2]], mask);
+        mask &= ~hits;
+        alive &= ~hits;
+      }
+      continue;
+    }
+
+    unsigned int left = packetHitsBox(pk, nodes[node.left], mask);
+    unsigned int right = packetHitsBox(pk, nodes[node.left + 1], mask);
+    if (right) {
+      stack[top] = node.left + 1;
+      masks[top++] = right;
+    }
+    if (left) {
+      stack[top] = node.left;
+      masks[top++] = left;
+    }
+  }
+  return all & ~alive;
+}
+
+
+//##########################################
+// Shadow rays
+
+void BVH::traceShadows(const Vector3f *vertices, const Index3i *faces, const ShadingStreams &s,
+                       const Vector3f light, float *visible, int begin, int end) const
+{
+  BVHPacket pk;
+  float bias = 0.0f;
+
+  if (nodes.empty()) {
+    for (int i = begin; i < end; i++)
+      visible[i] = 1.0f;
+    return;
+  }
+  for (int a = 0; a < 3; a++)
+    bias = std::max(bias, nodes[0].max[a] - nodes[0].min[a]);
+  bias *= BVH_SHADOW_BIAS;
+
+  for (int b = begin; b < end; b += BVH_PACKET) {
+    // rays from just off the surface, on the side of the light, as the
+    // normals may point either way; they end at the light
+    clearPacket(pk);
+    for (int i = b; i < end && i < b + BVH_PACKET; i++) {
+      Vector3f d = {light[0] - s.px[i], light[1] - s.py[i], light[2] - s.pz[i]};
+      float side = d[0] * s.nx[i] + d[1] * s.ny[i] + d[2] * s.nz[i] < 0.0f ? -bias : bias;
+      Vector3f o = {s.px[i] + side * s.nx[i], s.py[i] + side * s.ny[i], s.pz[i] + side * s.nz[i]};
+
+      sub(d, light, o);
+      addRay(pk, o, d);
+    }
+
+    unsigned int blocked = occluded(vertices, faces, pk);
+    for (int k = 0; k < pk.n; k++)
+      visible[b + k] = blocked & (1u << k) ? 0.0f : 1.0f;
+  }
+}
@@ -0,0 +1,119 @@
+#ifndef BVH_H
+#define BVH_H
+
+/* File: bvh
+ * Description:
+ *   Bounding volume hierarchy over the faces of a mesh, built with the
+ *   binned surface area heuristic, for view frustum culling and picking
+ */
+
+#include <vector>
+
+#include "geometry.h"
+
+class ThreadPool;
+struct ShadingStreams;
+
+#define BVH_BINS 16			// split candidates per axis are the bin borders
+#define BVH_LEAF_FACES 8		// leaves hold at most this many faces
+#define BVH_MAX_DEPTH 64		// deeper nodes become leaves, bounds the traversal stacks
+#define BVH_UNIT_FACES 1024		// culling and shading go by subtrees of at most this many faces
+#define BVH_PARALLEL_FACES 65536	// nodes this large are binned by all threads
+#define BVH_TRAVERSAL_COST 1.0		// cost of visiting a node, one face test costs 1
+#define BVH_PACKET 32			// rays traced together, one bit each in a mask
+#define BVH_SHADOW_BIAS 1e-3		// shadow rays start this part of the mesh size off the surface
+
+
+// The faces of a subtree follow each other in the tree order from first
+// on, the left subtree before the right one. Units and the nodes above
+// them are also ranges of the faces as drawn, so each is drawn with one
+// call; below the units the faces may be drawn in another order, and
+// BVH::leafFaces tells where they went.
+struct BVHNode {
+  Vector3f min, max;
+  int left;			// first of the two children, the other is left + 1; -1 for a leaf
+  int first, count;		// faces of the subtree, in the tree order
+  int unit, nunits;		// units of the subtree, 1 from the unit roots on
+};
+
+
+// A cull unit: the subtree below the first node of at most
+// BVH_UNIT_FACES faces. Once the vertices are numbered in the order the
+// faces first use them, the vertices a unit uses are its own range
+// plus some of the ranges of the units listed as its neighbors.
+struct BVHUnit {
+  int node;
+  int first, count;		// faces
+  int vfirst, vcount;		// vertices first used by these faces
+  int neighbors, nneighbors;	// units owning the other vertices, in BVH::neighbors
+  unsigned int shadedEpoch;	// lighting the own vertices were last shaded with
+  unsigned int tracedEpoch;	// shadows the own vertices were last traced for
+};
+
+
+// Up to BVH_PACKET segments from o to o + d that go down the tree
+// together in BVH::occluded()
+struct BVHPacket {
+  float ox[BVH_PACKET], oy[BVH_PACKET], oz[BVH_PACKET];
+  float dx[BVH_PACKET], dy[BVH_PACKET], dz[BVH_PACKET];
+  float ix[BVH_PACKET], iy[BVH_PACKET], iz[BVH_PACKET];	// 1 / d
+  Vector3f min, max;		// around the segments
+  int n;
+};
+
+void clearPacket(BVHPacket &p);
+void addRay(BVHPacket &p, const Vector3f o, const Vector3f d);
+
+
+class BVH {
+public:
+
+  BVH();
+
+  // Build the tree over the nf faces. order receives the face order the
+  // tree was built for, order[k] being the old index of face k; the
+  // faces have to be put in that order, or in one placeFaces() is told
+  // about, before the tree is used.
+  void build(const Vector3f *vertices, const Index3i *faces, int nf, ThreadPool *pool, int *order);
+
+  // The faces were put in the order placed instead of the order build()
+  // returned, both old indices, which may only differ within each unit.
+  // Point leafFaces at the places the faces of the tree went to.
+  void placeFaces(const int *order, const int *placed, int nf);
+
+  // Find the vertex ranges and neighbors of the units, once the faces
+  // are in tree order and the vertices numbered in the order they use them
+  void findVertices(const Index3i *faces);
+
+  // recompute the bounds after the vertices moved
+  void refit(const Vector3f *vertices, const Index3i *faces, ThreadPool *pool);
+
+  // Fill visible with the units whose bounds reach into the view
+  // frustum of mvp, the projection times the modelview, in increasing
+  // order. Return the number of faces in them.
+  int cull(const Matrix4f mvp);
+
+  // Nearest face hit by the ray origin + t * dir for 0 < t < tmax, with
+  // t set to its hit, or -1 if the ray misses
+  int intersect(const Vector3f *vertices, const Index3i *faces, const Vector3f origin,
+                const Vector3f dir, float &t) const;
+
+  // Shadow rays from the entries [begin, end) of s to the point light:
+  // visible[i] becomes 0 if a face is in between, 1 otherwise. The rays
+  // go down the tree in packets of BVH_PACKET consecutive entries.
+  void traceShadows(const Vector3f *vertices, const Index3i *faces, const ShadingStreams &s,
+                    const Vector3f light, float *visible, int begin, int end) const;
+
+  // The segments of p some face crosses, bit k set for segment k
+  unsigned int occluded(const Vector3f *vertices, const Index3i *faces, const BVHPacket &p) const;
+
+  std::vector<BVHNode> nodes;	// the root first, children after their parents
+  std::vector<BVHUnit> units;	// in face order
+  std::vector<int> neighbors;	// neighbor lists of all units
+  std::vector<int> leafFaces;	// face k of the tree order is faces[leafFaces[k]]
+  std::vector<int> visible;	// units of the last cull()
+  int visibleFaces;
+  int leaves, depth;
+};
+
+#endif
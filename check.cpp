@@ -0,0 +1,618 @@
+/* File: check
+ * Description:
+ *   Checks that the fast paths compute what their plain references do,
+ *   without OpenGL or a window, on bunny.ply or the given file. Every
+ *   check prints ok or how far apart the two were; the exit status is
+ *   1 if any failed.
+ *
+ *   check [file.ply]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdarg.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+#include "PLY.h"
+#include "geometry.h"
+#include "lighting.h"
+#include "simd.h"
+#include "plyTokenizer.h"
+#include "bvh.h"
+#include "profiler.h"
+
+static int failures = 0;
+
+
+// print the outcome of one check with what it compared
+static void report(const char *name, bool ok, const char *format, ...)
+{
+  va_list args;
+
+  printf("%-28s %-6s ", name, ok ? "ok" : "FAILED");
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+  fflush(stdout);
+  if (!ok)
+    failures++;
+}
+
+
+static float random01()
+{
+  return (float)rand() / RAND_MAX;
+}
+
+
+//##########################################
+// Shading kernels
+
+// A view turned about two axes and nlights point lights around the
+// resized mesh, the near ones attenuated so that the range culling
+// drops them for part of it
+static void setupLighting(LightingContext &ctx, int nlights)
+{
+  Vector4f black = {0.0, 0.0, 0.0, 1.0}, ambient = {0.2, 0.2, 0.2, 1.0};
+  Vector4f diffuse = {0.7, 0.7, 1.0, 1.0}, specular = {0.5, 0.5, 0.5, 1.0};
+  Vector3f viewer = {0.3, 0.2, 5.0};
+  float a = 20.0 * M_PI / 180.0, b = 30.0 * M_PI / 180.0;
+  LightList lights;
+  Light l;
+  int i, j;
+
+  initLightList(lights);
+  for (i = 0; i < nlights; i++) {
+    for (j = 0; j < 3; j++) {
+      l.position[j] = 6.0 * random01() - 3.0;
+      l.ambient[j] = 0.02;
+      l.diffuse[j] = l.specular[j] = random01();
+    }
+    l.position[3] = l.ambient[3] = l.diffuse[3] = l.specular[3] = 1.0;
+    l.constantAttenuation = 1.0;
+    l.linearAttenuation = i & 1 ? 0.5 : 0.0;
+    l.quadraticAttenuation = i & 2 ? 2.0 : 0.0;
+    addLight(lights, l);
+  }
+
+  emptyMatrix(ctx.modelView);
+  ctx.modelView[0][0] = cos(a);
+  ctx.modelView[0][2] = sin(a);
+  ctx.modelView[1][0] = sin(b) * sin(a);
+  ctx.modelView[1][1] = cos(b);
+  ctx.modelView[1][2] = -sin(b) * cos(a);
+  ctx.modelView[2][0] = -cos(b) * sin(a);
+  ctx.modelView[2][1] = sin(b);
+  ctx.modelView[2][2] = cos(b) * cos(a);
+  ctx.modelView[0][3] = 0.3;
+  ctx.modelView[1][3] = -0.2;
+  ctx.modelView[3][3] = 1.0;
+  normalizeVector(ctx.eyeDir, viewer);
+  setLightingProducts(ctx, black, lights, ambient, diffuse, specular);
+  ctx.shininess = 5.0;
+}
+
+
+// largest difference of a color channel and the number of vertices
+// that differ at all
+static int colorDifference(const Color3u *a, const Color3u *b, int n, int &differ)
+{
+  int most = 0;
+
+  differ = 0;
+  for (int i = 0; i < n; i++) {
+    int d = 0;
+    for (int j = 0; j < 3; j++)
+      d = std::max(d, abs(a[i][j] - b[i][j]));
+    most = std::max(most, d);
+    differ += d > 0;
+  }
+  return most;
+}
+
+
+// The scalar stream kernel is the per-vertex loop of shadeVertices()
+// over the streams and matches it bit for bit; the SSE and AVX2
+// kernels are within one unit. The odd ranges leave the vector kernels
+// partial blocks at both ends.
+static void checkShading(PLYObject *ply)
+{
+  typedef void (*Kernel)(const LightingContext&, const ShadingStreams&, Color3u*, int, int);
+  static const Kernel kernels[3] = {shadeStreamsScalar, shadeStreamsSSE, shadeStreamsAVX2};
+  static const char *names[3] = {"shade scalar", "shade SSE", "shade AVX2"};
+  int nv = ply->nv, begin = std::min(3, nv), end = std::max(begin, nv - 5);
+  std::vector<Color3u> reference(nv), colors(nv);
+  ShadingStreams s;
+  char name[64];
+
+  initShadingStreams(s);
+  fillShadingStreams(s, ply->vertices, ply->normals, nv);
+
+  for (int space = 0; space < 2; space++)
+    for (int nlights = 1; nlights <= 16; nlights *= 4) {
+      LightingContext ctx;
+
+      setupLighting(ctx, nlights);
+      if (space && !toObjectSpace(ctx)) {
+        report("object space", false, "singular modelview");
+        continue;
+      }
+      memset(&reference[0], 0, nv * sizeof(Color3u));
+      shadeVertices(ctx, ply->vertices, ply->normals, &reference[0], begin, end);
+
+      for (int k = 0; k < 3; k++) {
+        snprintf(name, sizeof(name), "%s %s %d", names[k], space ? "object" : "eye", nlights);
+        if (k > simdLevel()) {
+          printf("%-28s %-6s not supported here\n", name, "-");
+          continue;
+        }
+        memset(&colors[0], 0, nv * sizeof(Color3u));
+        kernels[k](ctx, s, &colors[0], begin, end);
+
+        int differ, most = colorDifference(&reference[0], &colors[0], nv, differ);
+        report(name, k == 0 ? most == 0 : most <= 1,
+               "%d of %d vertices differ, by up to %d", differ, nv, most);
+      }
+    }
+  freeShadingStreams(s);
+}
+
+
+//##########################################
+// Geometry kernels
+
+// largest difference of n floats and the number of them whose bits differ
+static float floatDifference(const float *a, const float *b, int n, int &differ)
+{
+  float most = 0.0f;
+
+  differ = 0;
+  for (int i = 0; i < n; i++)
+    if (memcmp(&a[i], &b[i], sizeof(float)) != 0) {
+      differ++;
+      most = std::max(most, fabsf(a[i] - b[i]));
+    }
+  return most;
+}
+
+
+static void reportFloats(const char *name, const float *a, const float *b, int n)
+{
+  int differ;
+  float most = floatDifference(a, b, n, differ);
+
+  report(name, differ == 0, "%d of %d values differ, by up to %g", differ, n, most);
+}
+
+
+// The AVX2 batch kernels compute what the scalar ones do, bit for bit.
+// Some normals are zero and some faces degenerate, which normalize to
+// zero; the odd ranges leave partial blocks of 8 at both ends.
+static void checkGeometry(PLYObject *ply)
+{
+  int nv = ply->nv, nf = ply->nf;
+  int vb = std::min(3, nv), ve = std::max(vb, nv - 5), vn = ve - vb;
+  int fb = std::min(3, nf), fe = std::max(fb, nf - 5), fn = fe - fb;
+  std::vector<Vector3f> vectors(nv);
+  std::vector<Index3i> faces(nf);
+  std::vector<Vector3f> a(std::max(nv, nf)), b(std::max(nv, nf));
+  std::vector<float> da(nv), db(nv);
+  LightingContext ctx;
+
+  if (simdLevel() < SIMD_AVX2) {
+    printf("%-28s %-6s not supported here\n", "geometry AVX2", "-");
+    return;
+  }
+
+  memcpy(&vectors[0], ply->normals, nv * sizeof(Vector3f));
+  for (int i = 0; i < nv; i += 97)
+    vectors[i][0] = vectors[i][1] = vectors[i][2] = 0.0f;
+  memcpy(&faces[0], ply->faces, nf * sizeof(Index3i));
+  for (int i = 0; i < nf; i += 101)
+    faces[i][2] = faces[i][1];
+  setupLighting(ctx, 1);
+
+  memset(&a[0], 0, a.size() * sizeof(Vector3f));
+  memset(&b[0], 0, b.size() * sizeof(Vector3f));
+  transformPointsScalar(&a[vb], ctx.modelView, ply->vertices + vb, vn);
+  transformPointsAVX2(&b[vb], ctx.modelView, ply->vertices + vb, vn);
+  reportFloats("transformPoints AVX2", &a[0][0], &b[0][0], 3 * nv);
+
+  normalizeVectorsScalar(&a[vb], &vectors[vb], vn);
+  normalizeVectorsAVX2(&b[vb], &vectors[vb], vn);
+  reportFloats("normalizeVectors AVX2", &a[0][0], &b[0][0], 3 * nv);
+
+  memset(&a[0], 0, a.size() * sizeof(Vector3f));
+  memset(&b[0], 0, b.size() * sizeof(Vector3f));
+  triangleNormalsScalar(&a[fb], ply->vertices, &faces[fb], fn);
+  triangleNormalsAVX2(&b[fb], ply->vertices, &faces[fb], fn);
+  reportFloats("triangleNormals AVX2", &a[0][0], &b[0][0], 3 * nf);
+
+  dotProductsScalar(&da[vb], ply->vertices + vb, &vectors[vb], vn);
+  dotProductsAVX2(&db[vb], ply->vertices + vb, &vectors[vb], vn);
+  reportFloats("dotProducts AVX2", &da[0], &db[0], nv);
+
+  memcpy(&a[0], ply->vertices, nv * sizeof(Vector3f));
+  memcpy(&b[0], ply->vertices, nv * sizeof(Vector3f));
+  addScaledVectorsScalar(&a[vb], 0.01f, &vectors[vb], vn);
+  addScaledVectorsAVX2(&b[vb], 0.01f, &vectors[vb], vn);
+  reportFloats("addScaledVectors AVX2", &a[0][0], &b[0][0], 3 * nv);
+
+  scaleVectorsScalar(&a[vb], -1.5f, vn);
+  scaleVectorsAVX2(&b[vb], -1.5f, vn);
+  reportFloats("scaleVectors AVX2", &a[0][0], &b[0][0], 3 * nv);
+}
+
+
+//##########################################
+// Number parsing
+
+// Parse every line of text with the tokenizer and with strtof and count
+// the numbers whose bits differ or that only one of them read
+static int parseDifferences(const std::vector<char> &text, int &numbers)
+{
+  PLYTokenizer t;
+  int differ = 0;
+
+  numbers = 0;
+  initTokenizer(t, &text[0], &text[0] + text.size(), 1);
+  while (t.p < t.end) {
+    const char *line = t.p;
+    float v;
+
+    while (parseFloat(t, v)) {
+      char *last;
+      float reference = strtof(line, &last);
+
+      differ += last != t.p || memcmp(&v, &reference, sizeof(float)) != 0;
+      numbers++;
+      line = t.p;
+    }
+    if (t.p < t.end && *t.p != '\n')
+      differ++;
+    nextLine(t);
+  }
+  return differ;
+}
+
+
+// The tokenizer rounds like strtof, which sscanf used before it:
+// random floats of every exponent, printed in several formats and
+// fixed cases of signs, missing digits and subnormals, then the vertex
+// lines of filename against the vertices the mapped loader read
+static void checkTokenizer(const char *filename)
+{
+  static const char *formats[4] = {"%.9g", "%g", "%e", "%.6f"};
+  static const char *cases = "0 -0 +0 +1.5 -1.5 .5 -.5 5. 1e3 1E-3 +2.5e+2 "
+    "3.4028235e38 -3.4028235e38 1.17549435e-38 1.4e-45 1e-40 0.000001 "
+    "16133.229492 30815.314453 0.100000001490116119384765625\n";
+  std::vector<char> text;
+  char number[64];
+  int numbers, differ;
+
+  text.insert(text.end(), cases, cases + strlen(cases));
+  for (int i = 0; i < 100000; i++) {
+    unsigned int bits = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+    float v;
+
+    // any exponent but those of inf and NaN
+    bits = (bits & 0x807fffff) | (((bits >> 23) % 254 + 1) << 23);
+    memcpy(&v, &bits, sizeof(float));
+    snprintf(number, sizeof(number), formats[i & 3], v);
+    text.insert(text.end(), number, number + strlen(number));
+    text.push_back(i % 8 == 7 ? '\n' : ' ');
+  }
+  text.push_back('\n');
+  differ = parseDifferences(text, numbers);
+  report("tokenizer numbers", differ == 0, "%d of %d numbers differ from strtof", differ, numbers);
+
+  PLYObject ply(filename);
+  FILE *in = fopen(filename, "rb");
+  char line[4096];
+
+  if (ply.format != PLY_ASCII || !in) {
+    printf("%-28s %-6s not an ASCII file\n", "tokenizer vertices", "-");
+    if (in)
+      fclose(in);
+    return;
+  }
+  while (fgets(line, sizeof(line), in) && strncmp(line, "end_header", 10))
+    ;
+  differ = 0;
+  for (int i = 0; i < ply.nv && fgets(line, sizeof(line), in); i++) {
+    float values[PLY_MAX_PROPERTIES];
+    char *p = line;
+
+    for (int j = 0; j < ply.nproperties && j < PLY_MAX_PROPERTIES; j++)
+      values[j] = strtof(p, &p);
+    for (int j = 0; j < 3; j++)
+      differ += memcmp(&values[ply.order[j]], &ply.vertices[i][j], sizeof(float)) != 0;
+  }
+  fclose(in);
+  report("tokenizer vertices", differ == 0, "%d of %d coordinates differ from strtof",
+         differ, 3 * ply.nv);
+}
+
+
+// An ASCII body split into chunks for several threads reads into the
+// same vertices, faces, normals and bounds as on one thread
+static void checkParallelParse(const char *filename)
+{
+  static const int threads[4] = {2, 3, 5, 8};
+  PLYObject serial;
+  char name[64];
+
+  serial.setThreads(1);
+  if (!serial.load(filename) || serial.format != PLY_ASCII) {
+    printf("%-28s %-6s not an ASCII file\n", "parallel parse", "-");
+    return;
+  }
+
+  for (int k = 0; k < 4; k++) {
+    PLYObject ply;
+    int nv = serial.nv, nf = serial.nf;
+
+    ply.setThreads(threads[k]);
+    ply.load(filename);
+    bool same = ply.nv == nv && ply.nf == nf &&
+      memcmp(ply.vertices, serial.vertices, nv * sizeof(Vector3f)) == 0 &&
+      memcmp(ply.faces, serial.faces, nf * sizeof(Index3i)) == 0 &&
+      memcmp(ply.normals, serial.normals, nv * sizeof(Vector3f)) == 0 &&
+      memcmp(ply.min, serial.min, sizeof(Vector3f)) == 0 &&
+      memcmp(ply.max, serial.max, sizeof(Vector3f)) == 0;
+    snprintf(name, sizeof(name), "parallel parse %d threads", threads[k]);
+    report(name, same, "%d vertices, %d faces", ply.nv, ply.nf);
+  }
+}
+
+
+//##########################################
+// Rays through the hierarchy
+
+// Moeller-Trumbore with the arithmetic of the hierarchy: the distance
+// along o + t * d of the hit on face p, q, r, or 0 if there is none
+static float hitFace(const Vector3f p, const Vector3f q, const Vector3f r,
+                     const Vector3f o, const Vector3f d)
+{
+  Vector3f e1, e2, s, h, k;
+  float det, u, v;
+
+  sub(e1, q, p);
+  sub(e2, r, p);
+  vecProd(h, d, e2);
+  det = dotProd(e1, h);
+  if (det == 0.0f)
+    return 0.0f;
+  sub(s, o, p);
+  u = dotProd(s, h) / det;
+  if (u < 0.0f || u > 1.0f)
+    return 0.0f;
+  vecProd(k, s, e1);
+  v = dotProd(d, k) / det;
+  if (v < 0.0f || u + v > 1.0f)
+    return 0.0f;
+  return std::max(dotProd(e2, k) / det, 0.0f);
+}
+
+
+// the nearest face the ray hits before t, with t lowered to its hit
+static int nearestFace(const PLYObject *ply, const Vector3f o, const Vector3f d, float &t)
+{
+  int hit = -1;
+
+  for (int f = 0; f < ply->nf; f++) {
+    const int *v = ply->faces[f];
+    float h = hitFace(ply->vertices[v[0]], ply->vertices[v[1]], ply->vertices[v[2]], o, d);
+    if (h > 0.0f && h < t) {
+      t = h;
+      hit = f;
+    }
+  }
+  return hit;
+}
+
+
+// true if a face crosses the segment from o to o + d
+static bool blocked(const PLYObject *ply, const Vector3f o, const Vector3f d)
+{
+  for (int f = 0; f < ply->nf; f++) {
+    const int *v = ply->faces[f];
+    float h = hitFace(ply->vertices[v[0]], ply->vertices[v[1]], ply->vertices[v[2]], o, d);
+    if (h > 0.0f && h < 1.0f)
+      return true;
+  }
+  return false;
+}
+
+
+// a random point of the box lo, hi grown by grow times its size
+static void randomPoint(Vector3f p, const Vector3f lo, const Vector3f hi, float grow)
+{
+  for (int a = 0; a < 3; a++) {
+    float size = hi[a] - lo[a];
+    p[a] = lo[a] - grow * size + (1.0f + 2.0f * grow) * size * random01();
+  }
+}
+
+
+// BVH::intersect(), BVH::occluded() and BVH::traceShadows() against a
+// test of every face: rays from around the mesh through it, random
+// segments in packets, and the shadow rays of lights on three sides
+static void checkRays(PLYObject *ply)
+{
+  const BVH &bvh = *ply->bvh;
+  const Vector3f &lo = bvh.nodes[0].min, &hi = bvh.nodes[0].max;
+  int differ = 0, hits = 0, rays = 2000;
+
+  for (int i = 0; i < rays; i++) {
+    Vector3f o, target, d;
+    float t = 1e30f, reference = 1e30f;
+
+    randomPoint(o, lo, hi, 1.0f);
+    randomPoint(target, lo, hi, 0.0f);
+    sub(d, target, o);
+    int face = bvh.intersect(ply->vertices, ply->faces, o, d, t);
+    int nearest = nearestFace(ply, o, d, reference);
+    // faces hit at the same point, on a shared edge, are both right
+    differ += t != reference || (face < 0) != (nearest < 0);
+    hits += nearest >= 0;
+  }
+  report("bvh intersect", differ == 0, "%d of %d rays differ, %d hit the mesh", differ, rays, hits);
+
+  BVHPacket pk;
+  int packets = 250;
+  differ = hits = 0;
+  for (int i = 0; i < packets; i++) {
+    unsigned int reference = 0;
+
+    clearPacket(pk);
+    for (int k = 0; k < BVH_PACKET; k++) {
+      Vector3f o, e, d;
+      randomPoint(o, lo, hi, 0.1f);
+      randomPoint(e, lo, hi, 0.1f);
+      sub(d, e, o);
+      // three packets in four have shorter segments, fewer of them blocked
+      if (i & 3)
+        scale(d, 1.0f / (i & 3) / (i & 3), d);
+      addRay(pk, o, d);
+      if (blocked(ply, o, d))
+        reference |= 1u << k;
+    }
+    unsigned int mask = bvh.occluded(ply->vertices, ply->faces, pk);
+    for (unsigned int x = mask ^ reference; x; x &= x - 1)
+      differ++;
+    for (unsigned int x = reference; x; x &= x - 1)
+      hits++;
+  }
+  report("bvh occluded", differ == 0, "%d of %d segments differ, %d blocked",
+         differ, packets * BVH_PACKET, hits);
+
+  static const Vector3f lights[3] = {{1.0, 3.0, 1.0}, {-2.0, 0.5, 0.0}, {0.3, -0.2, -4.0}};
+  const ShadingStreams &s = ply->streams;
+  std::vector<float> visible(ply->nv);
+  float bias = 0.0f;
+  char name[64];
+
+  for (int a = 0; a < 3; a++)
+    bias = std::max(bias, hi[a] - lo[a]);
+  bias *= BVH_SHADOW_BIAS;
+  ply->updateShadingStreams();
+  for (int l = 0; l < 3; l++) {
+    bvh.traceShadows(ply->vertices, ply->faces, s, lights[l], &visible[0], 0, ply->nv);
+    differ = hits = 0;
+    for (int i = 0; i < ply->nv; i++) {
+      Vector3f d = {lights[l][0] - s.px[i], lights[l][1] - s.py[i], lights[l][2] - s.pz[i]};
+      float side = d[0] * s.nx[i] + d[1] * s.ny[i] + d[2] * s.nz[i] < 0.0f ? -bias : bias;
+      Vector3f o = {s.px[i] + side * s.nx[i], s.py[i] + side * s.ny[i], s.pz[i] + side * s.nz[i]};
+
+      sub(d, lights[l], o);
+      bool shadowed = blocked(ply, o, d);
+      differ += shadowed != (visible[i] == 0.0f);
+      hits += shadowed;
+    }
+    snprintf(name, sizeof(name), "bvh shadows %d", l);
+    report(name, differ == 0, "%d of %d vertices differ, %d in shadow", differ, ply->nv, hits);
+  }
+}
+
+
+//##########################################
+// Profiler
+//##########################################
+
+static const char threadEvent[] = "check thread";
+
+
+// More short lived threads than there are ring slots record one event
+// each, and every event turns up in the trace
+static void checkProfiler()
+{
+  static const char *filename = "check-trace.json";
+  const int nthreads = 2 * PROFILE_MAX_THREADS, batch = 8;
+  std::vector<char> text;
+  char buffer[4096];
+  size_t n;
+  int found = 0;
+
+  for (int i = 0; i < nthreads; i += batch) {
+    std::vector<std::thread> threads;
+
+    for (int j = 0; j < batch; j++)
+      threads.push_back(std::thread([]() {
+        long long now = profileNow();
+        profileRecord(threadEvent, now, now + 1000);
+      }));
+    for (int j = 0; j < batch; j++)
+      threads[j].join();
+  }
+
+  if (!profileWriteTrace(filename)) {
+    report("profiler threads", false, "could not write %s", filename);
+    return;
+  }
+  FILE *in = fopen(filename, "rb");
+  while (in && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    text.insert(text.end(), buffer, buffer + n);
+  if (in)
+    fclose(in);
+  remove(filename);
+  text.push_back('\0');
+
+  for (const char *p = &text[0]; (p = strstr(p, "\"check thread\"")); p++)
+    found++;
+  report("profiler threads", found == nthreads, "%d of %d thread events in the trace",
+         found, nthreads);
+}
+
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "usage: %s [file.ply]\n", name);
+  exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+  const char *filename = "bunny.ply";
+  PLYObject *ply;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (argv[i][0] == '-')
+      usage(argv[0]);
+    else
+      filename = argv[i];
+  }
+
+  srand(1);
+  printf("simd %s\n\n", simdName(simdLevel()));
+
+  ply = new PLYObject(filename);
+  if (ply->nv == 0 || ply->nf == 0) {
+    fprintf(stderr, "Error: no mesh to check in %s.\n", filename);
+    return 1;
+  }
+  checkTokenizer(filename);
+  checkParallelParse(filename);
+
+  ply->resize();
+  checkShading(ply);
+  checkGeometry(ply);
+  ply->buildBVH();
+  checkRays(ply);
+  delete ply;
+  checkProfiler();
+
+  if (failures) {
+    fprintf(stderr, "Error: %d checks failed.\n", failures);
+    return 1;
+  }
+  printf("\nall checks passed\n");
+  return 0;
+}
@@ -0,0 +1,659 @@
+/* File: chunkedMesh
+ * Description:
+ *   Chunk files start with a header and the table of all chunks, which
+ *   stay in memory while streaming; only the chunk data is paged in.
+ *   A chunk is read in one piece into one block that also has room for
+ *   its vertex colors. The loader thread also fills the chunk's shading
+ *   streams, which count against the budget like the block.
+ *
+ *   Every update() ranks the chunks in view by the distance of their
+ *   boxes from the eye, followed by the chunks that a frustum widened by
+ *   PREFETCH_WIDEN and moved PREFETCH_FRAMES frames ahead along the
+ *   camera motion would see. The ranking is cut off where the budget is
+ *   used up, so when the view holds more than fits, the nearest chunks
+ *   are drawn. The loader queue is rebuilt in that order every frame:
+ *   requests that fell out of it are dropped before they are read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+
+#include "chunkedMesh.h"
+#include "PLY.h"
+#include "arena.h"
+#include "simd.h"
+#include "profiler.h"
+#include "threadPool.h"
+
+#define CHUNK_VERSION 1
+
+
+struct ChunkFileHeader {
+  char magic[8];		// "PLYCHUNK"
+  int version;			// CHUNK_VERSION
+  int byteOrder;		// 1, written in host byte order
+  int nchunks;
+  int reserved;
+  long long nv, nf;
+  Vector3f min, max;
+};
+
+
+static bool seekTo(FILE *f, long long offset)
+{
+#ifdef WIN32
+  return _fseeki64(f, offset, SEEK_SET) == 0;
+#else
+  return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+
+// bytes of the data of a chunk in the file; the colors come after it
+// in memory
+static size_t chunkFileSize(int nv, int nf)
+{
+  return 2 * arenaSize(nv * sizeof(Vector3f)) + arenaSize(nf * sizeof(Index3i));
+}
+
+
+static size_t chunkMemorySize(int nv, int nf)
+{
+  return chunkFileSize(nv, nf) + arenaSize(nv * sizeof(Color3u)) + 6 * arenaSize(nv * sizeof(float));
+}
+
+
+//##########################################
+// Writing
+
+// chunks appended one by one, the header and table written at the end
+struct ChunkWriter {
+  FILE *out;
+  std::vector<ChunkInfo> table;
+  long long position;
+  long long nv, nf;
+  Vector3f min, max;
+  bool ok;
+};
+
+
+static bool beginChunks(ChunkWriter &w, const char *filename, int nchunks)
+{
+  w.table.clear();
+  w.nv = w.nf = 0;
+  for (int i = 0; i < 3; i++) {
+    w.min[i] = FLT_MAX;
+    w.max[i] = -FLT_MAX;
+  }
+  if (!(w.out = fopen(filename, "wb"))) {
+    fprintf(stderr, "Error: cannot write %s.\n", filename);
+    return false;
+  }
+
+  // the data starts after room for the header and table
+  w.position = arenaSize(sizeof(ChunkFileHeader) + nchunks * sizeof(ChunkInfo));
+  w.ok = seekTo(w.out, w.position);
+  return w.ok;
+}
+
+
+static void writePadded(ChunkWriter &w, const void *data, size_t size)
+{
+  static const char zeros[ARENA_ALIGNMENT] = {0};
+  size_t pad = arenaSize(size) - size;
+
+  w.ok = w.ok && (size == 0 || fwrite(data, size, 1, w.out) == 1);
+  w.ok = w.ok && (pad == 0 || fwrite(zeros, pad, 1, w.out) == 1);
+  w.position += size + pad;
+}
+
+
+static void writeChunk(ChunkWriter &w, const Vector3f *vertices, const Vector3f *normals,
+                       const Index3i *faces, int nv, int nf)
+{
+  ChunkInfo c;
+  int i, j;
+
+  c.offset = w.position;
+  c.nv = nv;
+  c.nf = nf;
+  for (j = 0; j < 3; j++) {
+    c.min[j] = FLT_MAX;
+    c.max[j] = -FLT_MAX;
+  }
+  for (i = 0; i < nv; i++)
+    for (j = 0; j < 3; j++) {
+      c.min[j] = std::min(c.min[j], vertices[i][j]);
+      c.max[j] = std::max(c.max[j], vertices[i][j]);
+    }
+  for (j = 0; j < 3; j++) {
+    w.min[j] = std::min(w.min[j], c.min[j]);
+    w.max[j] = std::max(w.max[j], c.max[j]);
+  }
+  w.nv += nv;
+  w.nf += nf;
+
+  writePadded(w, vertices, nv * sizeof(Vector3f));
+  writePadded(w, normals, nv * sizeof(Vector3f));
+  writePadded(w, faces, nf * sizeof(Index3i));
+  w.table.push_back(c);
+}
+
+
+static bool finishChunks(ChunkWriter &w, const char *filename)
+{
+  ChunkFileHeader h;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "PLYCHUNK", 8);
+  h.version = CHUNK_VERSION;
+  h.byteOrder = 1;
+  h.nchunks = w.table.size();
+  h.nv = w.nv;
+  h.nf = w.nf;
+  for (int i = 0; i < 3; i++) {
+    h.min[i] = w.min[i];
+    h.max[i] = w.max[i];
+  }
+
+  w.ok = w.ok && seekTo(w.out, 0) && fwrite(&h, sizeof(h), 1, w.out) == 1;
+  w.ok = w.ok && fwrite(&w.table[0], sizeof(ChunkInfo), w.table.size(), w.out) == w.table.size();
+  w.ok = (fclose(w.out) == 0) && w.ok;
+  if (!w.ok) {
+    fprintf(stderr, "Error: cannot write %s.\n", filename);
+    return false;
+  }
+  printf("Wrote %d chunks, %lld vertices, %lld faces, %.1f MB to %s.\n",
+         (int)w.table.size(), w.nv, w.nf, w.position / 1048576.0, filename);
+  return true;
+}
+
+
+// centroid coordinate of a face along one axis, times 3
+static float centroid(const PLYObject *ply, int f, int axis)
+{
+  const int *t = ply->faces[f];
+
+  return ply->vertices[t[0]][axis] + ply->vertices[t[1]][axis] + ply->vertices[t[2]][axis];
+}
+
+
+// cut faces [begin, end) at the median centroid of their longest axis
+// until the pieces are small enough, leaving them in leaf order
+static void splitFaces(const PLYObject *ply, int *faces, int begin, int end,
+                       std::vector<std::pair<int, int> > &leaves)
+{
+  float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX}, hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  int axis = 0, i, j;
+
+  if (end - begin <= CHUNK_FACES) {
+    leaves.push_back(std::make_pair(begin, end));
+    return;
+  }
+
+  for (i = begin; i < end; i++)
+    for (j = 0; j < 3; j++) {
+      float c = centroid(ply, faces[i], j);
+      lo[j] = std::min(lo[j], c);
+      hi[j] = std::max(hi[j], c);
+    }
+  for (j = 1; j < 3; j++)
+    if (hi[j] - lo[j] > hi[axis] - lo[axis])
+      axis = j;
+
+  int mid = begin + (end - begin) / 2;
+  std::nth_element(faces + begin, faces + mid, faces + end, [&](int a, int b) {
+    return centroid(ply, a, axis) < centroid(ply, b, axis);
+  });
+  splitFaces(ply, faces, begin, mid, leaves);
+  splitFaces(ply, faces, mid, end, leaves);
+}
+
+
+bool writeChunkedMesh(const char *filename, const PLYObject *ply)
+{
+  PROFILE_SCOPE("writeChunkedMesh");
+  std::vector<int> order(ply->nf), local(ply->nv, -1), used;
+  std::vector<std::pair<int, int> > leaves;
+  std::vector<float> vertices, normals;
+  std::vector<int> faces;
+  ChunkWriter w;
+  int i, j;
+
+  if (ply->nv == 0 || ply->nf == 0) {
+    fprintf(stderr, "Error: no mesh to write to %s.\n", filename);
+    return false;
+  }
+  for (i = 0; i < ply->nf; i++)
+    order[i] = i;
+  splitFaces(ply, &order[0], 0, ply->nf, leaves);
+
+  if (!beginChunks(w, filename, leaves.size()))
+    return false;
+
+  // every leaf gets its own copy of the vertices it uses
+  for (size_t l = 0; l < leaves.size() && w.ok; l++) {
+    used.clear();
+    faces.clear();
+    for (i = leaves[l].first; i < leaves[l].second; i++)
+      for (j = 0; j < 3; j++) {
+        int v = ply->faces[order[i]][j];
+        if (local[v] < 0) {
+          local[v] = used.size();
+          used.push_back(v);
+        }
+        faces.push_back(local[v]);
+      }
+
+    vertices.resize(3 * used.size());
+    normals.resize(3 * used.size());
+    for (i = 0; i < (int)used.size(); i++) {
+      for (j = 0; j < 3; j++) {
+        vertices[3*i+j] = ply->vertices[used[i]][j];
+        normals[3*i+j] = ply->normals[used[i]][j];
+      }
+      local[used[i]] = -1;
+    }
+    writeChunk(w, (Vector3f*)&vertices[0], (Vector3f*)&normals[0], (Index3i*)&faces[0],
+               used.size(), faces.size() / 3);
+  }
+  return finishChunks(w, filename);
+}
+
+
+// height of the synthetic terrain and its partial derivatives
+static float terrain(float x, float z, float &dx, float &dz)
+{
+  dx = 0.3 * 0.7 * cos(0.7 * x) * cos(0.5 * z) + 0.05 * 5.0 * cos(5.0 * x + 3.0 * z);
+  dz = -0.3 * 0.5 * sin(0.7 * x) * sin(0.5 * z) + 0.05 * 3.0 * cos(5.0 * x + 3.0 * z);
+  return 0.3 * sin(0.7 * x) * cos(0.5 * z) + 0.05 * sin(5.0 * x + 3.0 * z);
+}
+
+
+bool writeSyntheticChunks(const char *filename, long long triangles)
+{
+  PROFILE_SCOPE("writeSyntheticChunks");
+  const int n = CHUNK_TILE + 1;
+  int tiles = (int)ceil(sqrt(triangles / 2.0) / CHUNK_TILE);
+  std::vector<float> vertices(3 * n * n), normals(3 * n * n);
+  std::vector<int> faces(6 * CHUNK_TILE * CHUNK_TILE);
+  float half;
+  ChunkWriter w;
+  int tx, tz, i, j;
+
+  if (tiles < 1)
+    tiles = 1;
+  half = 0.5 * tiles * CHUNK_TILE * CHUNK_SPACING;
+
+  // the faces are the same in every tile
+  for (i = 0; i < CHUNK_TILE; i++)
+    for (j = 0; j < CHUNK_TILE; j++) {
+      int *f = &faces[6 * (i * CHUNK_TILE + j)];
+      int a = i * n + j, b = a + 1, c = a + n, d = c + 1;
+      f[0] = a; f[1] = c; f[2] = d;
+      f[3] = a; f[4] = d; f[5] = b;
+    }
+
+  if (!beginChunks(w, filename, tiles * tiles))
+    return false;
+
+  // tiles row by row, neighbors share their edge vertices
+  for (tz = 0; tz < tiles && w.ok; tz++)
+    for (tx = 0; tx < tiles && w.ok; tx++) {
+      for (i = 0; i < n; i++)
+        for (j = 0; j < n; j++) {
+          float x = (tx * CHUNK_TILE + j) * CHUNK_SPACING - half;
+          float z = (tz * CHUNK_TILE + i) * CHUNK_SPACING - half;
+          float dx, dz, *v = &vertices[3 * (i * n + j)], *nm = &normals[3 * (i * n + j)];
+
+          v[0] = x;
+          v[1] = terrain(x, z, dx, dz);
+          v[2] = z;
+          nm[0] = -dx;
+          nm[1] = 1.0;
+          nm[2] = -dz;
+          normalize(nm);
+        }
+      writeChunk(w, (Vector3f*)&vertices[0], (Vector3f*)&normals[0], (Index3i*)&faces[0],
+                 n * n, 2 * CHUNK_TILE * CHUNK_TILE);
+    }
+  return finishChunks(w, filename);
+}
+
+
+//##########################################
+// Streaming
+
+ChunkStream::ChunkStream(const char *filename, size_t budget)
+  : valid(false), nchunks(0), chunks(NULL), nv(0), nf(0), budget(budget),
+    frame(0), moved(false), lightingEpoch(0), pool(NULL), busy(0), quit(false)
+{
+  ChunkFileHeader h;
+  std::vector<ChunkInfo> table;
+
+  memset(&stats, 0, sizeof(stats));
+  if (!(file = fopen(filename, "rb"))) {
+    fprintf(stderr, "Error: cannot open %s.\n", filename);
+    return;
+  }
+  if (fread(&h, sizeof(h), 1, file) != 1 || memcmp(h.magic, "PLYCHUNK", 8) != 0
+      || h.version != CHUNK_VERSION || h.byteOrder != 1 || h.nchunks <= 0) {
+    fprintf(stderr, "Error: %s is not a chunk file of this version.\n", filename);
+    return;
+  }
+  table.resize(h.nchunks);
+  if (fread(&table[0], sizeof(ChunkInfo), h.nchunks, file) != (size_t)h.nchunks) {
+    fprintf(stderr, "Error: chunk table of %s is cut short.\n", filename);
+    return;
+  }
+
+  nchunks = h.nchunks;
+  nv = h.nv;
+  nf = h.nf;
+  for (int i = 0; i < 3; i++) {
+    min[i] = h.min[i];
+    max[i] = h.max[i];
+  }
+
+  chunks = new Chunk[nchunks];
+  for (int c = 0; c < nchunks; c++) {
+    chunks[c].info = table[c];
+    chunks[c].bytes = chunkMemorySize(table[c].nv, table[c].nf);
+    chunks[c].state = CHUNK_ABSENT;
+    chunks[c].data = NULL;
+    initShadingStreams(chunks[c].streams);
+    chunks[c].lastUsed = 0;
+    chunks[c].shadedEpoch = 0;
+    chunks[c].distance = 0.0;
+  }
+
+  valid = true;
+  pool = new ThreadPool();
+  loader = std::thread(&ChunkStream::loaderLoop, this);
+}
+
+
+ChunkStream::~ChunkStream()
+{
+  if (loader.joinable()) {
+    {
+      std::lock_guard<std::mutex> l(lock);
+      quit = true;
+    }
+    wake.notify_one();
+    loader.join();
+  }
+  for (int c = 0; c < nchunks; c++) {
+    simdFree(chunks[c].data);
+    freeShadingStreams(chunks[c].streams);
+  }
+  delete [] chunks;
+  delete pool;
+  if (file)
+    fclose(file);
+}
+
+
+// clip space test of the eight corners of a box against one plane each
+static bool boxInFrustum(const Matrix4f mvp, const Vector3f lo, const Vector3f hi)
+{
+  float clip[8][4];
+  int i, j, k;
+
+  for (i = 0; i < 8; i++) {
+    float p[3] = {i & 1 ? hi[0] : lo[0], i & 2 ? hi[1] : lo[1], i & 4 ? hi[2] : lo[2]};
+    for (j = 0; j < 4; j++)
+      clip[i][j] = mvp[j][0] * p[0] + mvp[j][1] * p[1] + mvp[j][2] * p[2] + mvp[j][3];
+  }
+
+  // the box is out if all corners are beyond the same plane
+  for (k = 0; k < 6; k++) {
+    int axis = k / 2, out = 0;
+    float sign = k & 1 ? -1.0 : 1.0;
+    for (i = 0; i < 8; i++)
+      out += sign * clip[i][axis] > clip[i][3];
+    if (out == 8)
+      return false;
+  }
+  return true;
+}
+
+
+static float boxDistance(const Vector3f p, const Vector3f lo, const Vector3f hi)
+{
+  float d = 0.0;
+
+  for (int j = 0; j < 3; j++) {
+    float e = p[j] < lo[j] ? lo[j] - p[j] : p[j] > hi[j] ? p[j] - hi[j] : 0.0;
+    d += e * e;
+  }
+  return sqrt(d);
+}
+
+
+void ChunkStream::update(const Matrix4f modelView, const Matrix4f projection)
+{
+  PROFILE_SCOPE("stream update");
+  Matrix4f mvp, ahead, wide, shifted;
+  Vector3f eye, delta;
+  std::vector<int> visible, prefetch, wanted;
+  size_t total = 0;
+  int c, i, j;
+
+  frame++;
+
+  // eye in object space, -R^T t of the rigid modelview
+  for (i = 0; i < 3; i++)
+    eye[i] = -(modelView[0][i] * modelView[0][3] + modelView[1][i] * modelView[1][3]
+               + modelView[2][i] * modelView[2][3]);
+  for (i = 0; i < 3; i++)
+    delta[i] = moved ? eye[i] - lastEye[i] : 0.0;
+  for (i = 0; i < 3; i++)
+    lastEye[i] = eye[i];
+  moved = true;
+
+  // the view, and a wider one from where the eye will be
+  multMatrix(mvp, projection, modelView);
+  for (i = 0; i < 4; i++)
+    for (j = 0; j < 4; j++)
+      shifted[i][j] = modelView[i][j];
+  for (i = 0; i < 3; i++)
+    shifted[i][3] -= PREFETCH_FRAMES * (modelView[i][0] * delta[0] + modelView[i][1] * delta[1]
+                                        + modelView[i][2] * delta[2]);
+  for (i = 0; i < 4; i++)
+    for (j = 0; j < 4; j++)
+      wide[i][j] = projection[i][j] / (i < 2 ? PREFETCH_WIDEN : 1.0);
+  multMatrix(ahead, wide, shifted);
+
+  for (c = 0; c < nchunks; c++) {
+    Chunk &ch = chunks[c];
+    if (ch.state == CHUNK_FAILED)
+      continue;
+    ch.distance = boxDistance(eye, ch.info.min, ch.info.max);
+    if (boxInFrustum(mvp, ch.info.min, ch.info.max))
+      visible.push_back(c);
+    else if (boxInFrustum(ahead, ch.info.min, ch.info.max))
+      prefetch.push_back(c);
+  }
+  auto nearer = [&](int a, int b) { return chunks[a].distance < chunks[b].distance; };
+  std::sort(visible.begin(), visible.end(), nearer);
+  std::sort(prefetch.begin(), prefetch.end(), nearer);
+  stats.visible = visible.size();
+
+  // nearest first, as far as the budget goes
+  for (i = 0; i < (int)(visible.size() + prefetch.size()); i++) {
+    c = i < (int)visible.size() ? visible[i] : prefetch[i - visible.size()];
+    if (total + chunks[c].bytes > budget)
+      break;
+    total += chunks[c].bytes;
+    chunks[c].lastUsed = frame;
+    wanted.push_back(c);
+  }
+  stats.wanted = wanted.size();
+  request(wanted);
+
+  drawable.clear();
+  stats.drawnFaces = 0;
+  for (i = 0; i < (int)visible.size(); i++)
+    if (chunks[visible[i]].state == CHUNK_RESIDENT && chunks[visible[i]].lastUsed == frame) {
+      drawable.push_back(visible[i]);
+      stats.drawnFaces += chunks[visible[i]].info.nf;
+    }
+}
+
+
+// Queue the wanted chunks that are not in memory, making room by
+// evicting the least recently wanted ones
+void ChunkStream::request(const std::vector<int> &wanted)
+{
+  std::unique_lock<std::mutex> l(lock);
+  std::vector<int> resident;
+  int c;
+
+  // drop what is still queued, the wanted chunks go back in order
+  for (size_t q = 0; q < queue.size(); q++) {
+    chunks[queue[q]].state = CHUNK_ABSENT;
+    stats.committed -= chunks[queue[q]].bytes;
+  }
+  queue.clear();
+
+  for (c = 0; c < nchunks; c++)
+    if (chunks[c].state == CHUNK_RESIDENT && chunks[c].lastUsed != frame)
+      resident.push_back(c);
+  std::sort(resident.begin(), resident.end(), [&](int a, int b) {
+    return chunks[a].lastUsed < chunks[b].lastUsed;
+  });
+
+  size_t next = 0;
+  for (size_t w = 0; w < wanted.size(); w++) {
+    Chunk &ch = chunks[wanted[w]];
+    if (ch.state != CHUNK_ABSENT)
+      continue;
+    while (stats.committed + ch.bytes > budget && next < resident.size())
+      evict(resident[next++]);
+    if (stats.committed + ch.bytes > budget)
+      break;
+    ch.state = CHUNK_QUEUED;
+    stats.committed += ch.bytes;
+    queue.push_back(wanted[w]);
+  }
+  l.unlock();
+  wake.notify_one();
+}
+
+
+void ChunkStream::evict(int c)
+{
+  simdFree(chunks[c].data);
+  chunks[c].data = NULL;
+  freeShadingStreams(chunks[c].streams);
+  chunks[c].state = CHUNK_ABSENT;
+  stats.committed -= chunks[c].bytes;
+  stats.evictions++;
+}
+
+
+bool ChunkStream::readChunk(Chunk &c)
+{
+  size_t size = chunkFileSize(c.info.nv, c.info.nf);
+  char *data = (char*)simdAlloc(c.bytes);
+
+  if (!data || !seekTo(file, c.info.offset) || fread(data, size, 1, file) != 1) {
+    fprintf(stderr, "Error: cannot read chunk at %lld.\n", c.info.offset);
+    simdFree(data);
+    return false;
+  }
+
+  c.data = data;
+  c.vertices = (Vector3f*)data;
+  c.normals = (Vector3f*)(data + arenaSize(c.info.nv * sizeof(Vector3f)));
+  c.faces = (Index3i*)(data + 2 * arenaSize(c.info.nv * sizeof(Vector3f)));
+  c.colors = (Color3u*)(data + size);
+  fillShadingStreams(c.streams, c.vertices, c.normals, c.info.nv);
+  c.shadedEpoch = 0;
+  return true;
+}
+
+
+void ChunkStream::loaderLoop()
+{
+  std::unique_lock<std::mutex> l(lock);
+
+  for (;;) {
+    wake.wait(l, [&]() { return quit || !queue.empty(); });
+    if (quit)
+      return;
+
+    int c = queue.front();
+    queue.pop_front();
+    chunks[c].state = CHUNK_LOADING;
+    busy++;
+
+    // read without the lock, update() may run meanwhile
+    l.unlock();
+    bool ok;
+    {
+      PROFILE_SCOPE("load chunk");
+      ok = readChunk(chunks[c]);
+    }
+    l.lock();
+
+    busy--;
+    if (ok) {
+      chunks[c].state = CHUNK_RESIDENT;
+      stats.loads++;
+    }
+    else {
+      chunks[c].state = CHUNK_FAILED;
+      stats.committed -= chunks[c].bytes;
+    }
+    if (queue.empty() && busy == 0)
+      idle.notify_all();
+  }
+}
+
+
+void ChunkStream::waitForLoads()
+{
+  std::unique_lock<std::mutex> l(lock);
+
+  idle.wait(l, [&]() { return queue.empty() && busy == 0; });
+}
+
+
+bool ChunkStream::loading()
+{
+  std::lock_guard<std::mutex> l(lock);
+
+  return !queue.empty() || busy > 0;
+}
+
+
+void ChunkStream::shade(const LightingContext &ctx)
+{
+  PROFILE_SCOPE("lighting");
+  std::vector<int> stale;
+
+  if (lightingEpoch == 0 || !sameLighting(ctx, lastLighting)) {
+    lastLighting = ctx;
+    lightingEpoch++;
+  }
+  for (size_t i = 0; i < drawable.size(); i++)
+    if (chunks[drawable[i]].shadedEpoch != lightingEpoch) {
+      chunks[drawable[i]].shadedEpoch = lightingEpoch;
+      stale.push_back(drawable[i]);
+    }
+
+  // a chunk has thousands of vertices, enough for one task each
+  pool->parallelFor(0, (int)stale.size(), 1, [&](int begin, int end) {
+    PROFILE_SCOPE("shade chunk");
+    for (int i = begin; i < end; i++) {
+      Chunk &c = chunks[stale[i]];
+      shadeStreams(ctx, c.streams, c.colors, 0, c.info.nv);
+    }
+  });
+}
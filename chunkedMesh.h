@@ -0,0 +1,144 @@
+#ifndef CHUNKEDMESH_H
+#define CHUNKEDMESH_H
+
+/* File: chunkedMesh
+ * Description:
+ *   Out-of-core meshes: a file of spatially coherent chunks, each with
+ *   its own bounding box, and a stream keeping the chunks near the view
+ *   in memory under a budget, loaded on a background thread
+ */
+
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "geometry.h"
+#include "lighting.h"
+
+class PLYObject;
+class ThreadPool;
+
+typedef unsigned char Color3u[3];
+
+#define CHUNK_FACES 32768	// at most this many faces per chunk of a split mesh
+#define CHUNK_TILE 128		// quads along each side of a synthetic chunk
+#define CHUNK_SPACING 0.02	// distance of the synthetic grid points
+#define PREFETCH_FRAMES 8	// frames of camera motion the prefetch looks ahead
+#define PREFETCH_WIDEN 1.5	// prefetch frustum is this much wider than the view
+
+// residency of a chunk
+enum { CHUNK_ABSENT, CHUNK_QUEUED, CHUNK_LOADING, CHUNK_RESIDENT, CHUNK_FAILED };
+
+
+// Chunk table entry. The data at offset holds vertices, normals and
+// faces, each padded to 64 bytes; faces index the chunk's own vertices,
+// which repeat the vertices shared with neighbor chunks.
+struct ChunkInfo {
+  long long offset;
+  int nv, nf;
+  Vector3f min, max;
+};
+
+
+// Split the faces of ply into chunks of at most CHUNK_FACES by median
+// cuts along the longest axis and write them to filename
+bool writeChunkedMesh(const char *filename, const PLYObject *ply);
+
+// Write a rolling terrain of about the given number of triangles as
+// CHUNK_TILE tiles, one chunk each, without ever holding more than a
+// tile in memory
+bool writeSyntheticChunks(const char *filename, long long triangles);
+
+
+struct Chunk {
+  ChunkInfo info;
+  size_t bytes;			// memory the chunk takes when resident
+  std::atomic<int> state;	// CHUNK_ABSENT ... CHUNK_FAILED
+  char *data;			// block holding the arrays below
+  Vector3f *vertices, *normals;
+  Index3i *faces;
+  Color3u *colors;		// user lighting, see ChunkStream::shade()
+  ShadingStreams streams;	// SoA copy of vertices and normals, filled on load
+  unsigned int lastUsed;	// last frame the chunk was wanted
+  unsigned int shadedEpoch;	// lighting the colors were computed with
+  float distance;		// from the eye in the last update()
+};
+
+
+// The working set of a chunk file. update() picks the chunks in view
+// and, from the camera motion, those about to come into view, and asks
+// the loader thread for the missing ones, nearest first. Chunks no
+// longer wanted are evicted least recently used first whenever the
+// budget needs room. Only the thread calling update() evicts, so the
+// chunks in drawable stay valid until its next update().
+class ChunkStream {
+public:
+
+  // budget in bytes of chunk data held at once
+  ChunkStream(const char *filename, size_t budget);
+  ~ChunkStream();
+
+  // Cull the chunks with projection * modelView, queue the wanted
+  // chunks and fill drawable with the visible resident ones
+  void update(const Matrix4f modelView, const Matrix4f projection);
+
+  // Light the drawable chunks whose colors are older than ctx, on the
+  // threads of pool. Streamed meshes have no hierarchy to trace and no
+  // baked occlusion, so ctx.shadows and ctx.occlusion change nothing.
+  void shade(const LightingContext &ctx);
+
+  // block until nothing is queued or loading
+  void waitForLoads();
+  bool loading();
+
+  bool valid;			// the file could be read
+  int nchunks;
+  Chunk *chunks;
+  long long nv, nf;		// totals over all chunks
+  Vector3f min, max;
+  size_t budget;
+
+  std::vector<int> drawable;	// visible resident chunks, nearest first
+
+  struct {
+    int visible;		// chunks in view
+    int wanted;			// in view or prefetched and within the budget
+    size_t committed;		// bytes resident, loading or queued
+    long long loads, evictions;	// since the stream was opened
+    long long drawnFaces;	// faces of the drawable chunks
+  } stats;
+
+private:
+
+  void request(const std::vector<int> &wanted);
+  void evict(int c);
+  void loaderLoop();
+  bool readChunk(Chunk &c);
+
+  FILE *file;			// read by the loader thread only
+  unsigned int frame;
+  Vector3f lastEye;
+  bool moved;			// lastEye is set
+
+  LightingContext lastLighting;
+  unsigned int lightingEpoch;
+  ThreadPool *pool;		// shades the chunks
+
+  std::thread loader;
+  std::mutex lock;		// guards queue, busy, quit and the stats
+  std::condition_variable wake, idle;
+  std::deque<int> queue;	// chunks to load, nearest first
+  int busy;			// chunks being read
+  bool quit;
+};
+
+
+// Update stream for the current GL matrices and draw its visible
+// chunks (PLYDraw.cpp, needs OpenGL)
+void drawChunks(ChunkStream &stream);
+
+#endif
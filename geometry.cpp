@@ -11,6 +11,7 @@
 #include <math.h>
 
 #include "geometry.h"
+#include "simd.h"
 
 
 void add(Vector3f sum, const Vector3f v)
@@ -152,16 +153,18 @@ float normalize(Vector3f n)
   float norm;
 
   norm = sqrt(dotProd(n, n));
-  scale(n, 1.0/norm);
+  // degenerate triangles have no normal, leave them zero
+  if (norm > 0.0)
+    scale(n, 1.0/norm);
 
   return norm;
 }
 
-void normalizeVector(Vector3f n, Vector3f input)
+void normalizeVector(Vector3f n, const Vector3f input)
 {
   float l = length(input);
   for(int i = 0; i<3; i++)
-        n[i] = (input[i]/l);
+        n[i] = l > 0.0 ? (input[i]/l) : 0.0;
 
 }
 
@@ -258,6 +261,34 @@ void transpose(Matrix4f m, const Matrix4f m1)
 }
 
 
+bool invertAffine(Matrix4f m, const Matrix4f m1)
+{
+  int i, j;
+  float det;
+  Matrix3f a;
+
+  // cofactors of the upper 3x3 part
+  for (j = 0; j < 3; j++)
+    for (i = 0; i < 3; i++)
+      a[i][j] = m1[(j+1)%3][(i+1)%3] * m1[(j+2)%3][(i+2)%3] -
+                m1[(j+1)%3][(i+2)%3] * m1[(j+2)%3][(i+1)%3];
+  det = m1[0][0] * a[0][0] + m1[0][1] * a[1][0] + m1[0][2] * a[2][0];
+  if (det == 0.0)
+    return false;
+
+  for (j = 0; j < 3; j++) {
+    m[j][3] = 0.0;
+    for (i = 0; i < 3; i++) {
+      m[j][i] = a[j][i] / det;
+      m[j][3] -= m[j][i] * m1[i][3];
+    }
+    m[3][j] = 0.0;
+  }
+  m[3][3] = 1.0;
+  return true;
+}
+
+
 void scaleMatrix(Matrix3f m, float s)
 {
   int i, j;
@@ -392,14 +423,9 @@ void multVectors4(Vector4f res, const Vector4f u, const Vector4f v)
 		res[j] = u[j] * v[j];
 }
 
-float length(Vector3f input)
-{
-  float result = 0;
-  for(int i = 0; i<3; i++)
-        result += pow(input[i],2);
-
-  result = sqrt(result);
-  return result;
+float length(const Vector3f input)
+{
+  return sqrt(dotProd(input, input));
 }
 
 void negative(Vector3f n, Vector3f input)
@@ -414,3 +440,140 @@ void copy(Vector4f n, Vector4f input)
    for(int i = 0; i<4; i++)
         n[i] = input[i];
 }
+
+
+//##########################################
+// Batch operations
+
+void transformPointsScalar(Vector3f *out, const Matrix4f m, const Vector3f *in, int n)
+{
+  for (int i = 0; i < n; i++) {
+    float x = in[i][0], y = in[i][1], z = in[i][2];
+
+    for (int j = 0; j < 3; j++)
+      out[i][j] = x * m[j][0] + y * m[j][1] + z * m[j][2] + m[j][3];
+  }
+}
+
+
+void normalizeVectorsScalar(Vector3f *out, const Vector3f *in, int n)
+{
+  for (int i = 0; i < n; i++) {
+    float d = dotProd(in[i], in[i]);
+    float inv = d > 0.0f ? 1.0f / sqrtf(d) : 0.0f;
+
+    for (int j = 0; j < 3; j++)
+      out[i][j] = in[i][j] * inv;
+  }
+}
+
+
+void triangleNormalsScalar(Vector3f *out, const Vector3f *vertices, const Index3i *faces, int n)
+{
+  for (int i = 0; i < n; i++) {
+    Vector3f u, v;
+
+    sub(u, vertices[faces[i][1]], vertices[faces[i][0]]);
+    sub(v, vertices[faces[i][2]], vertices[faces[i][0]]);
+    vecProd(out[i], u, v);
+  }
+  normalizeVectorsScalar(out, out, n);
+}
+
+
+void dotProductsScalar(float *out, const Vector3f *a, const Vector3f *b, int n)
+{
+  for (int i = 0; i < n; i++)
+    out[i] = dotProd(a[i], b[i]);
+}
+
+
+void addScaledVectorsScalar(Vector3f *out, float s, const Vector3f *v, int n)
+{
+  float *o = out[0];
+  const float *w = v[0];
+
+  for (int i = 0; i < 3 * n; i++)
+    o[i] += s * w[i];
+}
+
+
+void scaleVectorsScalar(Vector3f *v, float s, int n)
+{
+  float *o = v[0];
+
+  for (int i = 0; i < 3 * n; i++)
+    o[i] *= s;
+}
+
+
+void transformPoints(Vector3f *out, const Matrix4f m, const Vector3f *in, int n)
+{
+#ifdef SIMD_X86
+  if (simdLevel() >= SIMD_AVX2) {
+    transformPointsAVX2(out, m, in, n);
+    return;
+  }
+#endif
+  transformPointsScalar(out, m, in, n);
+}
+
+
+void normalizeVectors(Vector3f *out, const Vector3f *in, int n)
+{
+#ifdef SIMD_X86
+  if (simdLevel() >= SIMD_AVX2) {
+    normalizeVectorsAVX2(out, in, n);
+    return;
+  }
+#endif
+  normalizeVectorsScalar(out, in, n);
+}
+
+
+void triangleNormals(Vector3f *out, const Vector3f *vertices, const Index3i *faces, int n)
+{
+#ifdef SIMD_X86
+  if (simdLevel() >= SIMD_AVX2) {
+    triangleNormalsAVX2(out, vertices, faces, n);
+    return;
+  }
+#endif
+  triangleNormalsScalar(out, vertices, faces, n);
+}
+
+
+void dotProducts(float *out, const Vector3f *a, const Vector3f *b, int n)
+{
+#ifdef SIMD_X86
+  if (simdLevel() >= SIMD_AVX2) {
+    dotProductsAVX2(out, a, b, n);
+    return;
+  }
+#endif
+  dotProductsScalar(out, a, b, n);
+}
+
+
+void addScaledVectors(Vector3f *out, float s, const Vector3f *v, int n)
+{
+#ifdef SIMD_X86
+  if (simdLevel() >= SIMD_AVX2) {
+    addScaledVectorsAVX2(out, s, v, n);
+    return;
+  }
+#endif
+  addScaledVectorsScalar(out, s, v, n);
+}
+
+
+void scaleVectors(Vector3f *v, float s, int n)
+{
+#ifdef SIMD_X86
+  if (simdLevel() >= SIMD_AVX2) {
+    scaleVectorsAVX2(v, s, n);
+    return;
+  }
+#endif
+  scaleVectorsScalar(v, s, n);
+}
@@ -44,7 +44,7 @@ void vecProd(Vector3d n, const Vector3d u, const Vector3d v);
 float normalize(Vector3f n);
 double normalize(Vector3d n);
 
-void normalizeVector(Vector3f n, Vector3f input);
+void normalizeVector(Vector3f n, const Vector3f input);
 
 void normal(Vector3f n, const Vector3f p, const Vector3f q, const Vector3f r);
 void normal(Vector3d n, const Vector3d p, const Vector3d q, const Vector3d r);
@@ -57,6 +57,8 @@ void setRowVectors(Matrix4f m, const Vector3f u, const Vector3f v, const Vector3
 void setColVectors(Matrix4f m, const Vector3f u, const Vector3f v, const Vector3f w);
 
 void transpose(Matrix4f m, const Matrix4f m1);
+// inverse of an affine matrix (last row 0 0 0 1), false if singular
+bool invertAffine(Matrix4f m, const Matrix4f m1);
 
 void scaleMatrix(Matrix3f m, float s);
 
@@ -82,11 +84,41 @@ void multVector(Vector3f u, const Matrix4f m, const Vector3f v);
 void multVectors(Vector3f res, const Vector3f u, const Vector3f v);
 void multVectors4(Vector4f res, const Vector4f u, const Vector4f v);
 
-float length(Vector3f input);
+float length(const Vector3f input);
 float length4(Vector4f input);
 
 void negative(Vector3f n, Vector3f input);
 void copy(Vector4f n, Vector4f input);
-
 
+// Batch operations on n consecutive elements, run by the AVX2 kernels
+// of geometrySIMD when simdLevel() allows. The output may be the input
+// array. Zero length vectors normalize to zero.
+typedef int Index3i[3];
+
+// out[i] = m * in[i] as multVector() computes it
+void transformPoints(Vector3f *out, const Matrix4f m, const Vector3f *in, int n);
+void normalizeVectors(Vector3f *out, const Vector3f *in, int n);
+// unit normal of each face, counterclockwise as normal() does
+void triangleNormals(Vector3f *out, const Vector3f *vertices, const Index3i *faces, int n);
+void dotProducts(float *out, const Vector3f *a, const Vector3f *b, int n);
+// out[i] += s * v[i]
+void addScaledVectors(Vector3f *out, float s, const Vector3f *v, int n);
+void scaleVectors(Vector3f *v, float s, int n);
+
+// the kernels behind them
+void transformPointsScalar(Vector3f *out, const Matrix4f m, const Vector3f *in, int n);
+void normalizeVectorsScalar(Vector3f *out, const Vector3f *in, int n);
+void triangleNormalsScalar(Vector3f *out, const Vector3f *vertices, const Index3i *faces, int n);
+void dotProductsScalar(float *out, const Vector3f *a, const Vector3f *b, int n);
+void addScaledVectorsScalar(Vector3f *out, float s, const Vector3f *v, int n);
+void scaleVectorsScalar(Vector3f *v, float s, int n);
+
+void transformPointsAVX2(Vector3f *out, const Matrix4f m, const Vector3f *in, int n);
+void normalizeVectorsAVX2(Vector3f *out, const Vector3f *in, int n);
+void triangleNormalsAVX2(Vector3f *out, const Vector3f *vertices, const Index3i *faces, int n);
+void dotProductsAVX2(float *out, const Vector3f *a, const Vector3f *b, int n);
+void addScaledVectorsAVX2(Vector3f *out, float s, const Vector3f *v, int n);
+void scaleVectorsAVX2(Vector3f *v, float s, int n);
+
+
 #endif
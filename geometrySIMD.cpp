@@ -0,0 +1,241 @@
+/* File: geometrySIMD
+ * Description:
+ *   AVX2 versions of the batch vector operations of geometry. Eight
+ *   Vector3f, 24 consecutive floats, are split into x, y and z vectors
+ *   with three blends and a permute each and put back together the same
+ *   way. The arithmetic runs in the order of the scalar kernels and
+ *   without fused multiply-adds, so both give the same bits. Arrays from
+ *   the mesh arena start on a cache line, so every block of eight vectors
+ *   starts on 32 bytes and the kernels switch to aligned loads and stores.
+ */
+
+#include "geometry.h"
+#include "simd.h"
+
+#ifdef SIMD_X86
+
+#include <stdint.h>
+#include <immintrin.h>
+
+
+// lanes 0,3,6 / 1,4,7 / 2,5 of a vector
+#define LANES_036 0x49
+#define LANES_147 0x92
+#define LANES_25  0x24
+
+
+#define ALIGNED32(p) (((uintptr_t)(p) & 31) == 0)
+
+
+template <bool aligned>
+SIMD_TARGET("avx2")
+static inline __m256 load(const float *p)
+{
+  return aligned ? _mm256_load_ps(p) : _mm256_loadu_ps(p);
+}
+
+
+template <bool aligned>
+SIMD_TARGET("avx2")
+static inline void store(float *p, __m256 v)
+{
+  if (aligned)
+    _mm256_store_ps(p, v);
+  else
+    _mm256_storeu_ps(p, v);
+}
+
+
+// x, y and z of the eight vectors starting at p
+template <bool aligned>
+SIMD_TARGET("avx2")
+static inline void load8(const float *p, __m256 &x, __m256 &y, __m256 &z)
+{
+  __m256 a = load<aligned>(p), b = load<aligned>(p + 8), c = load<aligned>(p + 16);
+
+  x = _mm256_blend_ps(_mm256_blend_ps(a, b, LANES_147), c, LANES_25);
+  y = _mm256_blend_ps(_mm256_blend_ps(a, b, LANES_25), c, LANES_036);
+  z = _mm256_blend_ps(_mm256_blend_ps(a, b, LANES_036), c, LANES_147);
+  x = _mm256_permutevar8x32_ps(x, _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5));
+  y = _mm256_permutevar8x32_ps(y, _mm256_setr_epi32(1, 4, 7, 2, 5, 0, 3, 6));
+  z = _mm256_permutevar8x32_ps(z, _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7));
+}
+
+
+template <bool aligned>
+SIMD_TARGET("avx2")
+static inline void store8(float *p, __m256 x, __m256 y, __m256 z)
+{
+  x = _mm256_permutevar8x32_ps(x, _mm256_setr_epi32(0, 3, 6, 1, 4, 7, 2, 5));
+  y = _mm256_permutevar8x32_ps(y, _mm256_setr_epi32(5, 0, 3, 6, 1, 4, 7, 2));
+  z = _mm256_permutevar8x32_ps(z, _mm256_setr_epi32(2, 5, 0, 3, 6, 1, 4, 7));
+  store<aligned>(p, _mm256_blend_ps(_mm256_blend_ps(x, y, LANES_147), z, LANES_25));
+  store<aligned>(p + 8, _mm256_blend_ps(_mm256_blend_ps(x, y, LANES_25), z, LANES_036));
+  store<aligned>(p + 16, _mm256_blend_ps(_mm256_blend_ps(x, y, LANES_036), z, LANES_147));
+}
+
+
+// v / |v|, zero where |v| is zero
+SIMD_TARGET("avx2")
+static inline void normalize8(__m256 &x, __m256 &y, __m256 &z)
+{
+  __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z));
+  __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(d));
+
+  inv = _mm256_and_ps(_mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GT_OQ), inv);
+  x = _mm256_mul_ps(x, inv);
+  y = _mm256_mul_ps(y, inv);
+  z = _mm256_mul_ps(z, inv);
+}
+
+
+// the first n / 8 * 8 points, the rest is left to the scalar kernel
+template <bool aligned>
+SIMD_TARGET("avx2")
+static int transformPoints8(Vector3f *out, const Matrix4f m, const Vector3f *in, int n)
+{
+  __m256 M[3][4];
+  int i;
+
+  for (int j = 0; j < 3; j++)
+    for (int k = 0; k < 4; k++)
+      M[j][k] = _mm256_set1_ps(m[j][k]);
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 x, y, z, r[3];
+
+    load8<aligned>(in[i], x, y, z);
+    for (int j = 0; j < 3; j++)
+      r[j] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, M[j][0]), _mm256_mul_ps(y, M[j][1])),
+                                         _mm256_mul_ps(z, M[j][2])), M[j][3]);
+    store8<aligned>(out[i], r[0], r[1], r[2]);
+  }
+  return i;
+}
+
+
+SIMD_TARGET("avx2")
+void transformPointsAVX2(Vector3f *out, const Matrix4f m, const Vector3f *in, int n)
+{
+  int i = ALIGNED32(out) && ALIGNED32(in) ? transformPoints8<true>(out, m, in, n)
+                                          : transformPoints8<false>(out, m, in, n);
+
+  transformPointsScalar(out + i, m, in + i, n - i);
+}
+
+
+template <bool aligned>
+SIMD_TARGET("avx2")
+static int normalizeVectors8(Vector3f *out, const Vector3f *in, int n)
+{
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 x, y, z;
+
+    load8<aligned>(in[i], x, y, z);
+    normalize8(x, y, z);
+    store8<aligned>(out[i], x, y, z);
+  }
+  return i;
+}
+
+
+SIMD_TARGET("avx2")
+void normalizeVectorsAVX2(Vector3f *out, const Vector3f *in, int n)
+{
+  int i = ALIGNED32(out) && ALIGNED32(in) ? normalizeVectors8<true>(out, in, n)
+                                          : normalizeVectors8<false>(out, in, n);
+
+  normalizeVectorsScalar(out + i, in + i, n - i);
+}
+
+
+template <bool aligned>
+SIMD_TARGET("avx2")
+static int triangleNormals8(Vector3f *out, const Vector3f *vertices, const Index3i *faces, int n)
+{
+  const float *base = vertices[0];
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 p[3][3];
+
+    // corners j of the eight faces, gathered coordinate by coordinate
+    for (int j = 0; j < 3; j++) {
+      __m256i idx = _mm256_i32gather_epi32((const int*)faces[i] + j, _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21), 4);
+      idx = _mm256_add_epi32(idx, _mm256_add_epi32(idx, idx));
+      for (int k = 0; k < 3; k++)
+        p[j][k] = _mm256_i32gather_ps(base + k, idx, 4);
+    }
+
+    __m256 ux = _mm256_sub_ps(p[1][0], p[0][0]), uy = _mm256_sub_ps(p[1][1], p[0][1]), uz = _mm256_sub_ps(p[1][2], p[0][2]);
+    __m256 vx = _mm256_sub_ps(p[2][0], p[0][0]), vy = _mm256_sub_ps(p[2][1], p[0][1]), vz = _mm256_sub_ps(p[2][2], p[0][2]);
+    __m256 x = _mm256_sub_ps(_mm256_mul_ps(uy, vz), _mm256_mul_ps(uz, vy));
+    __m256 y = _mm256_sub_ps(_mm256_mul_ps(uz, vx), _mm256_mul_ps(ux, vz));
+    __m256 z = _mm256_sub_ps(_mm256_mul_ps(ux, vy), _mm256_mul_ps(uy, vx));
+
+    normalize8(x, y, z);
+    store8<aligned>(out[i], x, y, z);
+  }
+  return i;
+}
+
+
+SIMD_TARGET("avx2")
+void triangleNormalsAVX2(Vector3f *out, const Vector3f *vertices, const Index3i *faces, int n)
+{
+  int i = ALIGNED32(out) ? triangleNormals8<true>(out, vertices, faces, n)
+                         : triangleNormals8<false>(out, vertices, faces, n);
+
+  triangleNormalsScalar(out + i, vertices, faces + i, n - i);
+}
+
+
+SIMD_TARGET("avx2")
+void dotProductsAVX2(float *out, const Vector3f *a, const Vector3f *b, int n)
+{
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    __m256 ax, ay, az, bx, by, bz;
+
+    load8<false>(a[i], ax, ay, az);
+    load8<false>(b[i], bx, by, bz);
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, bx), _mm256_mul_ps(ay, by)),
+                                            _mm256_mul_ps(az, bz)));
+  }
+  dotProductsScalar(out + i, a + i, b + i, n - i);
+}
+
+
+SIMD_TARGET("avx2")
+void addScaledVectorsAVX2(Vector3f *out, float s, const Vector3f *v, int n)
+{
+  __m256 S = _mm256_set1_ps(s);
+  float *o = out[0];
+  const float *w = v[0];
+  int i;
+
+  // a flat run of floats, the coordinates do not matter
+  for (i = 0; i + 8 <= 3 * n; i += 8)
+    _mm256_storeu_ps(o + i, _mm256_add_ps(_mm256_loadu_ps(o + i), _mm256_mul_ps(S, _mm256_loadu_ps(w + i))));
+  for (; i < 3 * n; i++)
+    o[i] += s * w[i];
+}
+
+
+SIMD_TARGET("avx2")
+void scaleVectorsAVX2(Vector3f *v, float s, int n)
+{
+  __m256 S = _mm256_set1_ps(s);
+  float *o = v[0];
+  int i;
+
+  for (i = 0; i + 8 <= 3 * n; i += 8)
+    _mm256_storeu_ps(o + i, _mm256_mul_ps(_mm256_loadu_ps(o + i), S));
+  for (; i < 3 * n; i++)
+    o[i] *= s;
+}
+
+#endif
@@ -0,0 +1,205 @@
+/* File: image
+ * Description:
+ *   Writing of 8-bit RGB frames to PPM and PNG files
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "image.h"
+
+
+bool writePPM(const char *filename, const unsigned char *rgb, int width, int height)
+{
+  FILE *out;
+  bool ok;
+
+  if (!(out = fopen(filename, "wb"))) {
+    fprintf(stderr, "Error: cannot open output file %s.\n", filename);
+    return false;
+  }
+  fprintf(out, "P6\n%d %d\n255\n", width, height);
+  ok = fwrite(rgb, 3 * width, height, out) == (size_t)height;
+  if (fclose(out) != 0 || !ok) {
+    fprintf(stderr, "Error: could not write %s.\n", filename);
+    return false;
+  }
+  return true;
+}
+
+
+//##########################################
+// PNG
+
+static unsigned int crcTable[256];
+
+static void makeCrcTable()
+{
+  for (unsigned int n = 0; n < 256; n++) {
+    unsigned int c = n;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    crcTable[n] = c;
+  }
+}
+
+
+static unsigned int updateCrc(unsigned int crc, const unsigned char *p, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    crc = crcTable[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+
+static unsigned int updateAdler(unsigned int adler, const unsigned char *p, size_t n)
+{
+  unsigned int a = adler & 0xffff, b = adler >> 16;
+
+  // 5552 bytes is the most that can be summed before b overflows
+  while (n > 0) {
+    size_t m = n < 5552 ? n : 5552;
+    n -= m;
+    while (m--) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+
+// Writes the chunk data in pieces and keeps the running CRC
+struct PNGChunk {
+  FILE *out;
+  unsigned int crc;
+};
+
+
+static void putBigEndian(unsigned char *p, unsigned int v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+
+static void beginChunk(PNGChunk &c, const char *type, unsigned int length)
+{
+  unsigned char head[8];
+
+  putBigEndian(head, length);
+  memcpy(head + 4, type, 4);
+  fwrite(head, 1, 8, c.out);
+  c.crc = updateCrc(0xffffffffu, head + 4, 4);
+}
+
+
+static void chunkData(PNGChunk &c, const unsigned char *p, size_t n)
+{
+  fwrite(p, 1, n, c.out);
+  c.crc = updateCrc(c.crc, p, n);
+}
+
+
+static void endChunk(PNGChunk &c)
+{
+  unsigned char tail[4];
+
+  putBigEndian(tail, c.crc ^ 0xffffffffu);
+  fwrite(tail, 1, 4, c.out);
+}
+
+
+bool writePNG(const char *filename, const unsigned char *rgb, int width, int height)
+{
+  static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  const size_t maxBlock = 65535;
+  size_t rowSize = 3 * (size_t)width + 1;	// filter type byte and pixels
+  size_t raw = rowSize * height;
+  size_t nblocks = raw ? (raw + maxBlock - 1) / maxBlock : 1;
+  unsigned char header[13], zhead[2] = {0x78, 0x01}, block[5], word[4], filter = 0;
+  unsigned int adler = 1;
+  size_t row = 0, col = 0, left = raw;
+  PNGChunk c;
+  bool ok;
+
+  if (!crcTable[1])
+    makeCrcTable();
+  if (!(c.out = fopen(filename, "wb"))) {
+    fprintf(stderr, "Error: cannot open output file %s.\n", filename);
+    return false;
+  }
+  fwrite(signature, 1, 8, c.out);
+
+  putBigEndian(header, width);
+  putBigEndian(header + 4, height);
+  header[8] = 8;		// bits per channel
+  header[9] = 2;		// RGB
+  header[10] = header[11] = header[12] = 0;
+  beginChunk(c, "IHDR", 13);
+  chunkData(c, header, 13);
+  endChunk(c);
+
+  // zlib stream of stored blocks, each row is prefixed by filter 0
+  beginChunk(c, "IDAT", 2 + 5 * nblocks + raw + 4);
+  chunkData(c, zhead, 2);
+  do {
+    size_t n = left < maxBlock ? left : maxBlock;
+
+    left -= n;
+    block[0] = left == 0;
+    block[1] = n & 0xff;
+    block[2] = n >> 8;
+    block[3] = ~n & 0xff;
+    block[4] = (~n >> 8) & 0xff;
+    chunkData(c, block, 5);
+
+    while (n > 0) {
+      if (col == 0) {
+        chunkData(c, &filter, 1);
+        adler = updateAdler(adler, &filter, 1);
+        col = 1;
+        n--;
+        continue;
+      }
+      size_t m = rowSize - col < n ? rowSize - col : n;
+      const unsigned char *p = rgb + row * (rowSize - 1) + (col - 1);
+      chunkData(c, p, m);
+      adler = updateAdler(adler, p, m);
+      n -= m;
+      if ((col += m) == rowSize) {
+        col = 0;
+        row++;
+      }
+    }
+  } while (left > 0);
+  putBigEndian(word, adler);
+  chunkData(c, word, 4);
+  endChunk(c);
+
+  beginChunk(c, "IEND", 0);
+  endChunk(c);
+
+  ok = !ferror(c.out);
+  if (fclose(c.out) != 0 || !ok) {
+    fprintf(stderr, "Error: could not write %s.\n", filename);
+    return false;
+  }
+  return true;
+}
+
+
+bool writeImage(const char *filename, const unsigned char *rgb, int width, int height)
+{
+  size_t n = strlen(filename);
+
+  if (n >= 4 && filename[n-4] == '.' && tolower(filename[n-3]) == 'p' &&
+      tolower(filename[n-2]) == 'n' && tolower(filename[n-1]) == 'g')
+    return writePNG(filename, rgb, width, height);
+  return writePPM(filename, rgb, width, height);
+}
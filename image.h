@@ -0,0 +1,20 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+/* File: image
+ * Description:
+ *   Writing of 8-bit RGB frames to PPM and PNG files
+ */
+
+
+// rgb holds height rows of width pixels, the top row first
+bool writePPM(const char *filename, const unsigned char *rgb, int width, int height);
+
+// The PNG is not compressed (stored deflate blocks), it only needs to
+// be readable by other tools, not small.
+bool writePNG(const char *filename, const unsigned char *rgb, int width, int height);
+
+// PNG if filename ends in .png, PPM otherwise
+bool writeImage(const char *filename, const unsigned char *rgb, int width, int height);
+
+#endif
@@ -2,6 +2,8 @@
 #include <sys/types.h>
 #include "inputModule.h"
 #include "PLY.h"
+#include "occlusion.h"
+#include "profiler.h"
 
 /* This File contains the KeyBoard and mouse handling routines */
 
@@ -16,6 +18,13 @@ GLfloat current_pos[] = {0.0, 0.0, 5.0};
 
 int flat = 0;
 int light = 1;
+int perPixel = 0;
+int objectSpace = 0;
+int shadows = 0;
+int ambientOcclusion = 0;
+int showProfile = 0;
+const char *traceFile = "trace.json";
+const char *meshFile = "bunny.ply";
 
 extern PLYObject* ply;
 
@@ -49,6 +58,49 @@ void readKeyboard(unsigned char key, int x, int y)
     light = (light + 1) % 2;
     printf("%s lighting\n", (light ? "OpenGL" : "User"));
     break;
+  case 'p':
+  case 'P':
+    perPixel = !perPixel;
+    printf("%s shading\n", (perPixel ? "Per-pixel" : "Per-vertex"));
+    break;
+  case 'o':
+  case 'O':
+    objectSpace = !objectSpace;
+    printf("User lighting in %s space\n", (objectSpace ? "object" : "eye"));
+    break;
+  case 's':
+  case 'S':
+    shadows = !shadows;
+    printf("Shadows %s\n", (shadows ? "on" : "off"));
+    break;
+  case 'a':
+  case 'A':
+    ambientOcclusion = !ambientOcclusion;
+    printf("Ambient occlusion %s\n", (ambientOcclusion ? "on" : "off"));
+    if (ambientOcclusion && ply && !ply->bake) {
+      ply->bakeOcclusion(meshFile);
+      if (ply->bake)
+        glutTimerFunc(BAKE_POLL_MS, watchBake, -1);
+    }
+    break;
+  case 'f':
+  case 'F':
+    showProfile = !showProfile;
+    break;
+  case 'x':
+  case 'X':
+    profileWriteTrace(traceFile);
+    break;
+  case 'k':
+  case 'K':
+    if (ply) {
+      int f = ply->pickPixel(x, y);
+      if (f >= 0)
+        printf("face %d, vertices %d %d %d\n", f, ply->faces[f][0], ply->faces[f][1], ply->faces[f][2]);
+      else
+        printf("no face under the cursor\n");
+    }
+    break;
   case 't':
   case 'T':
 		// PA4: Change some variable here...
@@ -67,7 +119,14 @@ void readKeyboard(unsigned char key, int x, int y)
     printf("\tPress q/Q for Quit\n");
     printf("\tPress h/H to print this help\n");
     printf("\tPress l/L to turn on/off Lighting\n");
+    printf("\tPress p/P to switch between per-vertex and per-pixel shading\n");
+    printf("\tPress o/O to switch the user lighting between eye and object space\n");
+    printf("\tPress s/S to turn on/off the shadows of the first light in user lighting\n");
+    printf("\tPress a/A to turn on/off the ambient occlusion in user lighting, baked on first use\n");
     printf("\tPress i/I to invert the normals\n");
+    printf("\tPress f/F to show or hide the frame times\n");
+    printf("\tPress x/X to write a Chrome trace of the last frames to %s\n", traceFile);
+    printf("\tPress k/K to pick the face under the cursor\n");
     printf("\tPress r/R to revert ViewPoint to initial position\n");
     printf("\tPress + to make the bunny grow fatter\n");
     printf("\tPress - to make the bunny grow thinner\n");
@@ -172,3 +231,19 @@ void setUserView()
   glRotatef(angle2, 1.0, 0.0, 0.0);
   glRotatef(angle, 0.0, 1.0, 0.0);
 }
+
+
+void watchBake(int percent)
+{
+  if (!ply || !ply->bake)
+    return;
+  if (ply->bake->finished()) {
+    glutPostRedisplay();
+    return;
+  }
+
+  int done = (int)(100.0 * ply->bake->progress());
+  if (done != percent)
+    printf("baking ambient occlusion, %d%% done\n", done);
+  glutTimerFunc(BAKE_POLL_MS, watchBake, done);
+}
@@ -14,6 +14,16 @@
 
 
 extern GLfloat current_pos[];
+extern int light;		// OpenGL lighting instead of the CPU Phong
+extern int perPixel;		// shade the window per pixel with the software rasterizer
+extern int objectSpace;		// user lighting in object space, see toObjectSpace()
+extern int shadows;		// user lighting traces the shadows of the first light
+extern int ambientOcclusion;	// user lighting scales the ambient light by the baked occlusion
+extern int showProfile;		// frame time overlay in the window
+extern const char *traceFile;	// Chrome trace written by the x key
+extern const char *meshFile;	// PLY file shown, the occlusion cache goes next to it
+
+#define BAKE_POLL_MS 100	// how often watchBake() looks at a bake
 
 #ifdef __cplusplus
 extern "C" {
@@ -25,6 +35,10 @@ void mouseButtHandler(int button, int state, int x, int y);
 void mouseMoveHandler(int x, int y);
 void setUserView();
 
+// Timer callback following a bake of the occlusion: prints its progress
+// when the whole percentage changes and redraws once when it is done
+void watchBake(int percent);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,432 @@
+/* File: lighting
+ * Description:
+ *   CPU evaluation of the Phong lighting equation used by the
+ *   user-lighting mode of PLYObject::draw()
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "lighting.h"
+#include "simd.h"
+
+
+//##########################################
+// Light list
+
+void initLightList(LightList &l)
+{
+  l.n = 0;
+  l.nextId = 0;
+}
+
+
+static int findLight(const LightList &l, int id)
+{
+  for (int i = 0; i < l.n; i++)
+    if (l.ids[i] == id)
+      return i;
+  return -1;
+}
+
+
+int addLight(LightList &l, const Light &light)
+{
+  if (l.n == MAX_LIGHTS)
+    return -1;
+  l.lights[l.n] = light;
+  l.ids[l.n] = l.nextId++;
+  return l.ids[l.n++];
+}
+
+
+bool removeLight(LightList &l, int id)
+{
+  int i = findLight(l, id);
+
+  if (i < 0)
+    return false;
+  // keep the order, it is the order the lights are summed in
+  for (l.n--; i < l.n; i++) {
+    l.lights[i] = l.lights[i+1];
+    l.ids[i] = l.ids[i+1];
+  }
+  return true;
+}
+
+
+bool updateLight(LightList &l, int id, const Light &light)
+{
+  int i = findLight(l, id);
+
+  if (i < 0)
+    return false;
+  l.lights[i] = light;
+  return true;
+}
+
+
+// Distance beyond which a light adds at most LIGHT_CUTOFF: solve
+// brightest / (kc + kl*d + kq*d^2) = LIGHT_CUTOFF for d
+static float lightRange(float brightest, float kc, float kl, float kq)
+{
+  float t = brightest / LIGHT_CUTOFF - kc;
+
+  if (t <= 0.0)
+    return 0.0;
+  if (kq > 0.0)
+    return (-kl + sqrt(kl*kl + 4.0*kq*t)) / (2.0*kq);
+  if (kl > 0.0)
+    return t / kl;
+  return FLT_MAX;
+}
+
+
+void setLightingProducts(LightingContext &ctx, const Vector4f As, const LightList &lights,
+                         const Vector4f Am, const Vector4f Dm, const Vector4f Sm)
+{
+  multVectors4(ctx.ambientProduct, As, Am);
+
+  ctx.objectSpace = false;
+  ctx.shadows = false;
+  ctx.occlusion = false;
+  ctx.nlights = lights.n;
+  for (int i = 0; i < lights.n; i++) {
+    const Light &light = lights.lights[i];
+    Vector3f p;
+    float brightest = 0.0;
+
+    multVector(p, ctx.modelView, light.position);
+    ctx.lights.x[i] = p[0];
+    ctx.lights.y[i] = p[1];
+    ctx.lights.z[i] = p[2];
+
+    for (int k = 0; k < 3; k++) {
+      ctx.lights.ambient[k][i] = light.ambient[k] * Am[k];
+      ctx.lights.diffuse[k][i] = light.diffuse[k] * Dm[k];
+      ctx.lights.specular[k][i] = light.specular[k] * Sm[k];
+
+      float sum = ctx.lights.ambient[k][i] + ctx.lights.diffuse[k][i] + ctx.lights.specular[k][i];
+      if (sum > brightest)
+        brightest = sum;
+    }
+
+    ctx.lights.constantAttenuation[i] = light.constantAttenuation;
+    ctx.lights.linearAttenuation[i] = light.linearAttenuation;
+    ctx.lights.quadraticAttenuation[i] = light.quadraticAttenuation;
+    ctx.lights.range[i] = lightRange(brightest, light.constantAttenuation,
+                                     light.linearAttenuation, light.quadraticAttenuation);
+  }
+}
+
+
+bool toObjectSpace(LightingContext &ctx)
+{
+  Matrix4f inverse, rotation;
+  Vector3f e;
+
+  if (ctx.objectSpace)
+    return true;
+  if (!invertAffine(inverse, ctx.modelView))
+    return false;
+
+  for (int i = 0; i < ctx.nlights; i++) {
+    Vector3f p = {ctx.lights.x[i], ctx.lights.y[i], ctx.lights.z[i]};
+
+    multVector(e, inverse, p);
+    ctx.lights.x[i] = e[0];
+    ctx.lights.y[i] = e[1];
+    ctx.lights.z[i] = e[2];
+  }
+
+  // eyeDir is a direction, leave out the translation
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 4; j++)
+      rotation[i][j] = (i < 3 && j < 3) ? inverse[i][j] : (i == j);
+  multVector(e, rotation, ctx.eyeDir);
+  normalizeVector(ctx.eyeDir, e);
+
+  ctx.objectSpace = true;
+  return true;
+}
+
+
+// Only the first nlights entries of the light arrays are set, compare
+// field by field rather than the whole context
+bool sameLighting(const LightingContext &a, const LightingContext &b)
+{
+  int n = a.nlights;
+
+  if (n != b.nlights || a.objectSpace != b.objectSpace || a.shadows != b.shadows ||
+      a.occlusion != b.occlusion ||
+      memcmp(a.modelView, b.modelView, sizeof(Matrix4f)) != 0 ||
+      memcmp(a.eyeDir, b.eyeDir, sizeof(Vector3f)) != 0 ||
+      memcmp(a.ambientProduct, b.ambientProduct, sizeof(Vector4f)) != 0 ||
+      a.shininess != b.shininess)
+    return false;
+
+  if (memcmp(a.lights.x, b.lights.x, n * sizeof(float)) != 0 ||
+      memcmp(a.lights.y, b.lights.y, n * sizeof(float)) != 0 ||
+      memcmp(a.lights.z, b.lights.z, n * sizeof(float)) != 0 ||
+      memcmp(a.lights.constantAttenuation, b.lights.constantAttenuation, n * sizeof(float)) != 0 ||
+      memcmp(a.lights.linearAttenuation, b.lights.linearAttenuation, n * sizeof(float)) != 0 ||
+      memcmp(a.lights.quadraticAttenuation, b.lights.quadraticAttenuation, n * sizeof(float)) != 0)
+    return false;
+  for (int k = 0; k < 3; k++)
+    if (memcmp(a.lights.ambient[k], b.lights.ambient[k], n * sizeof(float)) != 0 ||
+        memcmp(a.lights.diffuse[k], b.lights.diffuse[k], n * sizeof(float)) != 0 ||
+        memcmp(a.lights.specular[k], b.lights.specular[k], n * sizeof(float)) != 0)
+      return false;
+  return true;
+}
+
+
+bool objectSpaceLight(const LightingContext &ctx, int i, Vector3f p)
+{
+  Matrix4f inverse;
+  Vector3f e = {ctx.lights.x[i], ctx.lights.y[i], ctx.lights.z[i]};
+
+  if (ctx.objectSpace) {
+    for (int k = 0; k < 3; k++)
+      p[k] = e[k];
+    return true;
+  }
+  if (!invertAffine(inverse, ctx.modelView))
+    return false;
+  multVector(p, inverse, e);
+  return true;
+}
+
+
+//##########################################
+// Shading
+
+// Phong equation of one vertex with unit normal N, summed over the given
+// lights, each with attenuation factor att; visible scales the diffuse
+// and specular terms of light 0, open the ambient terms
+// If = (As*Am) + sum((Al*Am) + Id + Is) * att
+static inline void shadePoint(const LightingContext &ctx, const Vector3f p, const Vector3f N,
+                              const int *active, int nactive, float visible, float open,
+                              Color3u color)
+{
+  Vector3f vVertex;
+  Vector4f final_color;
+
+  if (ctx.objectSpace)
+    for (int k = 0; k < 3; k++)
+      vVertex[k] = p[k];
+  else
+    multVector(vVertex, ctx.modelView, p);
+  for (int k = 0; k < 3; k++)
+    final_color[k] = ctx.ambientProduct[k] * open;
+
+  for (int a = 0; a < nactive; a++) {
+    int i = active[a];
+    Vector3f lightDir = {ctx.lights.x[i] - vVertex[0],
+                         ctx.lights.y[i] - vVertex[1],
+                         ctx.lights.z[i] - vVertex[2]};
+
+    float d = length(lightDir);
+    if (!(d < ctx.lights.range[i]))
+      continue;
+    float att = 1.0 / (ctx.lights.constantAttenuation[i] +
+                       (ctx.lights.linearAttenuation[i]*d) +
+                       (ctx.lights.quadraticAttenuation[i]*d*d));
+
+    // ambient component of the light
+    float ambient = att * open;
+    for (int k = 0; k < 3; k++)
+      final_color[k] += ambient * ctx.lights.ambient[k][i];
+
+    // Calculate lambertTerm
+    Vector3f L;
+    normalizeVector(L, lightDir);
+    float lambertTerm = dotProd(N, L);
+
+    if (i == 0)
+      att *= visible;
+    if (lambertTerm > 0.0) {
+      // diffuse component
+      for (int k = 0; k < 3; k++)
+        final_color[k] += att * lambertTerm * ctx.lights.diffuse[k][i];
+
+      // specular component
+      Vector3f R;
+      scale(R, lambertTerm*2, N);
+      sub(R, L); // reflect(-L,N)
+
+      float dotProduct = dotProd(R, ctx.eyeDir);
+      float specular_factor;
+      if (dotProduct > 0.0)
+        specular_factor = pow(dotProduct, ctx.shininess);
+      else
+        specular_factor = 0;
+
+      for (int k = 0; k < 3; k++)
+        final_color[k] += att * specular_factor * ctx.lights.specular[k][i];
+    }
+  }
+
+  // several lights can saturate the color
+  for (int k = 0; k < 3; k++)
+    color[k] = (final_color[k] < 1.0 ? final_color[k] : 1.0) * 255;
+}
+
+
+void shadeVertices(const LightingContext &ctx, const Vector3f *vertices, const Vector3f *normals,
+                   Color3u *colors, int begin, int end)
+{
+  int all[MAX_LIGHTS];
+
+  for (int i = 0; i < ctx.nlights; i++)
+    all[i] = i;
+
+  for (int v = begin; v < end; v++) {
+    Vector3f N;
+    normalizeVector(N, normals[v]);
+    shadePoint(ctx, vertices[v], N, all, ctx.nlights, 1.0f, 1.0f, colors[v]);
+  }
+}
+
+
+int cullLights(const LightingContext &ctx, const ShadingStreams &s, int begin, int end, int *active)
+{
+  Vector3f lo = {FLT_MAX, FLT_MAX, FLT_MAX}, hi = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  Vector3f elo = {FLT_MAX, FLT_MAX, FLT_MAX}, ehi = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  int nactive = 0;
+
+  // eye (or object) space box around the entries, from the corners of their box
+  for (int v = begin; v < end; v++) {
+    if (s.px[v] < lo[0]) lo[0] = s.px[v];
+    if (s.px[v] > hi[0]) hi[0] = s.px[v];
+    if (s.py[v] < lo[1]) lo[1] = s.py[v];
+    if (s.py[v] > hi[1]) hi[1] = s.py[v];
+    if (s.pz[v] < lo[2]) lo[2] = s.pz[v];
+    if (s.pz[v] > hi[2]) hi[2] = s.pz[v];
+  }
+  for (int c = 0; c < 8; c++) {
+    Vector3f corner = {c & 1 ? hi[0] : lo[0], c & 2 ? hi[1] : lo[1], c & 4 ? hi[2] : lo[2]}, e;
+    if (!ctx.objectSpace)
+      multVector(e, ctx.modelView, corner);
+    else			// the lights are in object space already
+      for (int k = 0; k < 3; k++)
+        e[k] = corner[k];
+    for (int k = 0; k < 3; k++) {
+      if (e[k] < elo[k]) elo[k] = e[k];
+      if (e[k] > ehi[k]) ehi[k] = e[k];
+    }
+  }
+
+  for (int i = 0; i < ctx.nlights; i++) {
+    float l[3] = {ctx.lights.x[i], ctx.lights.y[i], ctx.lights.z[i]};
+    float d2 = 0.0;
+
+    for (int k = 0; k < 3; k++) {
+      float out = l[k] < elo[k] ? elo[k] - l[k] : l[k] > ehi[k] ? l[k] - ehi[k] : 0.0;
+      d2 += out * out;
+    }
+    // with some slack for the rounding of the per-vertex distances
+    float range = ctx.lights.range[i] * 1.001f + 1e-4f;
+    if (range >= FLT_MAX || d2 < range * range)
+      active[nactive++] = i;
+  }
+  return nactive;
+}
+
+
+void initShadingStreams(ShadingStreams &s)
+{
+  s.px = s.py = s.pz = NULL;
+  s.nx = s.ny = s.nz = NULL;
+  s.n = s.capacity = 0;
+  s.visible = NULL;
+  s.occlusion = NULL;
+}
+
+
+void reserveShadingStreams(ShadingStreams &s, int n)
+{
+  if (n > s.capacity) {
+    // one block, every stream padded to a multiple of the widest vector
+    int padded = (n + 15) & ~15;
+
+    freeShadingStreams(s);
+    s.px = (float*)simdAlloc(6 * padded * sizeof(float));
+    s.py = s.px + padded;
+    s.pz = s.py + padded;
+    s.nx = s.pz + padded;
+    s.ny = s.nx + padded;
+    s.nz = s.ny + padded;
+    s.capacity = padded;
+  }
+  s.n = n;
+}
+
+
+void fillShadingStreams(ShadingStreams &s, const Vector3f *vertices, const Vector3f *normals, int n)
+{
+  int i;
+
+  reserveShadingStreams(s, n);
+
+  for (i = 0; i < n; i++) {
+    Vector3f N;
+
+    s.px[i] = vertices[i][0];
+    s.py[i] = vertices[i][1];
+    s.pz[i] = vertices[i][2];
+
+    normalizeVector(N, normals[i]);
+    s.nx[i] = N[0];
+    s.ny[i] = N[1];
+    s.nz[i] = N[2];
+  }
+}
+
+
+void freeShadingStreams(ShadingStreams &s)
+{
+  if (s.px)
+    simdFree(s.px);
+  initShadingStreams(s);
+}
+
+
+void shadeStreamsScalar(const LightingContext &ctx, const ShadingStreams &s,
+                        Color3u *colors, int begin, int end)
+{
+  int active[MAX_LIGHTS];
+
+  for (int b = begin; b < end; b += LIGHT_BLOCK) {
+    int e = b + LIGHT_BLOCK < end ? b + LIGHT_BLOCK : end;
+    int nactive = cullLights(ctx, s, b, e, active);
+
+    for (int v = b; v < e; v++) {
+      Vector3f p = {s.px[v], s.py[v], s.pz[v]};
+      Vector3f N = {s.nx[v], s.ny[v], s.nz[v]};
+      shadePoint(ctx, p, N, active, nactive, s.visible ? s.visible[v] : 1.0f,
+                 s.occlusion ? s.occlusion[v] : 1.0f, colors[v]);
+    }
+  }
+}
+
+
+void shadeStreams(const LightingContext &ctx, const ShadingStreams &s,
+                  Color3u *colors, int begin, int end)
+{
+  switch (simdLevel()) {
+#ifdef SIMD_X86
+  case SIMD_AVX2:
+    shadeStreamsAVX2(ctx, s, colors, begin, end);
+    break;
+  case SIMD_SSE:
+    shadeStreamsSSE(ctx, s, colors, begin, end);
+    break;
+#endif
+  default:
+    shadeStreamsScalar(ctx, s, colors, begin, end);
+    break;
+  }
+}
@@ -0,0 +1,159 @@
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+/* File: lighting
+ * Description:
+ *   CPU evaluation of the Phong lighting equation used by the
+ *   user-lighting mode of PLYObject::draw()
+ */
+
+#include "geometry.h"
+
+typedef unsigned char Color3u[3];
+
+
+#define MAX_LIGHTS 256
+
+// Lights that add less than this to every color channel of a vertex are
+// skipped, a quarter of the step between two 8-bit colors
+#define LIGHT_CUTOFF (1.0f / 1024.0f)
+
+
+// A point light. The CPU lighting always treats it as a point at
+// position; OpenGL makes it directional if position[3] is 0.
+struct Light {
+  Vector4f position;		// as given to GL_POSITION under an identity modelview
+  Vector4f ambient, diffuse, specular;
+  float constantAttenuation, linearAttenuation, quadraticAttenuation;
+};
+
+
+// The lights of a scene. Every light keeps the id addLight() returned
+// while other lights come and go.
+struct LightList {
+  Light lights[MAX_LIGHTS];
+  int ids[MAX_LIGHTS];
+  int n;
+  int nextId;
+};
+
+
+void initLightList(LightList &l);
+
+// the id of the new light, -1 if the list is full
+int addLight(LightList &l, const Light &light);
+bool removeLight(LightList &l, int id);
+bool updateLight(LightList &l, int id, const Light &light);
+
+
+// Snapshot of the light, material and transform state of one frame.
+// It is filled once before shading so the per-vertex loop does not
+// have to go back to the GL driver or the light list.
+struct LightingContext {
+  Matrix4f modelView;		// modelview rotation as used in display()
+  Vector3f eyeDir;		// normalized viewer direction
+
+  // Set by toObjectSpace(): the lights and eyeDir are in object space and
+  // the kernels use the vertices and normals as they are, without the
+  // modelView transform
+  bool objectSpace;
+
+  // Light 0 casts shadows: its diffuse and specular terms are scaled by
+  // the visibility stream of the ShadingStreams, which whoever shades
+  // with this context traces (PLYObject::shade(), Rasterizer::render())
+  bool shadows;
+
+  // The global and light ambient terms are scaled by the occlusion
+  // stream of the ShadingStreams, where the object has it baked
+  bool occlusion;
+
+  Vector4f ambientProduct;	// global ambient * material ambient (As*Am)
+  float shininess;
+
+  // The lights as structure of arrays, in eye coordinates and with the
+  // colors multiplied by the material (Al*Am, Dl*Dm, Sl*Sm). Light i
+  // reaches up to range[i]; beyond it the attenuation makes it add less
+  // than LIGHT_CUTOFF.
+  int nlights;
+  struct {
+    float x[MAX_LIGHTS], y[MAX_LIGHTS], z[MAX_LIGHTS];
+    float ambient[3][MAX_LIGHTS];
+    float diffuse[3][MAX_LIGHTS];
+    float specular[3][MAX_LIGHTS];
+    float constantAttenuation[MAX_LIGHTS];
+    float linearAttenuation[MAX_LIGHTS];
+    float quadraticAttenuation[MAX_LIGHTS];
+    float range[MAX_LIGHTS];
+  } lights;
+};
+
+
+// Structure-of-arrays copy of the vertex positions and unit normals,
+// the input layout of the vectorized shading kernels
+struct ShadingStreams {
+  float *px, *py, *pz;
+  float *nx, *ny, *nz;
+  int n, capacity;
+
+  // Visibility of light 0 from each entry, 0 in shadow to 1 lit; NULL
+  // leaves it unblocked. Not part of the block above: the owner of the
+  // array sets it before shading, initShadingStreams() clears it.
+  float *visible;
+
+  // Ambient occlusion of each entry, 0 enclosed to 1 open; NULL leaves
+  // the ambient light as it is. Owned and set like visible.
+  float *occlusion;
+};
+
+
+// Fill the products of a context from the global ambient As, the
+// lights and the material. The light positions are taken to eye space
+// with ctx.modelView, which has to be set before.
+void setLightingProducts(LightingContext &ctx, const Vector4f As, const LightList &lights,
+                         const Vector4f Am, const Vector4f Dm, const Vector4f Sm);
+
+// Move the lights and the viewer direction of a context filled by
+// setLightingProducts() into object space with the inverse modelView.
+// Positions and normals are then lit in the same space, so the result
+// differs from the eye space lighting, where the normals are not
+// transformed. Return false, leaving ctx alone, if modelView is singular.
+bool toObjectSpace(LightingContext &ctx);
+
+// true if a and b light every point alike: same view, material and lights
+bool sameLighting(const LightingContext &a, const LightingContext &b);
+
+// Position of light i in the space of the vertices, where shadow rays
+// are traced. False if modelView is singular.
+bool objectSpaceLight(const LightingContext &ctx, int i, Vector3f p);
+
+// shade vertices [begin, end) and store the result in colors
+void shadeVertices(const LightingContext &ctx, const Vector3f *vertices, const Vector3f *normals,
+                   Color3u *colors, int begin, int end);
+
+void initShadingStreams(ShadingStreams &s);
+// make room for n entries, the contents are lost if the streams grow
+void reserveShadingStreams(ShadingStreams &s, int n);
+void fillShadingStreams(ShadingStreams &s, const Vector3f *vertices, const Vector3f *normals, int n);
+void freeShadingStreams(ShadingStreams &s);
+
+// shade vertices [begin, end) of the streams with the best kernel
+// reported by simdLevel(); the result matches shadeVertices() within
+// one unit of the 8-bit colors
+void shadeStreams(const LightingContext &ctx, const ShadingStreams &s,
+                  Color3u *colors, int begin, int end);
+
+// The stream kernels light LIGHT_BLOCK entries at a time. cullLights()
+// stores the lights that reach any entry of [begin, end) in active and
+// returns their number; the others are not evaluated for that block.
+#define LIGHT_BLOCK 64
+int cullLights(const LightingContext &ctx, const ShadingStreams &s, int begin, int end, int *active);
+
+// the individual kernels behind shadeStreams()
+void shadeStreamsScalar(const LightingContext &ctx, const ShadingStreams &s,
+                        Color3u *colors, int begin, int end);
+void shadeStreamsSSE(const LightingContext &ctx, const ShadingStreams &s,
+                     Color3u *colors, int begin, int end);
+void shadeStreamsAVX2(const LightingContext &ctx, const ShadingStreams &s,
+                      Color3u *colors, int begin, int end);
+
+#endif
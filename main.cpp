@@ -8,6 +8,9 @@
 #include <string.h>
 #include <math.h>
 #include <signal.h>
+#include <chrono>
+#include <thread>
+#include <algorithm>
 #include <GL/gl.h>
 #include <GL/glut.h>
 
@@ -16,11 +19,19 @@
 #include "cube.h"
 #include "PLY.h"
 #include "geometry.h"
+#include "lighting.h"
+#include "rasterizer.h"
+#include "profiler.h"
+#include "chunkedMesh.h"
+#include "bvh.h"
+#include "occlusion.h"
 
 int window;
 int updateFlag;
 
 PLYObject *ply;
+ChunkStream *stream;		// out-of-core mesh shown instead of ply
+Rasterizer *raster;		// per-pixel shading of the window
 
 perspectiveData pD;
 
@@ -29,7 +40,9 @@ Vector4f ambient_light = {0.3, 0.3, 0.3, 1.0};
 Vector4f light_color = {0.6, 0.6, 0.6, 1.0};
 Vector4f black_color = {0.0, 0.0, 0.0, 1.0};
 
-Vector3f light_pos, viewer_pos;
+Vector3f viewer_pos;
+
+LightList lights;
 
 
 void cleanup(int sig)
@@ -38,6 +51,10 @@ void cleanup(int sig)
   //fprintf(stderr,"Cleaning up\n");
   if (ply)
     delete(ply);
+  if (raster)
+    delete(raster);
+  if (stream)
+    delete(stream);
   exit(0);
 }
 
@@ -45,11 +62,67 @@ void cleanup(int sig)
 //##########################################
 // OpenGL Display function
 
+// one line of the overlay, left aligned at x, y in window pixels
+void drawText(int x, int y, const char *text, int n)
+{
+  glRasterPos2i(x, y);
+  for (int i = 0; i < n && text[i]; i++)
+    glutBitmapCharacter(GLUT_BITMAP_8_BY_13, text[i]);
+}
+
+
+// Frame rate, the counters of the frame in stats, one per line, and time
+// per stage over the last second, in the top left corner of the window
+void drawProfile(const char *stats)
+{
+  ProfileStage stages[PROFILE_MAX_STAGES];
+  GLint viewport[4];
+  char line[128];
+  double fps;
+  int i, n, y;
+
+  n = profileSummary(1.0, stages, PROFILE_MAX_STAGES, fps);
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  gluOrtho2D(0, viewport[2], 0, viewport[3]);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_LIGHTING);
+  glColor3f(0.0, 0.0, 0.0);
+
+  y = viewport[3] - 18;
+  snprintf(line, sizeof(line), "%.1f fps, %.2f ms per frame", fps, fps > 0.0 ? 1000.0 / fps : 0.0);
+  drawText(8, y, line, sizeof(line));
+  for (const char *s = stats; *s; s += *s == '\n') {
+    int len = strcspn(s, "\n");
+    drawText(8, y -= 15, s, len);
+    s += len;
+  }
+  y -= 5;
+  for (i = 0; i < n; i++) {
+    snprintf(line, sizeof(line), "%-16s %8.3f ms", stages[i].name, stages[i].ms);
+    drawText(8, y -= 15, line, sizeof(line));
+  }
+
+  glEnable(GL_DEPTH_TEST);
+  glPopMatrix();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+}
+
+
 void display(void)
 {
   int i, j;
   float M[16];
   Matrix4f m;
+  char stats[256] = "";
 
   glutSetWindow(window);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -65,26 +138,284 @@ void display(void)
     }
   }
   m[3][3] = 1.0;
-  multVector(light_pos, m, initial_light_pos);
   multVector(viewer_pos, m, current_pos);
 
-  ply->draw();
+  // a finished bake of the occlusion is taken over before the drawing
+  if (ply)
+    ply->updateOcclusion();
+
+  if (perPixel && ply) {
+    if (!raster)
+      raster = new Rasterizer(IMAGE_WIDTH, IMAGE_HEIGHT);
+    ply->drawPixels(*raster);
+    snprintf(stats, sizeof(stats), "transform %.2f ms, bin %.2f ms\nraster %.2f ms, shade %.2f ms",
+             raster->times.transform, raster->times.bin, raster->times.raster, raster->times.shade);
+  }
+  else if (stream) {
+    drawChunks(*stream);
+    snprintf(stats, sizeof(stats), "drew %d of %d chunks in view\n%lld faces, %.0f of %.0f MB in use",
+             (int)stream->drawable.size(), stream->stats.visible, stream->stats.drawnFaces,
+             stream->stats.committed / 1048576.0, stream->budget / 1048576.0);
+  }
+  else {
+    ply->draw();
+    snprintf(stats, sizeof(stats), "drew %d of %d faces", ply->culled ? ply->bvh->visibleFaces :
+             ply->lod > 0 ? ply->lodCount[ply->lod] : ply->nf, ply->nf);
+    if (!light)
+      snprintf(stats + strlen(stats), sizeof(stats) - strlen(stats), "\nshaded %d of %d vertices",
+               ply->shadedVertices, ply->nv);
+  }
+
+  if (ply && ply->bake)
+    snprintf(stats + strlen(stats), sizeof(stats) - strlen(stats), "\nbaking occlusion, %.0f%% done",
+             100.0 * ply->bake->progress());
+
+  if (showProfile)
+    drawProfile(stats);
+
+  {
+    PROFILE_SCOPE("swap");
+    glutSwapBuffers();
+  }
+  profileFrame();
+
+  // keep drawing while the frame times are shown or chunks arrive
+  if (showProfile || (stream && stream->loading()))
+    glutPostRedisplay();
+}
+
+
+//##########################################
+// Headless rendering
+
+// Render a turntable of frames around the initial view of inputModule
+// without a window, lit by the CPU Phong of PLY.cpp with the light
+// list, per vertex or, with perPixel set, per pixel, in object space
+// if objectSpace is set. Frame f
+// is written to the file named by the printf pattern output.
+// lights and viewer as display() places them for the view mv, the
+// eye translated by pos
+void batchLighting(LightingContext &ctx, const Matrix4f mv, const float *pos)
+{
+  Matrix4f m;
+  int i, j;
+
+  for (i = 0; i < 3; i++) {
+    m[i][3] = 0.0;
+    m[3][i] = 0.0;
+    for (j = 0; j < 3; j++)
+      m[i][j] = mv[j][i];
+  }
+  m[3][3] = 1.0;
+  multVector(viewer_pos, m, pos);
+
+  for (i = 0; i < 4; i++)
+    for (j = 0; j < 4; j++)
+      ctx.modelView[i][j] = m[i][j];
+  normalizeVector(ctx.eyeDir, viewer_pos);
+  setMaterialLighting(ctx, black_color, lights);
+  ctx.shadows = shadows;
+  ctx.occlusion = ambientOcclusion;
+  if (objectSpace)
+    toObjectSpace(ctx);
+}
+
+
+void renderBatch(int frames, const char *output)
+{
+  int f;
+  float pos[3] = {0.0, 0.0, 5.0};
+  Matrix4f mv, proj;
+  LightingContext ctx;
+  Rasterizer raster(IMAGE_WIDTH, IMAGE_HEIGHT);
+  char name[1024];
+
+  perspectiveMatrix(proj, pD);
+
+  // the frames wait for the occlusion, so they do not depend on how
+  // far the bake got
+  while (ply->bake && !ply->bake->finished()) {
+    printf("baking ambient occlusion, %.0f%% done\n", 100.0 * ply->bake->progress());
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  profileFrame();
+  for (f = 0; f < frames; f++) {
+    userViewMatrix(mv, 20.0 + 360.0 * f / frames, 30.0, pos);
+    batchLighting(ctx, mv, pos);
+
+    std::chrono::steady_clock::time_point lit = std::chrono::steady_clock::now();
+    if (!perPixel)
+      ply->shade(ctx);
+    double lighting = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - lit).count();
+
+    raster.render(ply, mv, proj, perPixel ? &ctx : NULL);
+    printf("frame %d: vertex lighting %.2f ms (%d vertices), transform %.2f ms, bin %.2f ms, raster %.2f ms, shade %.2f ms\n",
+           f, lighting, ply->shadedVertices, raster.times.transform, raster.times.bin, raster.times.raster, raster.times.shade);
+
+    snprintf(name, sizeof(name), output, f);
+    {
+      PROFILE_SCOPE("writeImage");
+      if (!raster.writeImage(name))
+        exit(1);
+    }
+    profileFrame();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("%d frames in %.2f s, %.1f ms per frame\n", frames, seconds, 1000.0 * seconds / frames);
+}
+
+
+// modelview of an eye at eye looking along dir, y up
+void lookAlong(Matrix4f m, const Vector3f eye, const Vector3f dir)
+{
+  Vector3f up = {0.0, 1.0, 0.0}, f, s, u;
+  int i;
+
+  normalizeVector(f, dir);
+  vecProd(s, f, up);
+  normalize(s);
+  vecProd(u, s, f);
+
+  emptyMatrix(m);
+  for (i = 0; i < 3; i++) {
+    m[0][i] = s[i];
+    m[1][i] = u[i];
+    m[2][i] = -f[i];
+  }
+  m[0][3] = -dotProd(s, eye);
+  m[1][3] = -dotProd(u, eye);
+  m[2][3] = dotProd(f, eye);
+  m[3][3] = 1.0;
+}
+
+
+// Fly a circle low over the streamed mesh without a window, lighting
+// the chunks drawn in each frame on the CPU, and report the working set.
+// Frames are paced to 60 Hz as a display would, the loader thread has
+// the rest of each frame to catch up.
+void streamBatch(int frames)
+{
+  float up[3] = {0.0, 0.0, 1.0};
+  Vector3f center, eye, dir;
+  Matrix4f mv, proj;
+  LightingContext ctx;
+  size_t peak = 0;
+  long long drawn = 0;
+  int f, i;
+
+  float extent = std::max(stream->max[0] - stream->min[0], stream->max[2] - stream->min[2]);
+  for (i = 0; i < 3; i++)
+    center[i] = 0.5 * (stream->min[i] + stream->max[i]);
+  perspectiveMatrix(proj, pD);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  profileFrame();
+  for (f = 0; f < frames; f++) {
+    float a = 2.0 * M_PI * f / frames;
+
+    eye[0] = center[0] + 0.35 * extent * cos(a);
+    eye[1] = stream->max[1] + 0.02 * extent;
+    eye[2] = center[2] + 0.35 * extent * sin(a);
+    dir[0] = -sin(a);
+    dir[1] = -0.25;
+    dir[2] = cos(a);
+    lookAlong(mv, eye, dir);
+
+    std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+    stream->update(mv, proj);
+    batchLighting(ctx, mv, up);
+    stream->shade(ctx);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+    std::this_thread::sleep_until(t + std::chrono::microseconds(16667));
+
+    peak = std::max(peak, stream->stats.committed);
+    drawn += stream->stats.drawnFaces;
+    printf("frame %d: %d chunks in view, %d wanted, %d drawn (%lld faces), %.0f MB in use, "
+           "%lld loads, %lld evictions, %.2f ms\n", f, stream->stats.visible, stream->stats.wanted,
+           (int)stream->drawable.size(), stream->stats.drawnFaces, stream->stats.committed / 1048576.0,
+           stream->stats.loads, stream->stats.evictions, ms);
+    profileFrame();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("%d frames in %.2f s, %.1f ms per frame, %.1fM faces drawn per frame, at most %.0f of %.0f MB in use\n",
+         frames, seconds, 1000.0 * seconds / frames, drawn / 1e6 / frames,
+         peak / 1048576.0, stream->budget / 1048576.0);
+}
+
+
+void writeTrace()
+{
+  profileWriteTrace(traceFile);
+}
+
+
+//##########################################
+// Lights
+
+// the light the scene always had
+void initLights()
+{
+  Light l;
+  int i;
+
+  initLightList(lights);
+  for (i = 0; i < 4; i++) {
+    l.position[i] = initial_light_pos[i];
+    l.ambient[i] = ambient_light[i];
+    l.diffuse[i] = light_color[i];
+    l.specular[i] = light_color[i];
+  }
+  l.constantAttenuation = 1.0;
+  l.linearAttenuation = l.quadraticAttenuation = 0.0;
+  addLight(lights, l);
+}
+
 
-  glutSwapBuffers();
+// n colored point lights with quadratic falloff scattered around the
+// object
+void addRandomLights(int n)
+{
+  Light l;
+  int i, j;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < 3; j++) {
+      l.position[j] = 6.0 * rand() / RAND_MAX - 3.0;
+      l.ambient[j] = 0.0;
+      l.diffuse[j] = l.specular[j] = (float)rand() / RAND_MAX;
+    }
+    l.position[3] = 1.0;
+    l.ambient[3] = l.diffuse[3] = l.specular[3] = 1.0;
+    l.constantAttenuation = 1.0;
+    l.linearAttenuation = 0.0;
+    l.quadraticAttenuation = 10.0;
+    if (addLight(lights, l) < 0) {
+      fprintf(stderr, "Error: at most %d lights.\n", MAX_LIGHTS);
+      exit(1);
+    }
+  }
 }
 
 
 //##########################################
 // Init display settings
 
-void initDisplay()
+void initPerspective()
 {
   // Perspective projection parameters
   pD.fieldOfView = 45.0;
   pD.aspect      = (float)IMAGE_WIDTH/IMAGE_HEIGHT;
   pD.nearPlane   = 0.1;
   pD.farPlane    = 50.0;
+}
+
 
+void initDisplay()
+{
   // setup context
   glMatrixMode(GL_PROJECTION);
   glLoadIdentity();
@@ -100,18 +431,10 @@ void initDisplay()
   glClearIndex(0);
   glClearDepth(1);
 
-  // setup lights
+  // setup lights, draw() enables those of the light list
   glLightModelfv(GL_LIGHT_MODEL_AMBIENT, black_color); // No global ambient light
-  glLightfv(GL_LIGHT0, GL_POSITION, initial_light_pos);
-//  glLightfv(GL_LIGHT0, GL_AMBIENT, black_color);
-//  glLightfv(GL_LIGHT0, GL_DIFFUSE, black_color);
-//  glLightfv(GL_LIGHT0, GL_SPECULAR, black_color);
-  glLightfv(GL_LIGHT0, GL_AMBIENT, ambient_light);
-  glLightfv(GL_LIGHT0, GL_DIFFUSE, light_color);
-  glLightfv(GL_LIGHT0, GL_SPECULAR, light_color);
 
   //glEnable(GL_LIGHTING);
-  glEnable(GL_LIGHT0);
 }
 
 //##########################################
@@ -122,27 +445,119 @@ int main(int argc, char **argv)
 
   //signal(SIGHUP, cleanup);
 
-  glutInit(&argc, argv);
+  const char *filename = "bunny.ply";
+  const char *output = "frame%04d.ppm";
+  int frames = 0;
+  int nlights = 0;
+  int weighting = NORMALS_UNIFORM;
+  const char *chunkOutput = NULL;
+  long long synthetic = 0;
+  int budget = 1024;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+      frames = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      output = argv[++i];
+    else if (strcmp(argv[i], "-p") == 0)
+      perPixel = 1;
+    else if (strcmp(argv[i], "-s") == 0)
+      objectSpace = 1;
+    else if (strcmp(argv[i], "-r") == 0)
+      shadows = 1;
+    else if (strcmp(argv[i], "-a") == 0)
+      ambientOcclusion = 1;
+    else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+      nlights = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      traceFile = argv[++i];
+      atexit(writeTrace);
+    }
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+      chunkOutput = argv[++i];
+    else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+      synthetic = atoll(argv[++i]);
+    else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+      budget = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && strcmp(argv[i+1], "area") == 0)
+      weighting = NORMALS_AREA, i++;
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && strcmp(argv[i+1], "angle") == 0)
+      weighting = NORMALS_ANGLE, i++;
+    else if (argv[i][0] != '-')
+      filename = argv[i];
+    else {
+      fprintf(stderr, "Usage: %s [-b frames] [-o pattern] [-p] [-s] [-r] [-a] [-l lights] [-n area|angle] [-t trace.json]\n"
+              "\t[-c out.chunks [-g triangles]] [-m MB] [filename]\n", argv[0]);
+      fprintf(stderr, "\tfilename is of PLY triangle mesh format (bunny.ply), or a .chunks file to stream\n");
+      fprintf(stderr, "\t-b renders a turntable of frames without a window\n");
+      fprintf(stderr, "\t-o names the frames, .png or .ppm (frame%%04d.ppm)\n");
+      fprintf(stderr, "\t-p lights every pixel instead of the vertices\n");
+      fprintf(stderr, "\t-s lights in object space instead of eye space\n");
+      fprintf(stderr, "\t-r traces the shadows of the first light\n");
+      fprintf(stderr, "\t-a darkens the ambient light by the ambient occlusion, baked once per mesh\n");
+      fprintf(stderr, "\t-l adds that many random point lights\n");
+      fprintf(stderr, "\t-n weights the faces around a vertex by area or angle\n");
+      fprintf(stderr, "\t-t writes a Chrome trace of loading and the last frames on exit\n");
+      fprintf(stderr, "\t-c splits the mesh into chunks for streaming and exits\n");
+      fprintf(stderr, "\t-g makes -c write a synthetic terrain of that many triangles instead\n");
+      fprintf(stderr, "\t-m keeps at most that many MB of streamed chunks in memory (1024)\n");
+      exit(1);
+    }
+  }
 
-	FILE *in;
-  char *filename;
- /* if (argc < 2) {
-    fprintf(stderr, "Usage: %s filename\n", argv[0]);
-    fprintf(stderr, "\tfilename is of PLY triangle mesh format\n");
-    exit(1);
-  }*/
+  if (chunkOutput && synthetic > 0)
+    return writeSyntheticChunks(chunkOutput, synthetic) ? 0 : 1;
 
-  //filename = argv[1];
-  filename = "bunny.ply";
-  if (!(in = fopen(filename, "r"))) {
-    fprintf(stderr, "Cannot open input file %s.\n", filename);
-    exit(1);
+  size_t len = strlen(filename);
+  if (len > 7 && strcmp(filename + len - 7, ".chunks") == 0) {
+    stream = new ChunkStream(filename, (size_t)budget << 20);
+    if (!stream->valid)
+      exit(1);
+    printf("Streaming %lld faces in %d chunks, at most %d MB in memory.\n",
+           stream->nf, stream->nchunks, budget);
+  }
+  else {
+    ply = new PLYObject(filename, true);
+    if (ply->nv == 0)
+      exit(1);
+    if (!ply->cached) {
+      ply->resize();
+      ply->optimizeMesh();
+    }
+    // the cache keeps the order of the hierarchy, rebuilding it moves nothing
+    ply->buildBVH();
+    if (!ply->cached)
+      ply->writeCache(filename);
+    if (weighting != NORMALS_UNIFORM) {
+      ply->normalWeighting = weighting;
+      ply->recomputeNormals();
+    }
+    if (chunkOutput)
+      return writeChunkedMesh(chunkOutput, ply) ? 0 : 1;
+    ply->buildLODs(MAX_LODS);
+    meshFile = filename;
+    if (ambientOcclusion)
+      ply->bakeOcclusion(filename);
   }
-
-  ply = new PLYObject(in);
-  ply->resize();
   srand(time(NULL));
 
+  initLights();
+  addRandomLights(nlights);
+  initPerspective();
+  if (frames > 0) {
+    if (stream) {
+      if (perPixel || shadows || ambientOcclusion)
+        fprintf(stderr, "Warning: streamed chunks are lit per vertex, without shadows or ambient occlusion.\n");
+      streamBatch(frames);
+      delete stream;
+      return 0;
+    }
+    renderBatch(frames, output);
+    delete ply;
+    return 0;
+  }
+
+  glutInit(&argc, argv);
 
   glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
   glutInitWindowSize(IMAGE_WIDTH,IMAGE_HEIGHT);
@@ -157,6 +572,8 @@ int main(int argc, char **argv)
   glutIdleFunc(NULL);
 
   initDisplay();
+  if (ply && ply->bake)
+    glutTimerFunc(BAKE_POLL_MS, watchBake, -1);
 
   glutMainLoop();
 
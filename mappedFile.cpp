@@ -0,0 +1,119 @@
+/* File: mappedFile
+ * Description:
+ *   Private (copy-on-write) memory mapping of a whole file
+ */
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mappedFile.h"
+
+
+void initMappedFile(MappedFile &m)
+{
+  m.data = NULL;
+  m.size = 0;
+#ifdef WIN32
+  m.file = m.mapping = NULL;
+#endif
+}
+
+
+#ifdef WIN32
+
+bool mapFile(MappedFile &m, const char *filename)
+{
+  LARGE_INTEGER size;
+
+  initMappedFile(m);
+  m.file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (m.file == INVALID_HANDLE_VALUE) {
+    m.file = NULL;
+    return false;
+  }
+  if (!GetFileSizeEx(m.file, &size) || size.QuadPart == 0) {
+    unmapFile(m);
+    return false;
+  }
+  m.size = (size_t)size.QuadPart;
+  m.mapping = CreateFileMappingA(m.file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  if (m.mapping)
+    m.data = (char*)MapViewOfFile(m.mapping, FILE_MAP_COPY, 0, 0, 0);
+  if (!m.data) {
+    unmapFile(m);
+    return false;
+  }
+  return true;
+}
+
+
+void unmapFile(MappedFile &m)
+{
+  if (m.data)
+    UnmapViewOfFile(m.data);
+  if (m.mapping)
+    CloseHandle(m.mapping);
+  if (m.file)
+    CloseHandle(m.file);
+  initMappedFile(m);
+}
+
+
+void releaseMappedRange(MappedFile &m, size_t from, size_t to)
+{
+  // private views cannot give back single pages on Win32
+}
+
+#else
+
+bool mapFile(MappedFile &m, const char *filename)
+{
+  struct stat st;
+  void *p;
+  int fd;
+
+  initMappedFile(m);
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return false;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+
+  m.data = (char*)p;
+  m.size = st.st_size;
+  madvise(m.data, m.size, MADV_SEQUENTIAL);
+  return true;
+}
+
+
+void unmapFile(MappedFile &m)
+{
+  if (m.data)
+    munmap(m.data, m.size);
+  initMappedFile(m);
+}
+
+
+void releaseMappedRange(MappedFile &m, size_t from, size_t to)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  from = (from + page - 1) / page * page;
+  to = to / page * page;
+  if (to > from)
+    madvise(m.data + from, to - from, MADV_DONTNEED);
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+/* File: mappedFile
+ * Description:
+ *   Private (copy-on-write) memory mapping of a whole file
+ */
+
+#include <stddef.h>
+
+
+struct MappedFile {
+  char *data;			// first byte of the file, NULL if not mapped
+  size_t size;			// file size in bytes
+#ifdef WIN32
+  void *file, *mapping;		// Win32 handles
+#endif
+};
+
+
+void initMappedFile(MappedFile &m);
+
+// Map filename so that its pages can be read and written; writes stay
+// private to the process. Returns false if the file cannot be mapped.
+bool mapFile(MappedFile &m, const char *filename);
+void unmapFile(MappedFile &m);
+
+// Tell the OS the pages of [from, to) will not be read again, so it
+// can drop them. Only whole pages inside the range are released.
+void releaseMappedRange(MappedFile &m, size_t from, size_t to);
+
+#endif
@@ -0,0 +1,185 @@
+/* File: meshOptimizer
+ * Description:
+ *   Triangle and vertex reordering for the post-transform vertex cache
+ *   and for sequential vertex fetches. The triangle order follows
+ *   T. Forsyth, "Linear-Speed Vertex Cache Optimisation" (2006): every
+ *   vertex is scored by its position in a modelled LRU cache and by the
+ *   number of triangles still waiting for it, and the next triangle is
+ *   the best scored one among those around the cached vertices.
+ */
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "meshOptimizer.h"
+
+
+float vertexCacheACMR(const Index3i *faces, int nf, int nv)
+{
+  // vertex v is in the FIFO while fewer than VCACHE_FIFO misses happened
+  // since it was loaded at miss number loaded[v]
+  std::vector<int> loaded(nv, -VCACHE_FIFO - 1);
+  int misses = 0;
+
+  for (int i = 0; i < nf; i++)
+    for (int j = 0; j < 3; j++) {
+      int v = faces[i][j];
+      if (misses - loaded[v] > VCACHE_FIFO - 1)
+        loaded[v] = misses++;
+    }
+  return nf > 0 ? (float)misses / nf : 0.0;
+}
+
+
+// Forsyth's weights, the three most recent vertices score alike so the
+// triangle just drawn does not pull its own neighbor unduly
+#define LAST_TRIANGLE_SCORE 0.75f
+#define CACHE_DECAY_POWER 1.5f
+#define VALENCE_BOOST_SCALE 2.0f
+#define VALENCE_BOOST_POWER 0.5f
+
+
+static float vertexScore(int cachePos, int remaining)
+{
+  float score;
+
+  if (remaining == 0)
+    return -1.0;
+
+  if (cachePos < 0)
+    score = 0.0;
+  else if (cachePos < 3)
+    score = LAST_TRIANGLE_SCORE;
+  else
+    score = powf(1.0f - (float)(cachePos - 3) / (VCACHE_LRU - 3), CACHE_DECAY_POWER);
+
+  // lone vertices are worth getting rid of early
+  return score + VALENCE_BOOST_SCALE * powf((float)remaining, -VALENCE_BOOST_POWER);
+}
+
+
+void optimizeVertexCache(const Index3i *faces, int nf, int nv, int *order)
+{
+  std::vector<int> start(nv + 1, 0), tris(3 * (size_t)nf), remaining(nv);
+  std::vector<int> cachePos(nv, -1);
+  std::vector<float> score(nv);
+  std::vector<char> emitted(nf, 0);
+  int cache[VCACHE_LRU + 3], newCache[VCACHE_LRU + 3];
+  int cacheSize = 0, cursor = 0, best = -1;
+  int i, j, k;
+
+  // triangles around each vertex, those still to draw come first
+  for (i = 0; i < nf; i++)
+    for (j = 0; j < 3; j++)
+      start[faces[i][j] + 1]++;
+  for (i = 0; i < nv; i++) {
+    remaining[i] = start[i+1];
+    start[i+1] += start[i];
+  }
+  std::vector<int> next(start.begin(), start.end() - 1);
+  for (i = 0; i < nf; i++)
+    for (j = 0; j < 3; j++)
+      tris[next[faces[i][j]]++] = i;
+
+  for (i = 0; i < nv; i++)
+    score[i] = vertexScore(-1, remaining[i]);
+
+  for (k = 0; k < nf; k++) {
+    // nothing cached has triangles left, go on in the input order
+    if (best < 0) {
+      while (emitted[cursor])
+        cursor++;
+      best = cursor;
+    }
+    order[k] = best;
+    emitted[best] = 1;
+
+    // take best out of the lists of its vertices
+    for (j = 0; j < 3; j++) {
+      int v = faces[best][j];
+      int *list = &tris[start[v]], last = --remaining[v];
+
+      for (i = 0; list[i] != best; i++)
+        ;
+      list[i] = list[last];
+      list[last] = best;
+    }
+
+    // its vertices move to the front of the cache
+    int n = 0;
+    for (j = 0; j < 3; j++)
+      newCache[n++] = faces[best][j];
+    for (i = 0; i < cacheSize; i++) {
+      int v = cache[i];
+      if (v != faces[best][0] && v != faces[best][1] && v != faces[best][2])
+        newCache[n++] = v;
+    }
+
+    // rescore the cached vertices, those pushed out of the cache included
+    for (i = 0; i < n; i++) {
+      int v = newCache[i];
+      cachePos[v] = i < VCACHE_LRU ? i : -1;
+      score[v] = vertexScore(cachePos[v], remaining[v]);
+    }
+
+    // best triangle around the cache
+    float bestScore = -1.0;
+    best = -1;
+    for (i = 0; i < n; i++) {
+      int v = newCache[i];
+      for (j = 0; j < remaining[v]; j++) {
+        int t = tris[start[v] + j];
+        float s = score[faces[t][0]] + score[faces[t][1]] + score[faces[t][2]];
+
+        if (s > bestScore) {
+          bestScore = s;
+          best = t;
+        }
+      }
+    }
+
+    cacheSize = n < VCACHE_LRU ? n : VCACHE_LRU;
+    for (i = 0; i < cacheSize; i++)
+      cache[i] = newCache[i];
+  }
+}
+
+
+void optimizePartVertexCache(const Index3i *faces, int *list, int n)
+{
+  std::vector<int> ids(3 * (size_t)n), order(n), part(list, list + n);
+  std::vector<Index3i> local(n);
+  int i, j;
+
+  if (n == 0)
+    return;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < 3; j++)
+      ids[3*i+j] = faces[list[i]][j];
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  for (i = 0; i < n; i++)
+    for (j = 0; j < 3; j++)
+      local[i][j] = std::lower_bound(ids.begin(), ids.end(), faces[list[i]][j]) - ids.begin();
+
+  optimizeVertexCache(&local[0], n, (int)ids.size(), &order[0]);
+  for (i = 0; i < n; i++)
+    list[i] = part[order[i]];
+}
+
+
+void optimizeVertexFetch(const Index3i *faces, int nf, int nv, int *remap)
+{
+  int next = 0;
+
+  for (int v = 0; v < nv; v++)
+    remap[v] = -1;
+  for (int i = 0; i < nf; i++)
+    for (int j = 0; j < 3; j++)
+      if (remap[faces[i][j]] < 0)
+        remap[faces[i][j]] = next++;
+  for (int v = 0; v < nv; v++)
+    if (remap[v] < 0)
+      remap[v] = next++;
+}
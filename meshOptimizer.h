@@ -0,0 +1,35 @@
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+/* File: meshOptimizer
+ * Description:
+ *   Triangle and vertex reordering for the post-transform vertex cache
+ *   and for sequential vertex fetches
+ */
+
+typedef int Index3i[3];
+
+#define VCACHE_FIFO 16		// entries of the FIFO cache ACMR is measured with
+#define VCACHE_LRU 32		// entries of the LRU cache the reordering models
+
+
+// Average cache miss ratio: vertices transformed per triangle when the
+// faces are drawn in order through a FIFO cache of VCACHE_FIFO entries.
+// 3 is the worst, about 0.5 the best reachable on a closed mesh.
+float vertexCacheACMR(const Index3i *faces, int nf, int nv);
+
+// Reorder the faces for the vertex cache with Tom Forsyth's linear-speed
+// algorithm. order receives the new face order, order[k] being the old
+// index of the k-th face; faces itself is not changed.
+void optimizeVertexCache(const Index3i *faces, int nf, int nv, int *order);
+
+// The same for the part of a larger mesh made of the faces list[0] to
+// list[n-1], reordering list in place. The part numbers its vertices
+// anew, so the cost depends on n and not on the size of the mesh.
+void optimizePartVertexCache(const Index3i *faces, int *list, int n);
+
+// Number the vertices in the order the faces first use them. remap[v]
+// is the new index of old vertex v; unused vertices go to the end.
+void optimizeVertexFetch(const Index3i *faces, int nf, int nv, int *remap);
+
+#endif
@@ -0,0 +1,285 @@
+/* File: occlusion
+ * Description:
+ *   Every vertex sends one packet of OCCLUSION_RAYS rays from just
+ *   off its surface. The directions are cosine distributed: their
+ *   radii in the tangent plane are stratified and their angles follow a
+ *   golden angle spiral, turned by a different angle for every vertex
+ *   so that neighbors do not share the same gaps. The part of the rays
+ *   that get away is then the cosine weighted openness of the
+ *   hemisphere, the way the ambient light would reach a diffuse surface.
+ *
+ *   The normals of a mesh may point inside, as those of the bunny do,
+ *   so the hemisphere is taken around the side the signed volume of
+ *   the mesh says is outside. Inverting the normals also turns the
+ *   faces, which keeps that side and the occlusion as they are.
+ *
+ *   Baked occlusion only depends on the mesh, and the cache is named
+ *   after the hash of the vertices and faces: any copy of the same mesh
+ *   finds it, and a changed mesh gets a bake of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "occlusion.h"
+#include "PLY.h"
+#include "threadPool.h"
+#include "profiler.h"
+
+
+struct OcclusionHeader {
+  char magic[8];		// "PLYOCCL"
+  int version;			// OCCLUSION_VERSION
+  int byteOrder;		// 1, written in host byte order
+  unsigned long long hash;	// meshHash() of the mesh baked
+  int nv;
+  int rays;			// OCCLUSION_RAYS
+  float radius;			// OCCLUSION_RADIUS
+  int reserved;
+};
+
+
+unsigned long long meshHash(const Vector3f *vertices, int nv, const Index3i *faces, int nf)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  const unsigned char *p;
+  size_t i, n;
+
+  p = (const unsigned char*)vertices;
+  for (i = 0, n = nv * sizeof(Vector3f); i < n; i++)
+    h = (h ^ p[i]) * 1099511628211ULL;
+  p = (const unsigned char*)faces;
+  for (i = 0, n = nf * sizeof(Index3i); i < n; i++)
+    h = (h ^ p[i]) * 1099511628211ULL;
+  return h;
+}
+
+
+float outsideSign(const Vector3f *vertices, const Index3i *faces, int nf)
+{
+  double volume = 0.0;
+
+  // six times the signed volume, positive if the faces turn
+  // counterclockwise around the outward normal
+  for (int f = 0; f < nf; f++) {
+    Vector3f n;
+    vecProd(n, vertices[faces[f][1]], vertices[faces[f][2]]);
+    volume += dotProd(vertices[faces[f][0]], n);
+  }
+  return volume < 0.0 ? -1.0f : 1.0f;
+}
+
+
+void traceOcclusion(const BVH &bvh, const Vector3f *vertices, const Vector3f *normals,
+                    const Index3i *faces, float outside, float *occlusion, int begin, int end)
+{
+  BVHPacket pk;
+  float size = 0.0f;
+
+  if (bvh.nodes.empty()) {
+    for (int i = begin; i < end; i++)
+      occlusion[i] = 1.0f;
+    return;
+  }
+  for (int a = 0; a < 3; a++)
+    size = std::max(size, bvh.nodes[0].max[a] - bvh.nodes[0].min[a]);
+  float bias = size * BVH_SHADOW_BIAS, reach = size * OCCLUSION_RADIUS;
+
+  for (int i = begin; i < end; i++) {
+    Vector3f N, T, B, o;
+
+    scale(N, outside, normals[i]);
+    if (!(dotProd(N, N) > 0.0f)) {
+      occlusion[i] = 1.0f;
+      continue;
+    }
+
+    // tangents T and B around N, continuous but for the sign of N[2]
+    float sign = N[2] < 0.0f ? -1.0f : 1.0f;
+    float a = -1.0f / (sign + N[2]), b = N[0] * N[1] * a;
+    T[0] = 1.0f + sign * N[0] * N[0] * a;
+    T[1] = sign * b;
+    T[2] = -sign * N[0];
+    B[0] = b;
+    B[1] = sign + N[1] * N[1] * a;
+    B[2] = -N[1];
+
+    for (int k = 0; k < 3; k++)
+      o[k] = vertices[i][k] + bias * N[k];
+    float turn = (float)(2.0 * M_PI * fmod(i * 0.6180339887498949, 1.0));
+
+    clearPacket(pk);
+    for (int r = 0; r < OCCLUSION_RAYS; r++) {
+      float u = (r + 0.5f) / OCCLUSION_RAYS;
+      float radius = sqrtf(u), height = sqrtf(1.0f - u);
+      float angle = r * 2.3999632f + turn;
+      float x = radius * cosf(angle), y = radius * sinf(angle);
+      Vector3f d;
+
+      for (int k = 0; k < 3; k++)
+        d[k] = reach * (x * T[k] + y * B[k] + height * N[k]);
+      addRay(pk, o, d);
+    }
+
+    int blocked = 0;
+    for (unsigned int hits = bvh.occluded(vertices, faces, pk); hits; hits &= hits - 1)
+      blocked++;
+    occlusion[i] = 1.0f - (float)blocked / OCCLUSION_RAYS;
+  }
+}
+
+
+//##########################################
+// Cache files
+
+void occlusionCacheName(char *name, size_t size, const char *filename, unsigned long long hash)
+{
+  const char *slash = strrchr(filename, '/'), *backslash = strrchr(filename, '\\');
+  int dir;
+
+  if (backslash > slash)
+    slash = backslash;
+  dir = slash ? (int)(slash - filename) + 1 : 0;
+  snprintf(name, size, "%.*socclusion-%016llx.cache", dir, filename, hash);
+}
+
+
+// load the occlusion of the mesh with this hash from name, if it holds it
+bool readOcclusion(const char *name, unsigned long long hash, int nv, float *occlusion)
+{
+  OcclusionHeader h;
+  FILE *in;
+  bool ok;
+
+  if (!(in = fopen(name, "rb")))
+    return false;
+  ok = fread(&h, sizeof(h), 1, in) == 1 && memcmp(h.magic, "PLYOCCL", 8) == 0 &&
+    h.version == OCCLUSION_VERSION && h.byteOrder == 1 && h.hash == hash && h.nv == nv &&
+    h.rays == OCCLUSION_RAYS && h.radius == (float)OCCLUSION_RADIUS &&
+    fread(occlusion, sizeof(float), nv, in) == (size_t)nv;
+  fclose(in);
+  return ok;
+}
+
+
+bool writeOcclusion(const char *name, unsigned long long hash, int nv, const float *occlusion)
+{
+  char tmpname[1040];
+  OcclusionHeader h;
+  FILE *out;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "PLYOCCL", 8);
+  h.version = OCCLUSION_VERSION;
+  h.byteOrder = 1;
+  h.hash = hash;
+  h.nv = nv;
+  h.rays = OCCLUSION_RAYS;
+  h.radius = OCCLUSION_RADIUS;
+
+  // write next to the final name and rename, readers never see half a file
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", name);
+  if (!(out = fopen(tmpname, "wb"))) {
+    fprintf(stderr, "Warning: cannot write occlusion cache %s.\n", tmpname);
+    return false;
+  }
+  bool ok = fwrite(&h, sizeof(h), 1, out) == 1 &&
+    fwrite(occlusion, sizeof(float), nv, out) == (size_t)nv;
+  ok = (fclose(out) == 0) && ok;
+
+  remove(name);
+  if (!ok || rename(tmpname, name) != 0) {
+    fprintf(stderr, "Warning: cannot write occlusion cache %s.\n", name);
+    remove(tmpname);
+    return false;
+  }
+  return true;
+}
+
+
+//##########################################
+// Background bake
+
+OcclusionBake::OcclusionBake(const PLYObject *ply, const char *cacheName, unsigned long long hash)
+  : nv(ply->nv), nf(ply->nf), bvh(*ply->bvh), hash(hash), done(0), complete(false), cancel(false)
+{
+  snprintf(this->cacheName, sizeof(this->cacheName), "%s", cacheName);
+  vertices = (Vector3f*)malloc(nv * sizeof(Vector3f));
+  normals = (Vector3f*)malloc(nv * sizeof(Vector3f));
+  faces = (Index3i*)malloc(nf * sizeof(Index3i));
+  occlusion = (float*)malloc(nv * sizeof(float));
+  if (!vertices || !normals || !faces || !occlusion) {
+    fprintf(stderr, "Error: no memory to bake the occlusion of %d vertices.\n", nv);
+    free(occlusion);
+    occlusion = NULL;
+    complete = true;
+    return;
+  }
+  memcpy(vertices, ply->vertices, nv * sizeof(Vector3f));
+  memcpy(normals, ply->normals, nv * sizeof(Vector3f));
+  memcpy(faces, ply->faces, nf * sizeof(Index3i));
+
+  worker = std::thread(&OcclusionBake::run, this);
+}
+
+
+OcclusionBake::~OcclusionBake()
+{
+  cancel = true;
+  if (worker.joinable())
+    worker.join();
+  free(vertices);
+  free(normals);
+  free(faces);
+  free(occlusion);
+}
+
+
+float OcclusionBake::progress() const
+{
+  return nv > 0 ? (float)done / nv : 1.0f;
+}
+
+
+bool OcclusionBake::finished() const
+{
+  return complete;
+}
+
+
+float *OcclusionBake::take()
+{
+  float *result = NULL;
+
+  if (complete)
+    std::swap(result, occlusion);
+  return result;
+}
+
+
+void OcclusionBake::run()
+{
+  PROFILE_SCOPE("bake occlusion");
+  ThreadPool pool;
+  float outside = outsideSign(vertices, faces, nf);
+
+  pool.parallelFor(0, nv, OCCLUSION_GRAIN, [&](int begin, int end) {
+    if (cancel)
+      return;
+    traceOcclusion(bvh, vertices, normals, faces, outside, occlusion, begin, end);
+    done += end - begin;
+  });
+
+  if (!cancel)
+    writeOcclusion(cacheName, hash, nv, occlusion);
+  // the copies are no longer needed
+  free(vertices);
+  free(normals);
+  free(faces);
+  vertices = normals = NULL;
+  faces = NULL;
+  complete = true;
+}
@@ -0,0 +1,81 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+/* File: occlusion
+ * Description:
+ *   Per vertex ambient occlusion, baked by casting rays over the
+ *   hemisphere outside each vertex through the hierarchy of the mesh,
+ *   on a background thread, and cached on disk under a hash of the mesh
+ */
+
+#include <atomic>
+#include <thread>
+
+#include "geometry.h"
+#include "bvh.h"
+
+class PLYObject;
+
+#define OCCLUSION_VERSION 1
+#define OCCLUSION_RAYS BVH_PACKET	// rays per vertex, traced as one packet
+#define OCCLUSION_RADIUS 0.25		// rays reach this part of the mesh size
+#define OCCLUSION_GRAIN 256		// vertices per task, the steps of the progress
+
+
+// 64-bit FNV-1a hash of the vertex positions and the faces
+unsigned long long meshHash(const Vector3f *vertices, int nv, const Index3i *faces, int nf);
+
+// 1 if the faces wind counterclockwise seen from outside, so that the
+// normals point out, -1 if they wind the other way
+float outsideSign(const Vector3f *vertices, const Index3i *faces, int nf);
+
+// Set occlusion[i] for the vertices [begin, end) to the part of
+// OCCLUSION_RAYS cosine distributed rays over the hemisphere around
+// outside * normals[i] that leave without hitting a face within
+// OCCLUSION_RADIUS of the mesh size: 0 enclosed to 1 open.
+void traceOcclusion(const BVH &bvh, const Vector3f *vertices, const Vector3f *normals,
+                    const Index3i *faces, float outside, float *occlusion, int begin, int end);
+
+// The cache file of the mesh with the given hash, next to filename
+void occlusionCacheName(char *name, size_t size, const char *filename, unsigned long long hash);
+bool readOcclusion(const char *name, unsigned long long hash, int nv, float *occlusion);
+bool writeOcclusion(const char *name, unsigned long long hash, int nv, const float *occlusion);
+
+
+// A bake of the occlusion of a mesh. It copies the mesh and its
+// hierarchy, so the mesh may change or go away meanwhile, and traces
+// them on a thread of its own with a thread pool of its own, writing
+// the cache file when done.
+class OcclusionBake {
+public:
+
+  // ply needs its hierarchy fitted to the current vertices
+  OcclusionBake(const PLYObject *ply, const char *cacheName, unsigned long long hash);
+  // stops a bake still running, the result is lost
+  ~OcclusionBake();
+
+  float progress() const;	// part of the vertices done
+  bool finished() const;
+
+  // Hand over the result, which the caller frees; NULL before
+  // finished() or if the bake could not run
+  float *take();
+
+private:
+
+  void run();
+
+  int nv, nf;
+  Vector3f *vertices, *normals;
+  Index3i *faces;
+  BVH bvh;
+  char cacheName[1024];
+  unsigned long long hash;
+  float *occlusion;
+
+  std::thread worker;
+  std::atomic<int> done;	// vertices traced
+  std::atomic<bool> complete, cancel;
+};
+
+#endif
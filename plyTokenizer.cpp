@@ -0,0 +1,93 @@
+/* File: plyTokenizer
+ * Description:
+ *   Locale independent number parsing for the body of ASCII PLY files.
+ *   std::from_chars rounds correctly, like strtof, so the floats are
+ *   bit-identical to those sscanf produced.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <charconv>
+
+#include "plyTokenizer.h"
+
+
+void initTokenizer(PLYTokenizer &t, const char *begin, const char *end, int line)
+{
+  t.p = t.lineStart = begin;
+  t.end = end;
+  t.line = line;
+}
+
+
+// move to the first character of the next token on this line
+static inline const char *skipBlanks(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    p++;
+  if (p < end && *p == '+')
+    p++;
+  return p;
+}
+
+
+bool parseFloat(PLYTokenizer &t, float &v)
+{
+  const char *p = skipBlanks(t.p, t.end);
+
+#if defined(__cpp_lib_to_chars)
+  std::from_chars_result r = std::from_chars(p, t.end, v);
+  if (r.ec != std::errc() || r.ptr == p)
+    return false;
+  t.p = r.ptr;
+#else
+  // no floating point from_chars, go through a copy of the token
+  char buf[64], *last;
+  int n = 0;
+
+  while (p + n < t.end && n < 63 && !strchr(" \t\r\n", p[n]))
+    n++;
+  memcpy(buf, p, n);
+  buf[n] = '\0';
+  v = strtof(buf, &last);
+  if (last == buf)
+    return false;
+  t.p = p + (last - buf);
+#endif
+  return true;
+}
+
+
+bool parseInt(PLYTokenizer &t, int &v)
+{
+  const char *p = skipBlanks(t.p, t.end);
+  std::from_chars_result r = std::from_chars(p, t.end, v);
+
+  if (r.ec != std::errc() || r.ptr == p)
+    return false;
+  t.p = r.ptr;
+  return true;
+}
+
+
+void nextLine(PLYTokenizer &t)
+{
+  const char *eol = (const char*)memchr(t.p, '\n', t.end - t.p);
+
+  t.p = t.lineStart = eol ? eol + 1 : t.end;
+  t.line++;
+}
+
+
+void tokenError(const PLYTokenizer &t, const char *expected)
+{
+  const char *p = skipBlanks(t.p, t.end);
+  int n = 0;
+
+  while (p + n < t.end && n < 20 && p[n] != '\n' && p[n] != '\r')
+    n++;
+  fprintf(stderr, "Error: line %d, column %d: %s expected, found \"%.*s\".\n",
+          t.line, (int)(p - t.lineStart) + 1, expected, n, p);
+  exit(1);
+}
@@ -0,0 +1,30 @@
+#ifndef PLYTOKENIZER_H
+#define PLYTOKENIZER_H
+
+/* File: plyTokenizer
+ * Description:
+ *   Locale independent number parsing for the body of ASCII PLY files
+ */
+
+
+struct PLYTokenizer {
+  const char *p, *end;		// current position and end of the input
+  const char *lineStart;	// first character of the current line
+  int line;			// number of the current line, counting from 1
+};
+
+
+void initTokenizer(PLYTokenizer &t, const char *begin, const char *end, int line);
+
+// Parse the next number on the current line. Return false, without
+// moving, if the line holds no further number.
+bool parseFloat(PLYTokenizer &t, float &v);
+bool parseInt(PLYTokenizer &t, int &v);
+
+// skip the rest of the current line
+void nextLine(PLYTokenizer &t);
+
+// report a malformed line with its line and column and exit
+void tokenError(const PLYTokenizer &t, const char *expected);
+
+#endif
@@ -0,0 +1,227 @@
+/* File: profiler
+ * Description:
+ *   Every thread that records gets a ring of PROFILE_RING events on its
+ *   first event, one a finished thread gave back or a new one in the
+ *   next slot of the ring table. After that recording is two clock
+ *   reads, a store and a release of the ring's head, without locks. A
+ *   ring given back keeps its events, and the next thread that takes it
+ *   appends to them, so a slot is a track that short lived threads
+ *   (bakes, pool workers after a resize) share. Readers copy the events
+ *   behind the head and drop those the writer may have overwritten
+ *   while they copied, so a summary or an export can run next to the
+ *   recording threads.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "profiler.h"
+
+
+struct ProfileRing {
+  ProfileEvent events[PROFILE_RING];
+  std::atomic<unsigned long long> head;	// events written so far
+};
+
+static std::atomic<ProfileRing*> rings[PROFILE_MAX_THREADS];
+static std::atomic<int> nrings(0);
+
+// rings of finished threads, taken before a new slot is claimed
+static std::mutex freeLock;
+static std::vector<ProfileRing*> freeRings;
+
+// The ring of the calling thread, given back when the thread ends
+struct ProfileHolder {
+  ProfileRing *ring;
+  bool noRing;		// all slots taken, the thread does not record
+
+  ~ProfileHolder() {
+    if (ring) {
+      std::lock_guard<std::mutex> lock(freeLock);
+      freeRings.push_back(ring);
+    }
+  }
+};
+
+static thread_local ProfileHolder holder;
+static thread_local long long lastFrame;	// end of the last frame, 0 before the first
+
+static const char frameName[] = "frame";
+
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+
+long long profileNow()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+
+void profileRecord(const char *name, long long begin, long long end)
+{
+  ProfileHolder &mine = holder;
+  ProfileRing *ring = mine.ring;
+
+  if (!ring) {
+    if (mine.noRing)
+      return;
+    {
+      std::lock_guard<std::mutex> lock(freeLock);
+      if (!freeRings.empty()) {
+        ring = freeRings.back();
+        freeRings.pop_back();
+      }
+    }
+    if (!ring) {
+      int slot = nrings.fetch_add(1);
+      if (slot >= PROFILE_MAX_THREADS) {
+        mine.noRing = true;
+        return;
+      }
+      ring = new ProfileRing;
+      ring->head.store(0, std::memory_order_relaxed);
+      rings[slot].store(ring, std::memory_order_release);
+    }
+    mine.ring = ring;
+  }
+
+  unsigned long long h = ring->head.load(std::memory_order_relaxed);
+  ProfileEvent &e = ring->events[h & (PROFILE_RING - 1)];
+  e.name = name;
+  e.begin = begin;
+  e.end = end;
+  ring->head.store(h + 1, std::memory_order_release);
+}
+
+
+void profileFrame()
+{
+  long long now = profileNow();
+
+  if (lastFrame > 0)
+    profileRecord(frameName, lastFrame, now);
+  lastFrame = now;
+}
+
+
+// the events of ring r still intact, oldest first
+static void copyEvents(int r, std::vector<ProfileEvent> &out)
+{
+  ProfileRing *p = rings[r].load(std::memory_order_acquire);
+  unsigned long long head, first, h;
+
+  out.clear();
+  if (!p)
+    return;
+
+  head = p->head.load(std::memory_order_acquire);
+  first = head > PROFILE_RING ? head - PROFILE_RING : 0;
+  for (h = first; h < head; h++)
+    out.push_back(p->events[h & (PROFILE_RING - 1)]);
+
+  // events the writer got around to again while they were copied
+  std::atomic_thread_fence(std::memory_order_acquire);
+  head = p->head.load(std::memory_order_relaxed);
+  if (head > PROFILE_RING && head - PROFILE_RING > first) {
+    unsigned long long lost = head - PROFILE_RING - first;
+    out.erase(out.begin(), out.begin() + (lost < out.size() ? lost : out.size()));
+  }
+}
+
+
+static int threadCount()
+{
+  int n = nrings.load();
+
+  return n < PROFILE_MAX_THREADS ? n : PROFILE_MAX_THREADS;
+}
+
+
+int profileSummary(double seconds, ProfileStage *stages, int max, double &fps)
+{
+  long long now = profileNow(), cutoff = now - (long long)(seconds * 1e9);
+  long long firstFrame = now, lastEnd = 0;
+  std::vector<ProfileEvent> events;
+  int nframes = 0, nstages = 0;
+
+  fps = 0.0;
+  for (int r = 0; r < threadCount(); r++) {
+    copyEvents(r, events);
+    for (size_t i = 0; i < events.size(); i++) {
+      const ProfileEvent &e = events[i];
+      int s;
+
+      if (e.end < cutoff)
+        continue;
+      if (e.name == frameName) {
+        nframes++;
+        if (e.begin < firstFrame)
+          firstFrame = e.begin;
+        if (e.end > lastEnd)
+          lastEnd = e.end;
+        continue;
+      }
+
+      for (s = 0; s < nstages && strcmp(stages[s].name, e.name); s++)
+        ;
+      if (s == nstages) {
+        if (nstages == max)
+          continue;
+        stages[s].name = e.name;
+        stages[s].ms = 0.0;
+        stages[s].count = 0;
+        nstages++;
+      }
+      stages[s].ms += (e.end - e.begin) * 1e-6;
+      stages[s].count++;
+    }
+  }
+
+  if (nframes == 0)
+    return 0;
+  for (int s = 0; s < nstages; s++) {
+    stages[s].ms /= nframes;
+    stages[s].count = (stages[s].count + nframes - 1) / nframes;
+  }
+  if (lastEnd > firstFrame)
+    fps = nframes * 1e9 / (lastEnd - firstFrame);
+  return nstages;
+}
+
+
+bool profileWriteTrace(const char *filename)
+{
+  FILE *out = fopen(filename, "w");
+  std::vector<ProfileEvent> events;
+  const char *separator = "";
+
+  if (!out) {
+    fprintf(stderr, "Error: could not write %s.\n", filename);
+    return false;
+  }
+
+  // complete events, times in microseconds, one track per thread
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (int r = 0; r < threadCount(); r++) {
+    fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"name\": \"%s %d\"}}", separator, r, r == 0 ? "main" : "thread", r);
+    separator = ",\n";
+
+    copyEvents(r, events);
+    for (size_t i = 0; i < events.size(); i++)
+      fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+              events[i].name, r, events[i].begin * 1e-3, (events[i].end - events[i].begin) * 1e-3);
+  }
+  fprintf(out, "\n]}\n");
+
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Error: could not write %s.\n", filename);
+    return false;
+  }
+  printf("wrote trace of %d threads to %s\n", threadCount(), filename);
+  return true;
+}
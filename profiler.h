@@ -0,0 +1,71 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+/* File: profiler
+ * Description:
+ *   Scoped timing of the frame and loading stages into per-thread ring
+ *   buffers, with a rolling summary and Chrome trace export
+ */
+
+#define PROFILE_RING 16384		// events kept per thread, a power of 2
+#define PROFILE_MAX_THREADS 64		// threads that can record at once
+#define PROFILE_MAX_STAGES 32		// distinct names in a summary
+
+
+// One timed stage, in nanoseconds since the program started. name has to
+// stay valid for the life of the program, a string literal.
+struct ProfileEvent {
+  const char *name;
+  long long begin, end;
+};
+
+
+// time of one stage per frame, averaged over the frames of the summary
+struct ProfileStage {
+  const char *name;
+  double ms;			// summed over all threads
+  int count;			// events per frame
+};
+
+
+// nanoseconds since the program started
+long long profileNow();
+
+// Append an event to the ring of the calling thread. Only that thread
+// writes its ring, so recording takes no lock; the oldest events are
+// overwritten once PROFILE_RING are kept. The ring goes back to be
+// reused, events and all, when the thread ends.
+void profileRecord(const char *name, long long begin, long long end);
+
+// Mark the end of a frame, recorded as the stage "frame" from the end of
+// the previous one. The first call only starts the first frame.
+void profileFrame();
+
+// Average the stages of the frames that ended within the last seconds
+// into stages (room for max), in the order they were first seen. The
+// frame rate goes to fps. Return the number of stages.
+int profileSummary(double seconds, ProfileStage *stages, int max, double &fps);
+
+// Write the kept events of all threads as Chrome trace events, to be
+// opened in chrome://tracing or Perfetto. Return false if the file
+// cannot be written.
+bool profileWriteTrace(const char *filename);
+
+
+// Times its own lifetime:
+//   { PROFILE_SCOPE("resize"); ... }
+class ProfileScope {
+public:
+  ProfileScope(const char *name) : name(name), begin(profileNow()) {}
+  ~ProfileScope() { profileRecord(name, begin, profileNow()); }
+
+private:
+  const char *name;
+  long long begin;
+};
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+
+#endif
@@ -0,0 +1,522 @@
+/* File: rasterizer
+ * Description:
+ *   Software rasterizer drawing PLY objects into an in-memory color and
+ *   depth buffer, for rendering without a window or a GPU.
+ *
+ *   A frame is drawn in three parallel passes: the vertices are
+ *   transformed to window coordinates, the triangles are sorted into
+ *   the tiles their bounding box touches, and every tile is then
+ *   cleared and filled by one thread. Vertices are snapped to a fixed
+ *   subpixel grid and the edge functions evaluated in integers, so
+ *   faces sharing an edge neither overlap nor leave gaps.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+
+#include "rasterizer.h"
+#include "PLY.h"
+#include "bvh.h"
+#include "threadPool.h"
+#include "simd.h"
+#include "image.h"
+#include "profiler.h"
+
+// vertices farther out than this many pixels are not drawn, which keeps
+// the integer edge functions from overflowing
+#define GUARD_BAND 8388608.0f
+
+
+void userViewMatrix(Matrix4f m, float angle, float angle2, const float *pos)
+{
+  float a = angle * M_PI / 180.0, b = angle2 * M_PI / 180.0;
+  Matrix4f t, rx, ry, trx;
+
+  // glTranslatef(-pos[0], pos[1], -pos[2])
+  emptyMatrix(t);
+  t[0][0] = t[1][1] = t[2][2] = t[3][3] = 1.0;
+  t[0][3] = -pos[0];
+  t[1][3] = pos[1];
+  t[2][3] = -pos[2];
+
+  // glRotatef(angle2, 1, 0, 0)
+  emptyMatrix(rx);
+  rx[0][0] = rx[3][3] = 1.0;
+  rx[1][1] = rx[2][2] = cos(b);
+  rx[1][2] = -sin(b);
+  rx[2][1] = sin(b);
+
+  // glRotatef(angle, 0, 1, 0)
+  emptyMatrix(ry);
+  ry[1][1] = ry[3][3] = 1.0;
+  ry[0][0] = ry[2][2] = cos(a);
+  ry[0][2] = sin(a);
+  ry[2][0] = -sin(a);
+
+  multMatrix(trx, t, rx);
+  multMatrix(m, trx, ry);
+}
+
+
+void perspectiveMatrix(Matrix4f m, const perspectiveData &pD)
+{
+  float f = 1.0 / tan(pD.fieldOfView * M_PI / 360.0);
+
+  emptyMatrix(m);
+  m[0][0] = f / pD.aspect;
+  m[1][1] = f;
+  m[2][2] = (pD.farPlane + pD.nearPlane) / (pD.nearPlane - pD.farPlane);
+  m[2][3] = 2.0 * pD.farPlane * pD.nearPlane / (pD.nearPlane - pD.farPlane);
+  m[3][2] = -1.0;
+}
+
+
+Rasterizer::Rasterizer(int width, int height)
+{
+  this->width = width;
+  this->height = height;
+  ntx = (width + RASTER_TILE - 1) / RASTER_TILE;
+  nty = (height + RASTER_TILE - 1) / RASTER_TILE;
+
+  color = (unsigned char*)simdAlloc((size_t)width * height * 3);
+  depth = (float*)simdAlloc((size_t)width * height * sizeof(float));
+
+  // white, like the window of main.cpp
+  for (int i = 0; i < 4; i++)
+    clearColor[i] = 1.0;
+
+  sx = sy = NULL;
+  sz = sq = NULL;
+  capacity = 0;
+
+  binCount = NULL;
+  binStart = (int*)malloc((ntx * nty + 1) * sizeof(int));
+  binned = NULL;
+  binSlices = binCapacity = 0;
+
+  initShadingStreams(gbuffer);
+  fragColors = NULL;
+  fragPixels = NULL;
+  fragVisible = NULL;
+  fragOcclusion = NULL;
+  shadowsValid = false;
+}
+
+
+Rasterizer::~Rasterizer()
+{
+  simdFree(color);
+  simdFree(depth);
+  simdFree(sx);
+  simdFree(sy);
+  simdFree(sz);
+  simdFree(sq);
+  free(binCount);
+  free(binStart);
+  free(binned);
+  freeShadingStreams(gbuffer);
+  simdFree(fragColors);
+  free(fragPixels);
+  free(fragVisible);
+  free(fragOcclusion);
+}
+
+
+bool Rasterizer::writeImage(const char *filename)
+{
+  return ::writeImage(filename, color, width, height);
+}
+
+
+void Rasterizer::transformVertices(PLYObject *ply, const Matrix4f mvp, int begin, int end)
+{
+  float scale = 0.5 * RASTER_SUBPIXELS;
+
+  for (int i = begin; i < end; i++) {
+    const float *v = ply->vertices[i];
+    float c[4];
+
+    for (int j = 0; j < 4; j++)
+      c[j] = mvp[j][0]*v[0] + mvp[j][1]*v[1] + mvp[j][2]*v[2] + mvp[j][3];
+
+    // Triangles reaching in front of the near plane are left out
+    // rather than clipped; the turntable views never come that close.
+    if (c[3] <= 0.0 || c[2] < -c[3]) {
+      sq[i] = 0.0;
+      continue;
+    }
+
+    float q = 1.0 / c[3];
+    float x = (c[0] * q + 1.0) * width * scale;
+    float y = (1.0 - c[1] * q) * height * scale;	// rows go down
+    if (fabs(x) > GUARD_BAND || fabs(y) > GUARD_BAND) {
+      sq[i] = 0.0;
+      continue;
+    }
+    sx[i] = (int)lrintf(x);
+    sy[i] = (int)lrintf(y);
+    sz[i] = (c[2] * q + 1.0) * 0.5;
+    sq[i] = q;
+  }
+}
+
+
+// first pixel whose center lies at or after the fixed point coordinate v
+static inline int firstPixel(int v)
+{
+  return (int)ceil((v - RASTER_SUBPIXELS/2) / (double)RASTER_SUBPIXELS);
+}
+
+
+// last pixel whose center lies at or before v
+static inline int lastPixel(int v)
+{
+  return (int)floor((v - RASTER_SUBPIXELS/2) / (double)RASTER_SUBPIXELS);
+}
+
+
+// Pixel bounding box [box[0], box[2]] x [box[1], box[3]] of face f on
+// screen, false if the face covers no pixel
+bool Rasterizer::setupTriangle(PLYObject *ply, int f, int box[4])
+{
+  const int *v = ply->faces[f];
+
+  if (sq[v[0]] == 0.0 || sq[v[1]] == 0.0 || sq[v[2]] == 0.0)
+    return false;
+
+  long long area = (long long)(sx[v[1]] - sx[v[0]]) * (sy[v[2]] - sy[v[0]]) -
+                   (long long)(sx[v[2]] - sx[v[0]]) * (sy[v[1]] - sy[v[0]]);
+  if (area == 0)
+    return false;
+
+  int x0 = sx[v[0]], x1 = x0, y0 = sy[v[0]], y1 = y0;
+  for (int k = 1; k < 3; k++) {
+    if (sx[v[k]] < x0) x0 = sx[v[k]];
+    if (sx[v[k]] > x1) x1 = sx[v[k]];
+    if (sy[v[k]] < y0) y0 = sy[v[k]];
+    if (sy[v[k]] > y1) y1 = sy[v[k]];
+  }
+  box[0] = firstPixel(x0);
+  box[1] = firstPixel(y0);
+  box[2] = lastPixel(x1);
+  box[3] = lastPixel(y1);
+  if (box[0] < 0) box[0] = 0;
+  if (box[1] < 0) box[1] = 0;
+  if (box[2] >= width) box[2] = width - 1;
+  if (box[3] >= height) box[3] = height - 1;
+
+  return box[0] <= box[2] && box[1] <= box[3];
+}
+
+
+void Rasterizer::binTriangles(PLYObject *ply, int nslices)
+{
+  int ntiles = ntx * nty;
+
+  if (nslices > binSlices) {
+    binCount = (int*)realloc(binCount, (size_t)nslices * ntiles * sizeof(int));
+    binSlices = nslices;
+  }
+
+  // Each slice of consecutive faces counts, and later stores, its own
+  // entries per tile. Laying the slices out one after the other keeps
+  // the faces of a tile in their original order, which decides between
+  // faces of equal depth.
+  auto slice = [&](int s, bool fill) {
+    int first = (int)((long long)s * ply->nf / nslices);
+    int last = (int)((long long)(s + 1) * ply->nf / nslices);
+    int *count = binCount + (size_t)s * ntiles;
+    int box[4];
+
+    if (!fill)
+      memset(count, 0, ntiles * sizeof(int));
+    for (int f = first; f < last; f++) {
+      if (!setupTriangle(ply, f, box))
+        continue;
+      for (int ty = box[1] / RASTER_TILE; ty <= box[3] / RASTER_TILE; ty++)
+        for (int tx = box[0] / RASTER_TILE; tx <= box[2] / RASTER_TILE; tx++) {
+          if (fill)
+            binned[count[ty * ntx + tx]++] = f;
+          else
+            count[ty * ntx + tx]++;
+        }
+    }
+  };
+
+  ply->pool->parallelFor(0, nslices, 1, [&](int s0, int s1) {
+    for (int s = s0; s < s1; s++)
+      slice(s, false);
+  });
+
+  // turn the counts into the position each slice writes to next
+  int total = 0;
+  for (int t = 0; t < ntiles; t++) {
+    binStart[t] = total;
+    for (int s = 0; s < nslices; s++) {
+      int n = binCount[(size_t)s * ntiles + t];
+      binCount[(size_t)s * ntiles + t] = total;
+      total += n;
+    }
+  }
+  binStart[ntiles] = total;
+
+  if (total > binCapacity) {
+    binned = (int*)realloc(binned, (size_t)total * sizeof(int));
+    binCapacity = total;
+  }
+
+  ply->pool->parallelFor(0, nslices, 1, [&](int s0, int s1) {
+    for (int s = s0; s < s1; s++)
+      slice(s, true);
+  });
+}
+
+
+// Fill tile t with the faces binned to it, either with their colors
+// or, if deferred, by storing their position, normal and, if the
+// G-buffer has a stream for it, occlusion in the G-buffer
+void Rasterizer::drawTile(PLYObject *ply, int t, bool deferred)
+{
+  int tx0 = (t % ntx) * RASTER_TILE, ty0 = (t / ntx) * RASTER_TILE;
+  int tx1 = tx0 + RASTER_TILE < width ? tx0 + RASTER_TILE : width;
+  int ty1 = ty0 + RASTER_TILE < height ? ty0 + RASTER_TILE : height;
+  unsigned char clear[3];
+
+  size_t base = (size_t)t * RASTER_TILE * RASTER_TILE;
+
+  for (int j = 0; j < 3; j++)
+    clear[j] = (unsigned char)(clearColor[j] * 255.0 + 0.5);
+  for (int y = ty0; y < ty1; y++)
+    for (int x = tx0; x < tx1; x++) {
+      size_t p = (size_t)y * width + x;
+      memcpy(color + 3 * p, clear, 3);
+      depth[p] = 1.0;
+    }
+
+  for (int n = binStart[t]; n < binStart[t+1]; n++) {
+    int f = binned[n];
+    const int *v = ply->faces[f];
+    int box[4];
+
+    setupTriangle(ply, f, box);
+    if (box[0] < tx0) box[0] = tx0;
+    if (box[1] < ty0) box[1] = ty0;
+    if (box[2] >= tx1) box[2] = tx1 - 1;
+    if (box[3] >= ty1) box[3] = ty1 - 1;
+
+    // Edge k runs between the two vertices other than k and is positive
+    // on the inside. A pixel center exactly on an edge belongs to the
+    // face on the side the edge normal (a, b) points to by this
+    // tie-break, so it is drawn by exactly one of the two faces.
+    long long area = (long long)(sx[v[1]] - sx[v[0]]) * (sy[v[2]] - sy[v[0]]) -
+                     (long long)(sx[v[2]] - sx[v[0]]) * (sy[v[1]] - sy[v[0]]);
+    int sign = area > 0 ? 1 : -1;
+    long long a[3], b[3], row[3];
+    bool inclusive[3];
+    int px = box[0] * RASTER_SUBPIXELS + RASTER_SUBPIXELS/2;
+    int py = box[1] * RASTER_SUBPIXELS + RASTER_SUBPIXELS/2;
+
+    for (int k = 0; k < 3; k++) {
+      int i = v[(k+1) % 3], j = v[(k+2) % 3];
+      a[k] = (long long)(sy[i] - sy[j]) * sign;
+      b[k] = (long long)(sx[j] - sx[i]) * sign;
+      row[k] = a[k] * (px - sx[i]) + b[k] * (py - sy[i]);
+      inclusive[k] = a[k] > 0 || (a[k] == 0 && b[k] > 0);
+    }
+
+    float inva = 1.0 / (float)(area * sign);
+    float z[3], q[3], c[3][3];
+    for (int k = 0; k < 3; k++) {
+      z[k] = sz[v[k]];
+      q[k] = sq[v[k]];
+      if (!deferred)
+        for (int j = 0; j < 3; j++)
+          c[k][j] = ply->colors[v[k]][j] * q[k];
+    }
+    const float *P0 = ply->vertices[v[0]], *P1 = ply->vertices[v[1]], *P2 = ply->vertices[v[2]];
+    const float *N0 = ply->normals[v[0]], *N1 = ply->normals[v[1]], *N2 = ply->normals[v[2]];
+    const float *O = ply->occlusion;
+
+    for (int y = box[1]; y <= box[3]; y++) {
+      long long e[3] = {row[0], row[1], row[2]};
+
+      for (int x = box[0]; x <= box[2]; x++) {
+        if ((e[0] > 0 || (e[0] == 0 && inclusive[0])) &&
+            (e[1] > 0 || (e[1] == 0 && inclusive[1])) &&
+            (e[2] > 0 || (e[2] == 0 && inclusive[2]))) {
+          float l0 = e[0] * inva, l1 = e[1] * inva, l2 = e[2] * inva;
+          float d = l0 * z[0] + l1 * z[1] + l2 * z[2];
+          size_t p = (size_t)y * width + x;
+
+          if (d < depth[p] && d <= 1.0) {
+            // attributes are interpolated perspective correct, as in GL
+            float w = 1.0 / (l0 * q[0] + l1 * q[1] + l2 * q[2]);
+            depth[p] = d;
+
+            if (deferred) {
+              float w0 = l0 * q[0] * w, w1 = l1 * q[1] * w, w2 = l2 * q[2] * w;
+              size_t g = base + (y - ty0) * RASTER_TILE + (x - tx0);
+
+              gbuffer.px[g] = w0 * P0[0] + w1 * P1[0] + w2 * P2[0];
+              gbuffer.py[g] = w0 * P0[1] + w1 * P1[1] + w2 * P2[1];
+              gbuffer.pz[g] = w0 * P0[2] + w1 * P1[2] + w2 * P2[2];
+              gbuffer.nx[g] = w0 * N0[0] + w1 * N1[0] + w2 * N2[0];
+              gbuffer.ny[g] = w0 * N0[1] + w1 * N1[1] + w2 * N2[1];
+              gbuffer.nz[g] = w0 * N0[2] + w1 * N1[2] + w2 * N2[2];
+              if (gbuffer.occlusion)
+                gbuffer.occlusion[g] = w0 * O[v[0]] + w1 * O[v[1]] + w2 * O[v[2]];
+            }
+            else
+              for (int j = 0; j < 3; j++) {
+                float s = (l0 * c[0][j] + l1 * c[1][j] + l2 * c[2][j]) * w + 0.5;
+                color[3*p + j] = s < 255.0 ? (unsigned char)s : 255;
+              }
+          }
+        }
+        for (int k = 0; k < 3; k++)
+          e[k] += a[k] * RASTER_SUBPIXELS;
+      }
+      for (int k = 0; k < 3; k++)
+        row[k] += b[k] * RASTER_SUBPIXELS;
+    }
+  }
+}
+
+
+// Light the covered pixels of tile t from the G-buffer. They are first
+// packed to the front of the tile's entries, with renormalized normals,
+// so the kernel runs over one contiguous range without gaps. Given an
+// object, their shadow rays are traced through its hierarchy first.
+void Rasterizer::shadeTile(const LightingContext &ctx, int t, const PLYObject *trace)
+{
+  int tx0 = (t % ntx) * RASTER_TILE, ty0 = (t / ntx) * RASTER_TILE;
+  int tx1 = tx0 + RASTER_TILE < width ? tx0 + RASTER_TILE : width;
+  int ty1 = ty0 + RASTER_TILE < height ? ty0 + RASTER_TILE : height;
+  int base = t * RASTER_TILE * RASTER_TILE, n = base;
+
+  for (int y = ty0; y < ty1; y++)
+    for (int x = tx0; x < tx1; x++) {
+      int p = y * width + x, g = base + (y - ty0) * RASTER_TILE + (x - tx0);
+      if (depth[p] >= 1.0)
+        continue;
+
+      Vector3f N = {gbuffer.nx[g], gbuffer.ny[g], gbuffer.nz[g]};
+      float l = sqrt(N[0]*N[0] + N[1]*N[1] + N[2]*N[2]);
+      if (l > 0.0)
+        l = 1.0 / l;
+
+      gbuffer.px[n] = gbuffer.px[g];
+      gbuffer.py[n] = gbuffer.py[g];
+      gbuffer.pz[n] = gbuffer.pz[g];
+      gbuffer.nx[n] = N[0] * l;
+      gbuffer.ny[n] = N[1] * l;
+      gbuffer.nz[n] = N[2] * l;
+      if (gbuffer.occlusion)
+        gbuffer.occlusion[n] = gbuffer.occlusion[g];
+      fragPixels[n++] = p;
+    }
+
+  if (trace)
+    trace->bvh->traceShadows(trace->vertices, trace->faces, gbuffer, shadowLight, fragVisible, base, n);
+  shadeStreams(ctx, gbuffer, fragColors, base, n);
+  for (int i = base; i < n; i++)
+    memcpy(color + 3 * (size_t)fragPixels[i], fragColors[i], 3);
+}
+
+
+static double millisecondsSince(std::chrono::steady_clock::time_point &start)
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  double ms = std::chrono::duration<double, std::milli>(now - start).count();
+
+  start = now;
+  return ms;
+}
+
+
+void Rasterizer::render(PLYObject *ply, const Matrix4f modelView, const Matrix4f projection,
+                        const LightingContext *perPixel)
+{
+  PROFILE_SCOPE("rasterize");
+  Matrix4f mvp;
+  int threads = ply->pool->size();
+  int ntiles = ntx * nty;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  multMatrix(mvp, projection, modelView);
+  ply->updateOcclusion();
+
+  if (ply->nv > capacity) {
+    simdFree(sx);
+    simdFree(sy);
+    simdFree(sz);
+    simdFree(sq);
+    sx = (int*)simdAlloc(ply->nv * sizeof(int));
+    sy = (int*)simdAlloc(ply->nv * sizeof(int));
+    sz = (float*)simdAlloc(ply->nv * sizeof(float));
+    sq = (float*)simdAlloc(ply->nv * sizeof(float));
+    capacity = ply->nv;
+  }
+
+  int grain = ply->nv / (4 * threads);
+  grain = grain < 1024 ? 1024 : grain;
+  ply->pool->parallelFor(0, ply->nv, grain, [&](int begin, int end) {
+    transformVertices(ply, mvp, begin, end);
+  });
+  times.transform = millisecondsSince(start);
+
+  binTriangles(ply, 4 * threads);
+  times.bin = millisecondsSince(start);
+
+  if (perPixel && !fragPixels) {
+    reserveShadingStreams(gbuffer, ntiles * RASTER_TILE * RASTER_TILE);
+    fragColors = (Color3u*)simdAlloc(gbuffer.capacity * sizeof(Color3u));
+    fragPixels = (int*)malloc(gbuffer.capacity * sizeof(int));
+  }
+  gbuffer.occlusion = NULL;
+  if (perPixel && perPixel->occlusion && ply->occlusion) {
+    if (!fragOcclusion)
+      fragOcclusion = (float*)malloc(gbuffer.capacity * sizeof(float));
+    gbuffer.occlusion = fragOcclusion;
+  }
+
+  // The same view of the same mesh fills the G-buffer the same way, so
+  // the shadow rays of the last frame still hold while the light stays
+  Vector3f light;
+  const PLYObject *trace = NULL;
+  gbuffer.visible = NULL;
+  if (perPixel && perPixel->shadows && ply->bvh && perPixel->nlights > 0 &&
+      objectSpaceLight(*perPixel, 0, light)) {
+    unsigned int stamps[3] = {ply->positionStamp, ply->normalStamp, ply->faceStamp};
+
+    if (!fragVisible)
+      fragVisible = (float*)malloc(gbuffer.capacity * sizeof(float));
+    if (!shadowsValid || shadowObject != ply || memcmp(mvp, shadowMVP, sizeof(Matrix4f)) != 0 ||
+        memcmp(light, shadowLight, sizeof(Vector3f)) != 0 || memcmp(stamps, shadowStamps, sizeof(stamps)) != 0) {
+      ply->refitBVH();
+      shadowObject = trace = ply;
+      memcpy(shadowMVP, mvp, sizeof(Matrix4f));
+      memcpy(shadowLight, light, sizeof(Vector3f));
+      memcpy(shadowStamps, stamps, sizeof(stamps));
+      shadowsValid = true;
+    }
+    gbuffer.visible = fragVisible;
+  }
+
+  ply->pool->parallelFor(0, ntiles, 1, [&](int t0, int t1) {
+    for (int t = t0; t < t1; t++)
+      drawTile(ply, t, perPixel != NULL);
+  });
+  times.raster = millisecondsSince(start);
+
+  times.shade = 0.0;
+  if (perPixel) {
+    ply->pool->parallelFor(0, ntiles, 1, [&](int t0, int t1) {
+      for (int t = t0; t < t1; t++)
+        shadeTile(*perPixel, t, trace);
+    });
+    times.shade = millisecondsSince(start);
+  }
+}
@@ -0,0 +1,101 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+/* File: rasterizer
+ * Description:
+ *   Software rasterizer drawing PLY objects into an in-memory color and
+ *   depth buffer, for rendering without a window or a GPU
+ */
+
+#include "geometry.h"
+#include "lighting.h"
+#include "viewModule.h"
+
+class PLYObject;
+
+#define RASTER_TILE 64		// tiles are RASTER_TILE x RASTER_TILE pixels
+#define RASTER_SUBPIXELS 16	// vertices snap to 1/16 of a pixel
+
+
+// the modelview matrix setUserView() loads for the given view parameters
+void userViewMatrix(Matrix4f m, float angle, float angle2, const float *pos);
+
+// the matrix gluPerspective() builds from pD
+void perspectiveMatrix(Matrix4f m, const perspectiveData &pD);
+
+
+// Draws the triangles of a PLYObject with its current vertex colors,
+// the way draw() shows them: depth tested, no culling, colors
+// interpolated across each face. The image is cut into tiles which
+// the threads of the object's pool fill independently, so the result
+// does not depend on the number of threads.
+//
+// Given a lighting context, render() shades every pixel instead
+// (deferred Phong shading): the faces only store their interpolated
+// object space position and normal in a G-buffer, which the vectorized
+// shadeStreams() kernel then lights tile by tile. The cost of the
+// lighting follows the number of covered pixels, not the vertices.
+// If the context casts shadows, every covered pixel also traces a
+// shadow ray to light 0 through the object's hierarchy; the results
+// are kept for the next frames until the view, the light or the mesh
+// changes. Baked ambient occlusion is interpolated like the normals.
+class Rasterizer {
+public:
+
+  Rasterizer(int width, int height);
+  ~Rasterizer();
+
+  // Clear to clearColor and draw ply as seen through projection *
+  // modelView, with the vertex colors or, if perPixel is given, lit per
+  // pixel. The time spent in each pass is left in times.
+  void render(PLYObject *ply, const Matrix4f modelView, const Matrix4f projection,
+              const LightingContext *perPixel = NULL);
+
+  bool writeImage(const char *filename);
+
+  int width, height;
+  unsigned char *color;		// RGB pixels, the top row first
+  float *depth;			// window depth of each pixel, 0 near, 1 far
+  Vector4f clearColor;
+
+  struct {
+    double transform, bin, raster, shade;	// milliseconds of the last frame, shade with the shadows
+  } times;
+
+private:
+
+  void transformVertices(PLYObject *ply, const Matrix4f mvp, int begin, int end);
+  bool setupTriangle(PLYObject *ply, int f, int box[4]);
+  void binTriangles(PLYObject *ply, int nslices);
+  void drawTile(PLYObject *ply, int t, bool deferred);
+  void shadeTile(const LightingContext &ctx, int t, const PLYObject *trace);
+
+  int ntx, nty;			// number of tiles across and down
+
+  int *sx, *sy;			// window x and y of the vertices in RASTER_SUBPIXELS
+  float *sz;			// window depth of the vertices
+  float *sq;			// 1/w of the vertices, 0 if they cannot be drawn
+  int capacity;			// vertices sx..sq have room for
+
+  int *binCount;		// triangles per slice and tile
+  int *binStart;		// first entry of each tile in binned
+  int *binned;			// triangle indices sorted by tile
+  int binSlices, binCapacity;
+
+  // G-buffer, each tile owns RASTER_TILE * RASTER_TILE consecutive
+  // entries starting at the tile number times that size
+  ShadingStreams gbuffer;
+  Color3u *fragColors;		// lit color of each G-buffer entry
+  int *fragPixels;		// pixel of each G-buffer entry after packing
+  float *fragOcclusion;		// interpolated ambient occlusion of each G-buffer entry
+
+  // visibility of light 0 of each G-buffer entry and what it was traced for
+  float *fragVisible;
+  bool shadowsValid;
+  const PLYObject *shadowObject;
+  Matrix4f shadowMVP;
+  Vector3f shadowLight;		// light 0 in object space
+  unsigned int shadowStamps[3];	// position, normal and face stamps of shadowObject
+};
+
+#endif
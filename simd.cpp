@@ -0,0 +1,99 @@
+/* File: simd
+ * Description:
+ *   Runtime selection of the vector instruction set and aligned
+ *   allocation for the vectorized kernels
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <malloc.h>
+#endif
+
+#include "simd.h"
+
+
+static int detectLevel()
+{
+#if defined(SIMD_X86) && defined(__GNUC__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return SIMD_SSE;
+#elif defined(SIMD_X86) && defined(_MSC_VER)
+  int info[4];
+
+  __cpuid(info, 0);
+  if (info[0] >= 7) {
+    __cpuidex(info, 7, 0);
+    if (info[1] & (1 << 5))
+      return SIMD_AVX2;
+  }
+  __cpuid(info, 1);
+  if (info[3] & (1 << 26))
+    return SIMD_SSE;
+#endif
+  return SIMD_SCALAR;
+}
+
+
+int simdLevel()
+{
+  static int level = -1;
+
+  if (level < 0) {
+    int supported = detectLevel();
+    const char *force = getenv("PHONG_SIMD");
+
+    level = supported;
+    if (force) {
+      if (strcmp(force, "scalar") == 0)
+        level = SIMD_SCALAR;
+      else if (strcmp(force, "sse") == 0 && supported >= SIMD_SSE)
+        level = SIMD_SSE;
+      else if (strcmp(force, "avx2") == 0 && supported >= SIMD_AVX2)
+        level = SIMD_AVX2;
+    }
+  }
+  return level;
+}
+
+
+const char *simdName(int level)
+{
+  switch (level) {
+  case SIMD_AVX2:
+    return "AVX2";
+  case SIMD_SSE:
+    return "SSE";
+  default:
+    return "scalar";
+  }
+}
+
+
+void *simdAlloc(size_t n)
+{
+#if defined(_MSC_VER)
+  return _aligned_malloc(n, SIMD_ALIGNMENT);
+#else
+  void *p;
+
+  if (posix_memalign(&p, SIMD_ALIGNMENT, n ? n : SIMD_ALIGNMENT) != 0)
+    return NULL;
+  return p;
+#endif
+}
+
+
+void simdFree(void *p)
+{
+#if defined(_MSC_VER)
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
@@ -0,0 +1,38 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+/* File: simd
+ * Description:
+ *   Runtime selection of the vector instruction set and aligned
+ *   allocation for the vectorized kernels
+ */
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+  #define SIMD_X86 1
+#endif
+
+#if defined(__GNUC__)
+  #define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+  #define SIMD_TARGET(isa)
+#endif
+
+// instruction sets, in increasing order of preference
+#define SIMD_SCALAR 0
+#define SIMD_SSE    1
+#define SIMD_AVX2   2
+
+#define SIMD_ALIGNMENT 64
+
+// best instruction set supported by this CPU, or the one forced by the
+// PHONG_SIMD environment variable (scalar, sse, avx2)
+int simdLevel();
+const char *simdName(int level);
+
+// allocate n bytes aligned to SIMD_ALIGNMENT, release with simdFree
+void *simdAlloc(size_t n);
+void simdFree(void *p);
+
+#endif
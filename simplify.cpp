@@ -0,0 +1,220 @@
+/* File: simplify
+ * Description:
+ *   Quadric error metric mesh simplification after M. Garland and
+ *   P. Heckbert, "Surface Simplification Using Quadric Error Metrics"
+ *   (1997), restricted to half-edge collapses: an edge (u, v) is removed
+ *   by moving u onto v. Every vertex keeps the area weighted sum of the
+ *   squared distances to the planes of its faces as a 4x4 quadric, and
+ *   the cheapest collapse by the summed quadrics of u and v goes first.
+ */
+
+#include <math.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+#include "simplify.h"
+
+
+// symmetric 4x4 matrix, upper triangle row by row
+struct Quadric {
+  double q[10];
+};
+
+
+static void addPlane(Quadric &Q, const double n[3], double d, double w)
+{
+  double p[4] = {n[0], n[1], n[2], d};
+  int k = 0;
+
+  for (int i = 0; i < 4; i++)
+    for (int j = i; j < 4; j++)
+      Q.q[k++] += w * p[i] * p[j];
+}
+
+
+static void addQuadric(Quadric &Q, const Quadric &R)
+{
+  for (int k = 0; k < 10; k++)
+    Q.q[k] += R.q[k];
+}
+
+
+// v^T Q v for the point v, w = 1
+static double quadricError(const Quadric &Q, const Vector3f v)
+{
+  double x = v[0], y = v[1], z = v[2];
+  const double *q = Q.q;
+
+  return q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x
+       + q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y
+       + q[7]*z*z + 2*q[8]*z
+       + q[9];
+}
+
+
+// unnormalized normal of the triangle a, b, c, twice its area long
+static void faceNormal(double n[3], const float *a, const float *b, const float *c)
+{
+  double u[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+  double v[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+
+  n[0] = u[1]*v[2] - u[2]*v[1];
+  n[1] = u[2]*v[0] - u[0]*v[2];
+  n[2] = u[0]*v[1] - u[1]*v[0];
+}
+
+
+// a collapse of u onto v, valid while the vertices keep their stamps
+struct Collapse {
+  double cost;
+  int u, v;
+  unsigned int stampU, stampV;
+
+  bool operator<(const Collapse &c) const { return cost > c.cost; }	// cheapest on top
+};
+
+
+int simplifyMesh(const Vector3f *vertices, int nv, const Index3i *faces, int nf,
+                 int targetFaces, Index3i *out)
+{
+  std::vector<Quadric> Q(nv);
+  std::vector<std::vector<int> > around(nv);	// faces around each vertex
+  std::vector<char> locked(nv, 0), removed(nv, 0), dead(nf, 0);
+  std::vector<unsigned int> stamp(nv, 0);
+  std::priority_queue<Collapse> heap;
+  int i, j, live = nf;
+
+  for (i = 0; i < nf; i++)
+    for (j = 0; j < 3; j++)
+      out[i][j] = faces[i][j];
+
+  for (i = 0; i < nv; i++)
+    for (j = 0; j < 10; j++)
+      Q[i].q[j] = 0.0;
+
+  for (i = 0; i < nf; i++) {
+    const int *f = out[i];
+    double n[3], len;
+
+    faceNormal(n, vertices[f[0]], vertices[f[1]], vertices[f[2]]);
+    len = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+    if (len > 0.0) {
+      double unit[3] = {n[0] / len, n[1] / len, n[2] / len};
+      double d = -(unit[0]*vertices[f[0]][0] + unit[1]*vertices[f[0]][1] + unit[2]*vertices[f[0]][2]);
+      for (j = 0; j < 3; j++)
+        addPlane(Q[f[j]], unit, d, 0.5 * len);
+    }
+    for (j = 0; j < 3; j++)
+      around[f[j]].push_back(i);
+  }
+
+  // edges used by other than two faces are borders (or worse), their
+  // vertices stay
+  std::vector<long long> edges;
+  edges.reserve(3 * (size_t)nf);
+  for (i = 0; i < nf; i++)
+    for (j = 0; j < 3; j++) {
+      long long a = out[i][j], b = out[i][(j+1)%3];
+      edges.push_back(a < b ? a * nv + b : b * nv + a);
+    }
+  std::sort(edges.begin(), edges.end());
+  for (size_t e = 0; e < edges.size(); ) {
+    size_t n = 1;
+    while (e + n < edges.size() && edges[e+n] == edges[e])
+      n++;
+    if (n != 2)
+      locked[edges[e] / nv] = locked[edges[e] % nv] = 1;
+    e += n;
+  }
+
+  // queue the cheaper direction of each edge that may collapse at all
+  auto push = [&](int a, int b) {
+    Quadric sum = Q[a];
+    addQuadric(sum, Q[b]);
+    double ab = locked[a] ? HUGE_VAL : quadricError(sum, vertices[b]);
+    double ba = locked[b] ? HUGE_VAL : quadricError(sum, vertices[a]);
+    if (ab == HUGE_VAL && ba == HUGE_VAL)
+      return;
+    Collapse c;
+    c.cost = ab <= ba ? ab : ba;
+    c.u = ab <= ba ? a : b;
+    c.v = ab <= ba ? b : a;
+    c.stampU = stamp[c.u];
+    c.stampV = stamp[c.v];
+    heap.push(c);
+  };
+  for (i = 0; i < nf; i++)
+    for (j = 0; j < 3; j++)
+      if (out[i][j] < out[i][(j+1)%3])
+        push(out[i][j], out[i][(j+1)%3]);
+
+  while (live > targetFaces && !heap.empty()) {
+    Collapse c = heap.top();
+    int u = c.u, v = c.v;
+
+    heap.pop();
+    if (removed[u] || removed[v] || stamp[u] != c.stampU || stamp[v] != c.stampV)
+      continue;
+
+    // moving u onto v must not turn any remaining face around
+    bool folds = false;
+    for (size_t a = 0; a < around[u].size() && !folds; a++) {
+      int f = around[u][a];
+      const int *t = out[f];
+      if (dead[f] || t[0] == v || t[1] == v || t[2] == v)
+        continue;
+
+      const float *p[3], *q[3];
+      for (j = 0; j < 3; j++) {
+        p[j] = vertices[t[j]];
+        q[j] = t[j] == u ? vertices[v] : p[j];
+      }
+      double n0[3], n1[3];
+      faceNormal(n0, p[0], p[1], p[2]);
+      faceNormal(n1, q[0], q[1], q[2]);
+      folds = n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2] <= 0.0;
+    }
+    if (folds)
+      continue;
+
+    // the faces on the edge vanish, the others move to v
+    for (size_t a = 0; a < around[u].size(); a++) {
+      int f = around[u][a];
+      int *t = out[f];
+      if (dead[f])
+        continue;
+      if (t[0] == v || t[1] == v || t[2] == v) {
+        dead[f] = 1;
+        live--;
+        continue;
+      }
+      for (j = 0; j < 3; j++)
+        if (t[j] == u)
+          t[j] = v;
+      around[v].push_back(f);
+    }
+    around[u].clear();
+    removed[u] = 1;
+    addQuadric(Q[v], Q[u]);
+    stamp[v]++;
+
+    // drop the dead faces around v and requeue its edges
+    std::vector<int> &av = around[v];
+    av.erase(std::remove_if(av.begin(), av.end(), [&](int f) { return dead[f] != 0; }), av.end());
+    for (size_t a = 0; a < av.size(); a++)
+      for (j = 0; j < 3; j++)
+        if (out[av[a]][j] != v)
+          push(v, out[av[a]][j]);
+  }
+
+  // keep the remaining faces in their order
+  int n = 0;
+  for (i = 0; i < nf; i++)
+    if (!dead[i]) {
+      for (j = 0; j < 3; j++)
+        out[n][j] = out[i][j];
+      n++;
+    }
+  return n;
+}
@@ -0,0 +1,21 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+/* File: simplify
+ * Description:
+ *   Quadric error metric mesh simplification by half-edge collapses
+ */
+
+typedef float Vector3f[3];
+typedef int Index3i[3];
+
+
+// Collapse edges of the nf faces until at most targetFaces are left or
+// nothing more can go without folding a face over. Vertices only ever
+// move onto another existing vertex, so the faces written to out (room
+// for nf) index the same vertex array. Border vertices stay in place.
+// Return the number of faces in out.
+int simplifyMesh(const Vector3f *vertices, int nv, const Index3i *faces, int nf,
+                 int targetFaces, Index3i *out);
+
+#endif
@@ -0,0 +1,152 @@
+/* File: threadPool
+ * Description:
+ *   Persistent pool of worker threads running data-parallel loops
+ */
+
+#include <stdlib.h>
+
+#include "threadPool.h"
+
+
+// set while a thread executes chunks, nested loops then run inline
+static thread_local bool insideJob = false;
+
+
+ThreadPool::ThreadPool(int nthreads)
+{
+  quit = false;
+  generation = 0;
+  active = 0;
+  job = NULL;
+  jobBegin = jobEnd = jobGrain = 0;
+  nextChunk = 0;
+
+  if (nthreads <= 0)
+    nthreads = defaultThreads();
+  start(nthreads - 1);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+  stop();
+}
+
+
+int ThreadPool::defaultThreads()
+{
+  const char *env = getenv("PHONG_THREADS");
+  int n = env ? atoi(env) : 0;
+
+  if (n <= 0)
+    n = (int)std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+
+void ThreadPool::resize(int nthreads)
+{
+  std::lock_guard<std::mutex> guard(submit);
+
+  if (nthreads <= 0)
+    nthreads = defaultThreads();
+  if (nthreads == size())
+    return;
+  stop();
+  start(nthreads - 1);
+}
+
+
+void ThreadPool::start(int nworkers)
+{
+  quit = false;
+  for (int i = 0; i < nworkers; i++)
+    workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+
+void ThreadPool::stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  wake.notify_all();
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+  workers.clear();
+}
+
+
+void ThreadPool::workerLoop()
+{
+  unsigned int seen = 0;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&] { return quit || generation != seen; });
+      if (quit)
+        return;
+      seen = generation;
+    }
+
+    runChunks();
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (--active == 0)
+        done.notify_one();
+    }
+  }
+}
+
+
+void ThreadPool::runChunks()
+{
+  int nchunks = (jobEnd - jobBegin + jobGrain - 1) / jobGrain;
+  int c;
+
+  insideJob = true;
+  while ((c = nextChunk.fetch_add(1)) < nchunks) {
+    int b = jobBegin + c * jobGrain;
+    int e = b + jobGrain < jobEnd ? b + jobGrain : jobEnd;
+    (*job)(b, e);
+  }
+  insideJob = false;
+}
+
+
+void ThreadPool::parallelFor(int begin, int end, int grain, const std::function<void(int, int)> &task)
+{
+  if (end <= begin)
+    return;
+  if (grain < 1)
+    grain = 1;
+
+  // not worth waking anybody up
+  if (workers.empty() || insideJob || end - begin <= grain) {
+    for (int b = begin; b < end; b += grain)
+      task(b, b + grain < end ? b + grain : end);
+    return;
+  }
+
+  std::lock_guard<std::mutex> serial(submit);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    job = &task;
+    jobBegin = begin;
+    jobEnd = end;
+    jobGrain = grain;
+    nextChunk = 0;
+    active = (int)workers.size();
+    generation++;
+  }
+  wake.notify_all();
+
+  runChunks();
+
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [&] { return active == 0; });
+  job = NULL;
+}
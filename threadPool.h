@@ -0,0 +1,57 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/* File: threadPool
+ * Description:
+ *   Persistent pool of worker threads running data-parallel loops
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class ThreadPool {
+public:
+
+  // nthreads counts the calling thread, 0 picks PHONG_THREADS or the
+  // number of hardware threads
+  ThreadPool(int nthreads = 0);
+  ~ThreadPool();
+
+  int size() const { return (int)workers.size() + 1; }
+  void resize(int nthreads);
+
+  // Call task(b, e) on consecutive chunks [b, e) of [begin, end). Chunk
+  // boundaries are begin + k*grain, so each chunk covers the same items
+  // no matter how many threads run. The caller works along and the
+  // call returns once every chunk is done.
+  void parallelFor(int begin, int end, int grain, const std::function<void(int, int)> &task);
+
+  static int defaultThreads();
+
+private:
+
+  void start(int nworkers);
+  void stop();
+  void workerLoop();
+  void runChunks();
+
+  std::vector<std::thread> workers;
+  std::mutex lock;		// guards the job fields below
+  std::condition_variable wake, done;
+  std::mutex submit;		// one parallelFor at a time
+  bool quit;
+  unsigned int generation;	// incremented for every new job
+  int active;			// workers still busy with the current job
+
+  // current job
+  const std::function<void(int, int)> *job;
+  int jobBegin, jobEnd, jobGrain;
+  std::atomic<int> nextChunk;
+};
+
+#endif